@@ -8,6 +8,9 @@
  */
 
 
+#ifdef ATA_SIM
+#include"ata_sim.h"
+#else
 #include"config.h"
 #include"types.h"
 #include"lib.h"
@@ -21,10 +24,17 @@
 #include"pci.h"
 #include"fs.h"
 #include"device.h"
+#endif
+#include"ata.h"
 
 
 enum{
 	TIME_OUT=2000,			/* Time out ms */
+	FLUSH_TIME_OUT=30000,	/* FLUSH CACHEのtime out ms */
+	SPIN_MAX=100,			/* これより短く完了するDMAはポーリングで待つ us */
+	SPIN_BYTES=0x2000,		/* ポーリングで待つDMAの最大バイト数 */
+	SPIN_SHIFT=3,			/* DMA完了時間の移動平均の重み 1/8 */
+	SPIN_RATIO=128,			/* SPIN_MAXより短く完了した割合がこれ以上ならポーリングする,256=100% */
 	IDENTIFY_SIZE=512,		/* ATA ATAPI identify buffer size */
 	ATA_SECTOR_SIZE=512,		/* ATA disk sector size */
 
@@ -51,6 +61,12 @@ enum{
 
 	/* Set features subcommand code */
 	SET_TRANSFER=0x3,	/* Set transfer mode */
+	SET_REL_INTR=0x5d,	/* Enable release interrupt */
+	SET_SRV_INTR=0x5e,	/* Enable SERVICE interrupt */
+	SET_WCACHE_ON=0x02,	/* Enable write cache */
+	SET_WCACHE_OFF=0x82,	/* Disable write cache */
+	SET_LOOKAHEAD_ON=0xaa,	/* Enable read look-ahead */
+	SET_LOOKAHEAD_OFF=0x55,	/* Disable read look-ahead */
 
 	/* Transfer mode of set features subcommand */
 	SUB_PIO_DEF=0x0,
@@ -71,6 +87,9 @@ enum{
 	U_DMA2=0x4,		/* Ultra DMA mode2 */
 	U_DMA1=0x2,		/* Ultra DMA mode1 */
 	U_DMA0=0x1,		/* Ultra DMA mode0 */
+	CBLID_BIT=0x2000,	/* 80芯ケーブル検出 bit in identify hard_reset_info */
+	ICRC_BIT=0x80,		/* Interface CRC error bit in error register */
+	ERR_DOWNGRADE=3,	/* 続けてこの回数エラーになったら転送モードを下げる */
 
 	/* Packet command features flag */
 	PACKET_DMA=0x1,		/* DMA transfer */
@@ -79,9 +98,18 @@ enum{
 	/* Conect device infomation */
 	ATA=1,
 	ATAPI=2,
-	PIO=1,		/* PIO transfer mode */
-	M_DMA=2,	/* Multi DMA transfer mode */
-	U_DMA=3,	/* Ultra DMA transfer mode */
+	PIO=ATA_PIO,		/* PIO transfer mode */
+	M_DMA=ATA_MDMA,		/* Multi DMA transfer mode */
+	U_DMA=ATA_UDMA,		/* Ultra DMA transfer mode */
+
+	/* 初期化で両方のホストに並べて出す設定コマンド */
+	INIT_PARAM=0,		/* INITIALIZE DEVICE PARAMETERS */
+	INIT_REL_INTR,		/* SET FEATURES release interrupt */
+	INIT_SRV_INTR,		/* SET FEATURES SERVICE interrupt */
+	INIT_MULTIPLE,		/* SET MULTIPLE MODE */
+	INIT_IDLE,			/* IDLE IMMEDIATE */
+	INIT_MODE,			/* SET FEATURES transfer mode */
+	INIT_STEP_NUM,
 
 	/* Interrupt mode */
 	INTR_DISABLE=0,
@@ -92,10 +120,36 @@ enum{
 	WRITE_DMA=1,	/* Write to fd */
 
 	/* Trasfer mode */
-	READ=0,
-	WRITE=1,
+	READ=ATA_READ,
+	WRITE=ATA_WRITE,
+	CTRL=2,					/* ホスト占有要求 */
+
+	/* Request flag */
+	REQ_PROC=0x1,			/* プロセスで処理する要求 */
+
+	/* Bus Master IDE Command register bit */
+	BMIC_START=0x1,			/* Start Bus Master */
+
+	/* Bus Master IDE Status register bit */
+	BMIS_ACT=0x1,			/* Bus Master IDE active */
+	BMIS_ERR=0x2,			/* Error */
+	BMIS_INTR=0x4,			/* Interrupt */
 
 	LBA_BIT=0x40,			/* LBA bit in Device_head register */
+	LBA48_BIT=0x400,		/* 48bit address feature set bit in identify cmd2 */
+	TCQ_BIT=0x2,			/* READ/WRITE DMA QUEUED bit in identify cmd2 */
+	REL_INTR_BIT=0x80,		/* Release interrupt bit in identify cmd1 */
+	SRV_INTR_BIT=0x100,		/* SERVICE interrupt bit in identify cmd1 */
+	WCACHE_SUP_BIT=0x20,	/* Write cache bit in identify cmd1 */
+	LOOKAHEAD_SUP_BIT=0x40,	/* Look-ahead bit in identify cmd1 */
+	FLUSH_SUP_BIT=0x1000,	/* FLUSH CACHE bit in identify cmd2 */
+	FLUSH_EXT_SUP_BIT=0x2000,	/* FLUSH CACHE EXT bit in identify cmd2 */
+	TCQ_MAX=8,				/* Max tags per host */
+	LBA28_MAX=0x10000000,	/* 28bit LBAで指定できるセクター数 */
+	ATA_COUNT_MAX=256,		/* Max sector count of 28bit command */
+	ATA_COUNT48_MAX=65536,	/* Max sector count of 48bit command */
+	ATAPI_COUNT_MAX=0xffff,	/* Max block count of READ(10),WRITE(10) */
+	CD_SPEED_MAX=0xffff,	/* SET CD SPEEDの最高速 */
 	ATAPI_LBA_BIT=0x200, 	/* LBA enable bit in ATAPI identify infomation */
 
 	/* IDE Bus Master IO register */
@@ -105,6 +159,32 @@ enum{
 	IDE_BMIDTP=0x4,			/* Bus Master IDE Descriptor Table Pointer register(4byte) */
 	IDE_BMIO_SECOND=0x8,	/* セカンダリーホストの場合にレジスター値にプラスする値 */
 	PRD_EOT=0x1<<31,		/* PRD EOT bit */
+	PRD_MAX=512,			/* PRD table entries per host */
+	PRD_BOUNDARY=0x10000,	/* PRDは64Kbyte境界を跨いではいけない */
+	BOUNCE_SIZE=0x10000,	/* DMAできないページ用のバウンスバッファー */
+	DMA_PAGE=0x1000,		/* ページサイズ */
+	PHYS_NONE=0xffffffff,	/* 物理アドレスに変換できない */
+	PG_PRESENT=0x1,			/* Page present bit */
+	PG_LARGE=0x80,			/* 4Mbyte page bit in PDE */
+	CR0_PG=0x80000000,		/* Paging enable bit */
+
+	/* IDE chipset family */
+	CHIP_INTEL=0,			/* Intel PIIX,ICH */
+	CHIP_VIA,				/* VIA,AMD */
+	CHIP_SIS,				/* SiS */
+	CHIP_FAMILY_NUM,
+
+	/* IDE chipset flag */
+	CHIP_PIO32=0x1,			/* データポートへの32bitアクセスができる */
+
+	/* Conect device flag */
+	PIO32_BIT=0x10000,		/* 32bit PIO data transfer */
+	WCACHE_BIT=0x20000,		/* Write cache enabled */
+	LOOKAHEAD_BIT=0x40000,	/* Read look-ahead enabled */
+	MEDIA_BIT=0x80000,		/* ATAPIのsector_sizeとall_sectorsが今のメディアのもの */
+	NO_GESN_BIT=0x100000,	/* GET EVENT STATUS NOTIFICATIONが使えない */
+	STREAM_BIT=0x200000,	/* ATAPIのストリーミング読み込み */
+	WBACK_BIT=0x400000,		/* キャッシュに書いて後で書き戻す,なければwrite-through */
 
 	/* ATAPI function flag */
 	PACK_OVL=0x2,			/* Packet feature overlappe flag */
@@ -116,6 +196,43 @@ enum{
 	SSU_START=0x1,			/* Disk start */
 	SSU_EJECT=0x2,			/* Disk eject */
 	SSU_STANBY=0x30,		/* Stanby */
+
+	/* ATAPI media check */
+	MEDIA_RETRY_MAX=10,		/* 準備完了を待つTEST UNIT READYの最大回数 */
+	MEDIA_WAIT_MIN=100,		/* 起動中に待つ最初の時間 ms,1回ごとに倍にする */
+	MEDIA_WAIT_MAX=1000,	/* 起動中に待つ最大の時間 ms */
+	GESN_MEDIA_CLASS=0x10,	/* GET EVENT STATUS NOTIFICATION media class bit */
+	GESN_NEA=0x80,			/* No event available bit */
+	GESN_PRESENT=0x2,		/* Media present bit in media status */
+
+	/* Interrupt trace */
+	TRACE_SIZE=256,			/* Records per CPU,2のべき乗 */
+	TRACE_CPU=16,			/* Traced CPUs */
+
+	/* Buffer cache */
+	CACHE_BLK_SIZE=0x1000,	/* Cache block bytes,DMAバッファープールの1ページ */
+	CACHE_BLOCKS=128,		/* Cache blocks per host */
+	CACHE_HASH=64,			/* Hash table size */
+	CACHE_BYPASS=128,		/* これ以上のセクター数の転送はキャッシュを通さない */
+	DIRTY_EXPIRE=5000,		/* これより古いdirtyブロックは次のhdXの読み書きで書き戻す ms */
+	DIRTY_MAX=CACHE_BLOCKS/2,	/* これ以上dirtyブロックがあれば古い順に書き戻す */
+	FLUSH_INTERVAL=100,		/* 書き戻しを調べる間隔 ms */
+	WRITEBACK_MAX=16,		/* 同時に書き戻すブロック数 */
+	RA_MIN=16,				/* 先読みの最小セクター数 */
+	RA_MAX=256,				/* 先読みの最大セクター数 */
+
+	/* DMA buffer pool */
+	DMA_POOL_BLOCKS=CACHE_BLOCKS+8,	/* ホストごとのページ数,キャッシュと初期化やATAPIの小さな転送用 */
+	READAHEAD_MAX=32,		/* 同時に先読みするブロック数 */
+
+	/* ATAPI streaming read */
+	STREAM_SIZE=0x10000,	/* 1バッファーのbyte,READ(12)1回で読む */
+
+	/* Elevator default parameters */
+	READ_EXPIRE=500,		/* Read deadline ms */
+	WRITE_EXPIRE=5000,		/* Write deadline ms */
+	RT_EXPIRE=100,			/* Realtime deadline ms */
+	IDLE_EXPIRE=2000,		/* Idleの飢餓防止の期限ms */
 };
 
 
@@ -190,7 +307,9 @@ typedef struct{
 	ushort	pmm_value;			/* 91 ATA only */
 	ushort	pass_rev_coad;		/* 92 ATA only */
 	ushort	hard_reset_info;	/* 93 */
-	ushort	reserv6[32];		/* 94 */
+	ushort	reserv6[6];			/* 94 */
+	ushort	lba48_all_sect[4];	/* 100 ATA only */
+	ushort	reserv7[22];		/* 104 */
 	ushort	atapi_byte_count;	/* 126 ATAPI only */
 	ushort	remov_set;			/* 127 */
 	ushort	secu_stat;			/* 128 */
@@ -210,6 +329,8 @@ typedef struct{
 /* Packet command parameters */
 typedef struct{
 	void *buf;			/* Block read write buffer */
+	ATA_SEG *seg;		/* Scatter gather buffer,NULLならbufを使う */
+	int nseg;			/* Number of segments */
 	int size;			/* Transfer bytes or Secter size */
 	uchar feutures;		/* Packet command flag */
 	uchar packet[14];	/* Packet command parameters and return packet */
@@ -220,11 +341,145 @@ typedef struct{
 	int type;				/* ATA=1 or ATAPI=2 */
 	int mode;				/* PIO=0,Multi DMA=1,Ultra DMA=2 */
 	int sector_size;		/* Secter size */
-	uint all_sectors;		/* LBA all sectors */
+	uint64 all_sectors;		/* LBA all sectors */
+	int max_count;			/* Max sectors per command */
 	int flag;				/* Function flag */
-	int (*transfer)(int,int,int,void*,int,uint); /* Tranfer function */
+	int multiple;			/* READ/WRITE MULTIPLEの1ブロックのセクター数,0なら使わない */
+	int tcq_depth;			/* TCQのキューの深さ,0ならTCQ未対応 */
+	int xfer;				/* 設定した転送モード(SET FEATURESの値) */
+	int udma_mask;			/* 使ってもよいULTRA DMAモード */
+	int err_count;			/* 続いたCRCエラーとタイムアウトの数 */
+	int downgrade;			/* 転送モードを下げる必要がある */
+	int (*transfer)(int,int,int,ATA_SEG*,int,int,uint); /* Tranfer function */
 }CONECT_DEV;
 
+/* Request queue */
+typedef struct{
+	ATA_REQ *head;			/* Device,LBA順のキュー */
+	ATA_REQ *cur;			/* 転送中の要求,NULLならホストは空き */
+	ATA_SEG *seg;			/* 転送中の要求のセグメントリスト */
+	int nseg;				/* Number of segments */
+	uint bytes;				/* 転送中の要求の全バイト数 */
+	uint done;				/* 転送済みバイト数 */
+	uint size;				/* 発行中のコマンドのバイト数 */
+	uint64 time;			/* コマンドを発行したclock */
+	uint64 start;			/* 転送中の要求を取り出したclock */
+	int intr;				/* 割り込みで完了させるコマンドを発行中 */
+	int last_dev;			/* 最後に転送したデバイス */
+	uint pos[2];			/* 最後に転送したセクターの次(ヘッド位置) */
+	ATA_SCHED param;		/* Elevator parameters */
+	ATA_SCHED_STAT stat;	/* Elevator statistics */
+	ATA_REQ *tag[TCQ_MAX];	/* TCQで発行中の要求 */
+	uint64 tag_start[TCQ_MAX];	/* TCQで発行したclock */
+	int ntag;				/* TCQで発行中の要求数 */
+	int tcq_dev;			/* TCQで発行中のデバイス */
+	int tcq_cur;			/* バスを使っているtag,-1ならバスは空き,TCQ_MAXなら発行中か割り込み処理中 */
+	ATA_REQ *ovl;			/* バスを解放してSERVICEを待っているoverlapのATAPI要求 */
+	uint ovl_done;			/* ovlの転送済みバイト数 */
+	uint64 ovl_start;		/* ovlを取り出したclock */
+	uint64 ovl_time;		/* ovlがバスを解放したclock */
+	int srv_intr;			/* ovlのSERVICEを調べている間にstart_queue()が呼ばれた */
+}REQ_QUEUE;
+
+/* Interrupt trace ring */
+typedef struct{
+	volatile uint head;			/* 割り込みハンドラーだけが進める */
+	volatile uint tail;			/* 読み出し側だけが進める */
+	volatile uint lost;			/* 満杯で捨てたレコード数,割り込みハンドラーだけが増やす */
+	uint lost_read;				/* 読み出し側が最後に見たlost */
+	ATA_TRACE rec[TRACE_SIZE];
+}TRACE_RING;
+
+/* Cache block */
+typedef struct CACHE_BLK{
+	struct CACHE_BLK *hnext;	/* Hash link */
+	struct CACHE_BLK *prev;		/* LRU link */
+	struct CACHE_BLK *next;		/* LRU link */
+	int dev;					/* Device number */
+	uint block;					/* Cache block number */
+	uint valid;					/* 有効なセクターのビット */
+	uint dirty;					/* 書き戻しが必要なセクターのビット */
+	uint io_mask;				/* 転送中のセクターのビット */
+	int io;						/* 転送中の方向 READ=先読み,WRITE=書き戻し */
+	int ra;						/* 先読みしてまだ使われていない */
+	int gen;					/* 書き込み世代 */
+	int wb_gen;					/* 書き戻しを始めた時の世代 */
+	volatile int io_done;		/* 転送完了 */
+	int io_error;				/* 転送の結果 */
+	uint64 time;				/* dirtyになったclock */
+	char *buf;					/* Cache buffer */
+	ATA_SEG seg;				/* 非同期転送用 */
+	ATA_REQ req;				/* 非同期転送用 */
+}CACHE_BLK;
+
+/* Sequential stream */
+typedef struct{
+	uint next;					/* 次に来ると予想するセクター */
+	uint end;					/* 先読みを出したセクターの終わり */
+	uint window;				/* 先読みするセクター数 */
+}RA_STREAM;
+
+/* Buffer cache */
+typedef struct{
+	WAIT_QUEUE lock;			/* Cache lock */
+	CACHE_BLK *blk;				/* Cache blocks */
+	int num;					/* Number of cache blocks,0ならキャッシュしない */
+	CACHE_BLK *hash[CACHE_HASH];	/* Hash table */
+	CACHE_BLK *lru_head;		/* 最近使ったブロック */
+	CACHE_BLK *lru_tail;		/* 一番使われていないブロック */
+	int ndirty;					/* Dirty blocks */
+	int writing;				/* 書き戻し中のブロック数 */
+	int reading;				/* 先読み中のブロック数 */
+	volatile int io_complete;	/* 非同期転送完了数 */
+	int io_reaped;				/* 後処理した非同期転送完了数 */
+	uint64 flush_time;			/* 最後に書き戻しを調べたclock */
+	WAIT_INTR flush_wait;		/* 非同期転送完了待ち */
+	RA_STREAM ra[2];			/* Device stream */
+	ATA_CACHE_STAT stat[2];		/* Statistics */
+}BLK_CACHE;
+
+/* ATAPI streaming read */
+typedef struct{
+	WAIT_QUEUE lock;			/* Stream lock */
+	char *buf[2];				/* 交互に読み込むバッファー */
+	uint begin[2];				/* バッファーの先頭セクター */
+	uint count[2];				/* バッファーのセクター数,0なら空 */
+	int busy[2];				/* 読み込み中 */
+	uint next;					/* 次に読み込むセクター */
+	int stale;					/* メディアが変わったか書き込んだので、バッファーを捨てる */
+	ATA_SEG seg[2];				/* 非同期転送用 */
+	ATA_REQ req[2];				/* 非同期転送用 */
+}ATAPI_STREAM;
+
+/* 短いDMAコマンドの完了時間の履歴 */
+typedef struct{
+	uint fast;					/* SPIN_MAXより短く完了したコマンドの平均clock,0なら未測定 */
+	uint ratio;					/* SPIN_MAXより短く完了した割合の移動平均,256=100% */
+}DMA_HIST;
+
+/* DMA buffer pool */
+typedef struct{
+	char *mem;					/* kmallocした領域 */
+	void *free;					/* 空きページのリスト,ページの先頭に次のページを入れる */
+	int num;					/* 空きページ数 */
+	int min;					/* 空きページ数の最小値 */
+}DMA_POOL;
+
+/* IDE chipset */
+typedef struct{
+	uint id;			/* PCI device id|vender id */
+	int family;			/* Register layout */
+	uchar udma;			/* 使えるULTRA DMAモードのビット */
+	uchar udma_val[7];	/* ULTRA DMAモードごとのタイミングレジスタ値 */
+	uchar flag;			/* CHIP_PIO32 */
+}IDE_CHIP;
+
+/* Chipset family timing */
+typedef struct{
+	ushort pio[5];		/* PIO mode0-4のタイミングレジスタ値 */
+	ushort mdma[3];		/* Multi DMA mode0-2のタイミングレジスタ値 */
+}CHIP_TIMING;
+
 /* Physical Region Descriptor for IDE Busmaster */
 typedef struct{
 	void *phys_addr;	/* Physical address */
@@ -243,51 +498,215 @@ static ATA_REG reg[2]={
 		SECN_BASE+5,SECN_BASE+5,SECN_BASE+6,SECN_BASE+7,SECN_BASE+7,SECN_BASE+0x206,SECN_BASE+0x206
 	}
 };
+static ID_INFO dev_id[2][2];						/* Identify infomation */
 static CONECT_DEV conect_dev[2][2]={			/* Conect device infomation */
-	{{0,0,0,0,0,NULL},{0,0,0,0,0,NULL}},
-	{{0,0,0,0,0,NULL},{0,0,0,0,0,NULL}}
+	{{0,0,0,0,0,0,0,0,0,0,0,0,NULL},{0,0,0,0,0,0,0,0,0,0,0,0,NULL}},
+	{{0,0,0,0,0,0,0,0,0,0,0,0,NULL},{0,0,0,0,0,0,0,0,0,0,0,0,NULL}}
 };
 static int current_intr[2];						/* Current host interrupt mode,enable=1 or diable=0 */
 static uint64 time_out;							/* Time out counts */
+static uint64 spin_max;							/* ポーリングする最大clock */
+static DMA_HIST dma_hist[2][2];					/* 短いDMAコマンドの完了時間の履歴 */
+static uint64 intr_clock[2];					/* 最後の割り込みのclock */
+static volatile int spinning[2];				/* DMAの完了をポーリング中 */
 static WAIT_INTR wait_intr_queue[2]={			/* 割り込み待ち用 */
 	{NULL,0},{NULL,0}
 };
-static WAIT_QUEUE wait_queue[2]={				/* 処理待ち用Wait queue */
-	{NULL,(PROC*)&wait_queue[0],0,0},
-	{NULL,(PROC*)&wait_queue[1],0,0}
-};
+static int queue_lock[2];						/* 要求キューのロック */
 static int ide_base[2];							/* IDE Bus Master IO base address */
 static uchar irq_num[2]={PRIM_IRQ,SECOND_IRQ};	/* IRQ number */
-static PRD prd[2];								/* Physical Region Descriptor */
+static PRD prd[2][PRD_MAX]						/* Physical Region Descriptor table */
+	__attribute__((aligned(PRD_MAX*sizeof(PRD))));
+static DMA_POOL dma_pool[2];					/* DMA buffer pool */
+static char bounce_buf[2][BOUNCE_SIZE]			/* Bounce buffer */
+	__attribute__((aligned(BOUNCE_SIZE)));
+static ATA_SEG bounce_seg[2][PRD_MAX];			/* 読み込み後にバウンスバッファーからコピーする領域 */
+static int bounce_num[2];
+static ATA_SEG chunk_seg[2][PRD_MAX];			/* 分割したコマンドのセグメントリスト */
+static ATA_SEG merge_seg[2][PRD_MAX];			/* まとめた要求のセグメントリスト */
+static ATA_DEV_STAT dev_stat[2][2];				/* Device statistics */
+static int dev_prio[2][2];						/* hdXの入口から来る要求のI/O priority class */
+static TRACE_RING trace_ring[TRACE_CPU];			/* CPUごとの割り込みトレース */
+static int trace_on=1;							/* Interrupt trace enable */
+static WAIT_QUEUE trace_lock={NULL,(PROC*)&trace_lock,0,0};	/* 読み出し側のロック */
+static IDE_CHIP ide_chip[]={						/* Supported IDE chipset */
+	{0x27DF8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH7 */
+	{0x266F8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH6 */
+	{0x24DB8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH5 */
+	{0x25A28086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel 6300ESB */
+	{0x24CB8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH4 */
+	{0x24CA8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH4 mobile */
+	{0x248a8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH3 mobile */
+	{0x248b8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH3 */
+	{0x244a8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH2 mobile */
+	{0x244b8086,CHIP_INTEL,0x3f,{0x00,0x01,0x02,0x11,0x12,0x21},CHIP_PIO32},	/* Intel ICH2 */
+	{0x24118086,CHIP_INTEL,0x1f,{0x00,0x01,0x02,0x11,0x12},CHIP_PIO32},			/* Intel ICH */
+	{0x76018086,CHIP_INTEL,0x1f,{0x00,0x01,0x02,0x11,0x12},CHIP_PIO32},			/* Intel ICH */
+	{0x24218086,CHIP_INTEL,0x07,{0x00,0x01,0x02},CHIP_PIO32},					/* Intel ICH0 */
+	{0x71118086,CHIP_INTEL,0x07,{0x00,0x01,0x02},CHIP_PIO32},					/* Intel PIIX4 */
+	{0x84CA8086,CHIP_INTEL,0x07,{0x00,0x01,0x02},CHIP_PIO32},					/* Intel PIIX4 */
+	{0x71998086,CHIP_INTEL,0x07,{0x00,0x01,0x02},CHIP_PIO32},					/* Intel PIIX4e */
+	{0x74411022,CHIP_VIA,0x3f,{0xc2,0xc1,0xc0,0xc4,0xc5,0xc6},CHIP_PIO32},		/* AMD 768 */
+	{0x74111022,CHIP_VIA,0x3f,{0xc2,0xc1,0xc0,0xc4,0xc5,0xc6},CHIP_PIO32},		/* AMD 766 */
+	{0x74091022,CHIP_VIA,0x1f,{0xc2,0xc1,0xc0,0xc4,0xc5},CHIP_PIO32},			/* AMD 756 */
+	{0x31471106,CHIP_VIA,0x7f,{0xf7,0xf7,0xf6,0xf4,0xf2,0xf1,0xf0},CHIP_PIO32},	/* VIA 8233a */
+	{0x06861106,CHIP_VIA,0x3f,{0xf7,0xf6,0xf4,0xf2,0xf1,0xf0},CHIP_PIO32},		/* VIA 82C686b */
+	{0x82311106,CHIP_VIA,0x3f,{0xf7,0xf6,0xf4,0xf2,0xf1,0xf0},CHIP_PIO32},		/* VIA 8231 */
+	{0x30741106,CHIP_VIA,0x3f,{0xf7,0xf6,0xf4,0xf2,0xf1,0xf0},CHIP_PIO32},		/* VIA 8233 */
+	{0x31091106,CHIP_VIA,0x3f,{0xf7,0xf6,0xf4,0xf2,0xf1,0xf0},CHIP_PIO32},		/* VIA 8233c */
+	{0x05961106,CHIP_VIA,0x1f,{0xee,0xec,0xea,0xe9,0xe8},CHIP_PIO32},			/* VIA 82C596b */
+	{0x05861106,CHIP_VIA,0x07,{0xc2,0xc1,0xc0},CHIP_PIO32},						/* VIA 82C586b */
+	{0x05711106,CHIP_VIA,0x00,{0},CHIP_PIO32},									/* VIA 82C571,Multi DMAまで */
+	{0x55131039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 5591 */
+	{0x06301039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 630 */
+	{0x06331039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 633 */
+	{0x06351039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 635 */
+	{0x06401039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 640 */
+	{0x06451039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 645 */
+	{0x06501039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 650 */
+	{0x07301039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 730 */
+	{0x07331039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 733 */
+	{0x07351039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 735 */
+	{0x07401039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 740 */
+	{0x07451039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 745 */
+	{0x07501039,CHIP_SIS,0x34,{0,0,0xb0,0,0x90,0x80},0},						/* SiS 750 */
+	{0x05301039,CHIP_SIS,0x14,{0,0,0xa0,0,0x90},0},								/* SiS 530 */
+	{0x05401039,CHIP_SIS,0x14,{0,0,0xa0,0,0x90},0},								/* SiS 540 */
+	{0x06201039,CHIP_SIS,0x14,{0,0,0xa0,0,0x90},0},								/* SiS 620 */
+	{0}
+};
+static CHIP_TIMING chip_timing[CHIP_FAMILY_NUM]={	/* PIO,Multi DMA timing */
+	{{0x0000,0x0000,0x1000,0x2100,0x2300},{0x0000,0x2100,0x2300}},	/* Intel ISP<<12|RTC<<8 */
+	{{0x00a8,0x0065,0x0042,0x0022,0x0020},{0x00a8,0x0022,0x0020}},	/* VIA active<<4|recovery */
+	{{0x0000,0x0607,0x0404,0x0303,0x0301},{0x0008,0x0302,0x0301}}	/* SiS recovery<<8|active */
+};
+static BLK_CACHE cache[2]={						/* Buffer cache */
+	{{NULL,(PROC*)&cache[0].lock,0,0}},
+	{{NULL,(PROC*)&cache[1].lock,0,0}}
+};
+static ATAPI_STREAM atapi_stream[2][2]={		/* ATAPI streaming read */
+	{{{NULL,(PROC*)&atapi_stream[0][0].lock,0,0}},{{NULL,(PROC*)&atapi_stream[0][1].lock,0,0}}},
+	{{{NULL,(PROC*)&atapi_stream[1][0].lock,0,0}},{{NULL,(PROC*)&atapi_stream[1][1].lock,0,0}}}
+};
+static REQ_QUEUE req_queue[2]={					/* Request queue */
+	{NULL,NULL,NULL,0,0,0,0,0,0,0,0,{0,0},{1,0,READ_EXPIRE,WRITE_EXPIRE,0,RT_EXPIRE,IDLE_EXPIRE},{0,0,0,0,0,0,0},{NULL},{0},0,0,-1,NULL,0,0,0,0},
+	{NULL,NULL,NULL,0,0,0,0,0,0,0,0,{0,0},{1,0,READ_EXPIRE,WRITE_EXPIRE,0,RT_EXPIRE,IDLE_EXPIRE},{0,0,0,0,0,0,0},{NULL},{0},0,0,-1,NULL,0,0,0,0}
+};
 
 
 static int check_busy(int);
 static void set_intr(int,int);
+static void trace_intr(int,uchar);
+static int read_trace(ATA_TRACE_READ*);
 static int prim_intr_handler();
 static int second_intr_handler();
+static int prepare_mode(int,int,int,uchar*);
 static int change_mode(int,int,int);
-static int read_pio(int,int,void*,int,int);
-static int write_pio(int,int,void*,int,int);
-static int read_dma(int,int,void*,int,int);
-static int write_dma(int,int,void*,int,int);
+static void downgrade_mode(int,int);
+static int set_mode(int,int,int);
+static void check_error(int,int,int);
+static int wait_pio(int);
+static int read_pio(int,int,ATA_SEG*,int,int,uint);
+static int write_pio(int,int,ATA_SEG*,int,int,uint);
+static uint virt_to_phys(uint);
+static int need_bounce(uint,uint,uint*,int*);
+static int set_prd(int,ATA_SEG*,int,int);
+static void start_dma(int,int);
+static void init_dma_pool(int);
+static void *alloc_dma_buf(int);
+static void free_dma_buf(int,void*);
+static int end_dma(int);
+static void update_dma_hist(int,int,uint,uint64);
+static int spin_dma(int,int,uint,WAIT_INTR*,uint64*);
+static int wait_dma(int,int,uint);
+static int read_dma(int,int,ATA_SEG*,int);
+static int write_dma(int,int,ATA_SEG*,int);
 static int init_ide_busmaster(int,PCI_INFO*);
+static IDE_CHIP *find_chipset(uint);
+static void change_pci_config(PCI_INFO*,int,uint,uint);
+static void set_chip_timing(IDE_CHIP*,PCI_INFO*,int,int,int,int);
 static int reset_host(int);
+static int setup_device(int,int,int,ID_INFO*);
+static int issue_init_step(int,int,int,int*,uchar*);
+static void end_init_step(int,int,int,int,uchar,int);
 static char *cnv_idinfo_str(char*,int);
 static int soft_reset();
 static int device_select(int,int);
-static int _transfer_ata(int,int,int,void*,int,uint);
+static int issue_ata(int,int,int,ATA_SEG*,int,int,uint);
+static int _transfer_ata(int,int,int,ATA_SEG*,int,int,uint);
 static int reset_device(int,int);
-static int identify_device(int,int,int,void*);
-static int idle_immediate_device(int,int);
-static int init_device_param(int,int,uchar,uchar);
+static int issue_identify(int,int,int);
+static int read_identify(int,int,void*);
+static int issue_nodata(int,int,uchar,uchar,uchar);
+static int wait_nodata(int,const char*);
+static int set_multiple(int,int,int);
 static int set_features(int,int,uchar,uchar);
+static int set_drive_cache(int,int,int,int);
+static int flush_device(int,int);
 static int issue_packet_command(int,int,PACKET_PARAM*);
 static int test_unit_ready(int,int);
 static int request_sense(int,int);
+static int media_event(int,int);
 static int start_stop_unit(int,int,uchar);
 static int read_capacity(int,int);
-static int _transfer_atapi(int,int,int,void*,int,uint);
+static int set_cd_speed(int,int,uint);
+static void set_rw_packet(int,int,int,int,uint,uchar*);
+static int issue_atapi(int,int,int,ATA_SEG*,int,int,uint);
+static int _transfer_atapi(int,int,int,ATA_SEG*,int,int,uint);
+static int make_chunk(int,ATA_SEG*,int,uint,uint,uint,uint*);
+static int do_transfer(int,int,int,ATA_SEG*,int,uint,uint);
+static void insert_request(int,ATA_REQ*);
+static ATA_REQ *pick_request(int);
+static void set_request_seg(int);
+static int issue_request(int);
+static int preempt_request(int);
+static int release_atapi(int);
+static int service_atapi(int);
+static void account_request(int,ATA_REQ*,int,uint64,uint64);
+static void complete_request(int,ATA_REQ*,int);
+static void end_request(int,int);
+static int prd_count(ATA_SEG*,int);
+static ATA_REQ *pick_tcq(int,int*);
+static int issue_tcq(int,int);
+static void end_tcq(int,int,int);
+static void abort_tcq(int,int);
+static int service_tcq(int);
+static void intr_tcq(int);
+static void start_queue(int);
+static void intr_request(int);
+static void check_timeout(int);
+static int queue_request(int,ATA_REQ*);
+static int wait_request(int,ATA_REQ*);
+static void lock_host(int,int,ATA_REQ*);
+static void unlock_host(int,ATA_REQ*);
+static void requeue_mode(int,int);
+static int transfer_sg(int,int,int,ATA_SEG*,int,size_t);
+static int ioctl_ata(int,int,int,void*);
+static int ioctl_drive_cache(int,int,int,int);
 static int transfer(int,int,int,void*,size_t,size_t);
+static CACHE_BLK *find_cache(int,int,uint);
+static void touch_cache(int,CACHE_BLK*);
+static void unhash_cache(int,CACHE_BLK*);
+static void reap_cache(int,int);
+static void wait_cache_io(int);
+static void cache_io_done(ATA_REQ*);
+static void dirty_run(CACHE_BLK*,int*,int*);
+static void start_writeback(int,CACHE_BLK*);
+static int write_cache_blk(int,CACHE_BLK*);
+static void flush_cache(int);
+static CACHE_BLK *alloc_cache(int,int,uint,int);
+static int fill_cache(int,CACHE_BLK*);
+static void start_readahead(int,CACHE_BLK*);
+static void readahead(int,int,uint,uint);
+static int sync_range(int,int,uint,uint,int);
+static int cache_transfer(int,int,int,void*,size_t,size_t);
+static int direct_transfer(int,int,int,ATA_SEG*,int,size_t);
+static void init_cache(int);
+static int start_stream(int,int,int);
+static int wait_stream(int,int,int);
+static void drop_stream(int,int);
+static int read_stream(int,int,void*,size_t,size_t);
+static int set_stream(int,int,int);
 static int test_atapi(int,int);
 static int open_hda();
 static int open_hdb();
@@ -314,1221 +733,4444 @@ static DEV_INFO hd_info[2][2]={
 
 
 /*
- * Data transfer
- * parameters : Host number,Device number,Mode=READ or WRITE,buffer,Transfer blocks,begin block
- * return : Transfer size or Error number
+ * 1コマンド分のセグメントリストを作る
+ * セグメントリストのdoneバイト目から最大maxバイトを、PRDテーブルとバウンスバッファーに収まる範囲で
+ * chunk_segに切り出す。PRDはページごとに1エントリーとして数える。切れ目はセクター境界に合わせる。
+ * parameters : Host number,Segment list,Number of segments,Done bytes,Max bytes,Sector size,Return chunk bytes
+ * return : Number of chunk segments
  */
-extern inline int transfer(int host,int dev,int mode,void *buf,size_t blocks,size_t begin)
+int make_chunk(int host,ATA_SEG *seg,int nseg,uint done,uint max,uint sector_size,uint *bytes)
 {
-	int error;
-	int rest;
+	ATA_SEG *chunk;
+	uint addr,len,piece,phys,prd_rest,bounce,rest;
+	int odd;
+	int i,n;
 
 
-	if(blocks==0)return 0;
-	if(begin+blocks>conect_dev[host][dev].all_sectors)return PRINT_ERR(EINVAL,"transfer");
+	chunk=chunk_seg[host];
+
+	/* 開始セグメントを探す */
+	for(i=0;(i<nseg)&&(done>=seg[i].size);++i)done-=seg[i].size;
 
-	wait_proc(&wait_queue[host]);
+	*bytes=0;
+	odd=0;
+	for(n=0,prd_rest=PRD_MAX,bounce=0;(i<nseg)&&(*bytes<max)&&(prd_rest>0);++i,done=0)
 	{
-		/* SMPなら割り込みが同じcpuに発生するようにする */
-		if(MFPS_addres)set_intr_cpu(irq_num[host],get_current_cpu());
+		addr=(uint)seg[i].addr+done;
+		len=seg[i].size-done;
+		if(len>max-*bytes)len=max-*bytes;
+		if(len==0)continue;
+
+		/*
+		 * PRDテーブルやバウンスバッファーに入りきらない分は次のコマンドにまわす
+		 * セクター境界で切り詰めると最後のページがバウンスになることがあるので1ページ残しておく
+		 */
+		for(rest=len;rest>0;rest-=piece,--prd_rest)
+		{
+			piece=DMA_PAGE-((addr+len-rest)&(DMA_PAGE-1));
+			if(piece>rest)piece=rest;
+			if((prd_rest==0)||
+				(need_bounce(addr+len-rest,piece,&phys,&odd)&&((bounce+=piece)>BOUNCE_SIZE-DMA_PAGE)))break;
+		}
+		len-=rest;
+		if(len==0)break;
+
+		chunk[n].addr=(void*)addr;
+		chunk[n].size=len;
+		*bytes+=len;
+		++n;
+		if(rest>0)break;
+	}
 
-		/* 転送開始 */
-		if((error=conect_dev[host][dev].transfer(host,dev,mode,buf,blocks,begin))!=0)rest=error;
-		else rest=blocks;
+	/* セクター境界に合わせる */
+	for(rest=*bytes%sector_size;rest>0;)
+	{
+		if(chunk[n-1].size>rest)
+		{
+			chunk[n-1].size-=rest;
+			break;
+		}
+		rest-=chunk[--n].size;
 	}
-	wake_proc(&wait_queue[host]);
+	*bytes=ROUNDDOWN(*bytes,sector_size);
 
-	return rest;
+	return n;
 }
 
 
 /*
- * Check busy flag in status register
- * parameters : Stat register,Mask,Compare rest value
- * return : Status value
+ * Data transfer to device
+ * 1コマンドで転送できないサイズはコマンドを分割する
+ * parameters : Host number,Device number,Mode=READ or WRITE,Segment list,Number of segments,Transfer blocks,begin block
+ * return : 0 or Error number
  */
-int check_busy(int str)
+int do_transfer(int host,int dev,int mode,ATA_SEG *seg,int nseg,uint blocks,uint begin)
 {
-	uchar in;
-	uint64 count;
+	CONECT_DEV *cd;
+	uint bytes,done,size,max;
+	int nchunk;
+	int error;
 
 
-	count=rdtsc();
-	while((in=inb(str))&BSY_BIT)
-		if(rdtsc()-count>time_out)return in;
+	cd=&conect_dev[host][dev];
+	bytes=blocks*cd->sector_size;
+	max=cd->max_count*cd->sector_size;
 
-	return in;
+	/* SMPなら割り込みが同じcpuに発生するようにする */
+	if(MFPS_addres)set_intr_cpu(irq_num[host],get_current_cpu());
+
+	for(done=0;done<bytes;done+=size)
+	{
+		nchunk=make_chunk(host,seg,nseg,done,max,cd->sector_size,&size);
+		if(size==0)return PRINT_ERR(EINVAL,"do_transfer");
+
+		if((error=cd->transfer(host,dev,mode,chunk_seg[host],nchunk,size/cd->sector_size,begin+done/cd->sector_size))!=0)
+			return error;
+	}
+
+	return 0;
 }
 
 
+/************************************************************************************************
+ *
+ * Request queue
+ *
+ ************************************************************************************************/
+
+
 /*
- * Set interrupt mode
- * parameters : Host,Interrupt mode
+ * 要求キューのロック
+ * 割り込みハンドラーからも操作するので、割り込みを禁止してからロックする
+ * parameters : Host number
+ * return : eflags
  */
-void set_intr(int host,int flag)
+static inline uint enter_queue(int host)
 {
-	if(flag==current_intr[host])return;
+	uint eflags;
+	int lock;
 
-	if(flag==INTR_DISABLE)
-	{
-		set_irq_mask(irq_num[host]);
-		outb(reg[host].ctr,0x2);			/* Disable interrupt */
-		mili_timer(5);						/* wait */
-		current_intr[host]=INTR_DISABLE;
-	}
-	else
+
+#ifdef ATA_SIM
+	eflags=sim_cli();
+#else
+	asm volatile("pushfl;popl %0;cli":"=r"(eflags)::"memory");
+#endif
+	do
 	{
-		outb(reg[host].ctr,0);				/* Enable interrupt */
-		release_irq_mask(irq_num[host]);
-		mili_timer(5);						/* wait */
-		current_intr[host]=INTR_ENABLE;
-	}
+		lock=1;
+		asm volatile("xchgl %0,%1":"+r"(lock),"+m"(queue_lock[host])::"memory");
+	}while(lock!=0);
+
+	return eflags;
 }
 
 
 /*
- * Primary ATA interrupt handler
- * return : Task switch on
+ * 要求キューのロック解除
+ * parameters : Host number,eflags
  */
-int prim_intr_handler()
+static inline void exit_queue(int host,uint eflags)
 {
-/***************************************/
-	printk("Interrupt IRQ14\n");
-/***************************************/
-	wake_intr(&wait_intr_queue[0]);
+	asm volatile("movl $0,%0":"=m"(queue_lock[host])::"memory");
+#ifdef ATA_SIM
+	sim_sti(eflags);
+#else
+	asm volatile("pushl %0;popfl"::"r"(eflags):"memory","cc");
+#endif
+}
 
-	return 1;
+
+/*
+ * 割り込みで完了させる転送ができるか
+ * parameters : Conect device
+ * return : 1=できる(DMA),0=プロセスで処理する
+ */
+static inline int intr_transfer(CONECT_DEV *cd)
+{
+	return (cd->mode!=PIO)&&((cd->type==ATA)||(cd->type==ATAPI));
 }
 
 
 /*
- * Secondary ATA interrupt handler
- * return : Task switch on
+ * overlapのATAPIがバスを解放している間は、そのデバイスの要求とプロセスで処理する要求を出さない
+ * SERVICE割り込みはプロセスのwait_intr()に渡さないので、その間プロセスで割り込みを待つコマンドは出せない
+ * parameters : Request queue,Request
+ * return : 1=待つ,0=出せる
  */
-int second_intr_handler()
+static inline int wait_ovl(REQ_QUEUE *q,ATA_REQ *req)
 {
-/***************************************/
-	printk("Interrupt IRQ15\n");
-/***************************************/
-	wake_intr(&wait_intr_queue[1]);
+	return (q->ovl!=NULL)&&((req->dev==q->ovl->dev)||(req->flag&REQ_PROC));
+}
 
-	return 1;
+
+/*
+ * I/O priority classの順位
+ * parameters : ATA_PRIO_*
+ * return : 0=Realtime,1=Best effort,2=Idle
+ */
+static inline int prio_rank(int prio)
+{
+	return (prio==ATA_PRIO_RT)?0:(prio==ATA_PRIO_BE)?1:2;
 }
 
 
 /*
- * Change transfer mode
- * parameters : Host number,Device number,Transfer mode(PIO=1 or Multi DMA=2 or Ultra DMA=3)
- * return : 0 or Error number
+ * 要求のクラスの期限
+ * parameters : Request queue,Request
+ * return : ms
  */
-int change_mode(int host,int dev,int mode)
+static inline int prio_expire(REQ_QUEUE *q,ATA_REQ *req)
 {
-	uchar subcm;
-	uint value;
-	int error;
-	ID_INFO *id_info;
-	PCI_INFO ide;
+	if(req->prio==ATA_PRIO_RT)return q->param.rt_expire;
+	if(req->prio==ATA_PRIO_IDLE)return q->param.idle_expire;
+	return (req->mode==READ)?q->param.read_expire:q->param.write_expire;
+}
+
+
+/*
+ * 要求をキューに入れる
+ * キューはデバイス番号,開始セクター順で、同じ位置の要求は到着順に並べる
+ * parameters : Host number,Request
+ */
+void insert_request(int host,ATA_REQ *req)
+{
+	ATA_REQ **p;
+
+
+	for(p=&req_queue[host].head;*p!=NULL;p=&(*p)->next)
+	{
+		if((*p)->dev>req->dev)break;
+		if(((*p)->dev==req->dev)&&((*p)->begin>req->begin))break;
+	}
+	req->next=*p;
+	*p=req;
+}
 
 
-	if(conect_dev[host][dev].mode==mode)return 0;
+/*
+ * 次に転送する要求をキューから取り出す
+ * 要求はI/O priority classの高い順に出す。期限切れの要求があればそれを優先し、なければ一番上のクラスの中で
+ * ヘッド位置から先で一番近い要求(C-SCAN)を選ぶ。下のクラスも期限が来れば上のクラスより先に出すので飢えない。
+ * 選んだ要求に続く同じデバイス、同じ方向、同じクラスの連続した要求はまとめてnextにつなぐ。
+ * parameters : Host number
+ * return : Request or NULL
+ */
+ATA_REQ *pick_request(int host)
+{
+	REQ_QUEUE *q;
+	ATA_REQ **p,*req,*last;
+	ATA_REQ *oldest[ATA_PRIO_NUM];
+	uint64 cur,now;
+	uint count,max;
+	int nseg;
+	int top;
+	int i;
 
-	if((id_info=(ID_INFO*)kmalloc(IDENTIFY_SIZE))==NULL)return PRINT_ERR(ENOMEM,"change_mode");
 
-	/* Read identify infomation */
-	if((error=identify_device(host,dev,conect_dev[host][dev].type,id_info))!=0)return error;
+	q=&req_queue[host];
 
-	if(mode==PIO)
+	/* クラスごとの一番古い要求 */
+	for(i=0;i<ATA_PRIO_NUM;++i)oldest[i]=NULL;
+	for(req=q->head;req!=NULL;req=req->next)
 	{
-		if(id_info->pio&PIO4)subcm=SUB_PIO_FLO|4;
-		else if(id_info->pio&PIO3)subcm=SUB_PIO_FLO|3;
-		else subcm=SUB_PIO_DEF;
+		if(wait_ovl(q,req))continue;
+		i=prio_rank(req->prio);
+		if((oldest[i]==NULL)||(req->time<oldest[i]->time))oldest[i]=req;
 	}
-	else if(mode==M_DMA)
+	for(top=0;(top<ATA_PRIO_NUM)&&(oldest[top]==NULL);++top);
+	if(top==ATA_PRIO_NUM)return NULL;
+
+	/* 期限切れの要求を上のクラスから探す。FIFOでは一番上のクラスは到着順のまま */
+	now=rdtsc();
+	for(req=NULL,i=top;i<ATA_PRIO_NUM;++i)
 	{
-		/* Set ATA transfer mode */
-		if(id_info->multi_dma&M_DMA2)subcm=SUB_M_DMA|2;
-		else if(id_info->multi_dma&M_DMA1)subcm=SUB_M_DMA|1;
-		else if(id_info->multi_dma&M_DMA0)subcm=SUB_M_DMA|0;
-		else return PRINT_ERR(ENOSYS,"change_mode");
+		if((oldest[i]==NULL)||((q->param.elevator==0)&&(i==top)))continue;
+		if(now-oldest[i]->time>clock_1m*prio_expire(q,oldest[i]))
+		{
+			req=oldest[i];
+			break;
+		}
+	}
 
-		/*
-		 * ULTRA DMA対応のドライブについては、BIOSでIDEがULTRA DMAに
-		 * 設定されているので、その設定を取り消す必要がある
-		 */
-		if((error=init_ide_busmaster(host,&ide))!=0)return error;
+	if(req!=NULL)++q->stat.expire;
+	else if(q->param.elevator==0)req=oldest[top];
+	else
+	{
+		/* 一番上のクラスの中でC-SCAN */
+		cur=(uint64)q->last_dev<<32|q->pos[q->last_dev];
+		for(req=q->head;req!=NULL;req=req->next)
+			if((prio_rank(req->prio)==top)&&(wait_ovl(q,req)==0)&&(((uint64)req->dev<<32|req->begin)>=cur))break;
+		if(req==NULL)for(req=q->head;(prio_rank(req->prio)!=top)||wait_ovl(q,req);req=req->next);
+	}
 
-		switch(ide.vender)
+	/*
+	 * 先に入った要求と範囲が重なる場合は、書き込みの順序を守るため先の要求を選ぶ
+	 * ホスト占有要求は先に入った要求を追い越さない
+	 */
+	for(last=q->head;last!=NULL;)
+	{
+		if((last!=req)&&(last->time<req->time)&&(wait_ovl(q,last)==0)&&
+			((req->mode==CTRL)||((last->dev==req->dev)&&((last->mode==WRITE)||(req->mode==WRITE))&&
+			(last->begin<req->begin+req->count)&&(req->begin<last->begin+last->count))))
 		{
-			case 0x24CB8086:		/* Intel ICH4 */
-			case 0x248a8086:		/* Intel ICH3 mobile */
-    		case 0x248b8086:		/* Intel ICH3 */
-    		case 0x244a8086:		/* Intel ICH2 mobile */
-    		case 0x244b8086:		/* Intel ICH2 */
-    		case 0x24118086:		/* Intel ICH */
-    		case 0x76018086:		/* Intel ICH */
-    		case 0x24218086:		/* Intel ICH0 */
-			case 0x71118086:		/* Intel PIIX4 */
-    		case 0x84CA8086:		/* Intel PIIX4 */
-    		case 0x71998086:		/* Intel PIIX4e */
-    			value=read_pci_config(ide.bus,ide.dev,ide.func,0x48);
-    			writedw_pci_config(ide.bus,ide.dev,ide.func,0x48,value&~(1<<(host*2+dev)));
-    			break;
-    		case 0x74411022:		/* AMD 768 */
-    		case 0x74111022:		/* AMD 766 */
-    		case 0x74091022:		/* AMD 756 */
-    		case 0x05711106:		/* VIA 82C571, 82C586, 82C596, 82C686 , 8231, 8233 */
-    		case 0x31471106:		/* VIA 8233a */
-    		case 0x82311106:		/* VIA 8231 */
-    		case 0x30741106:		/* VIA 8233 */
-    		case 0x31091106:		/* VIA 8233c */
-    		case 0x06861106:		/* VIA 82C686 82C686a 82C686b */
-    		case 0x05961106:		/* VIA 82C596a 82C596b */
-    		case 0x05861106:		/* VIA 82C586b */
-    			value=read_pci_config(ide.bus,ide.dev,ide.func,0x50);
-    			writedw_pci_config(ide.bus,ide.dev,ide.func,0x50,value&~(0x40000000>>(host*16+dev*8)));
-    			/*writeb_pci_config(ide.bus,ide.dev,ide.func,0x4b-host*2-dev,0x31);*/
-    			break;
-    		case 0x55131039:		/* SiS 5591 */
-    		case 0x06301039:		/* SiS 630 */
-    		case 0x06331039:		/* SiS 633 */
-    		case 0x06351039:		/* SiS 635 */
-    		case 0x06401039:		/* SiS 640 */
-    		case 0x06451039:		/* SiS 645 */
-    		case 0x06501039:		/* SiS 650 */
-    		case 0x07301039:		/* SiS 730 */
-    		case 0x07331039:		/* SiS 733 */
-    		case 0x07351039:		/* SiS 735 */
-    		case 0x07401039:		/* SiS 740 */
-    		case 0x07451039:		/* SiS 745 */
-    		case 0x07501039:		/* SiS 750 */
-    		case 0x05301039:		/* SiS 530 */
-    		case 0x05401039:		/* SiS 540 */
-    		case 0x06201039:		/* SiS 620 */
-    			value=read_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4);
-    			writedw_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4,value&~(0xf000<<dev*16));
-    			break;
-    	}
+			req=last;
+			last=q->head;
+		}
+		else last=last->next;
 	}
-	else if(mode==U_DMA)
-	{
-		if((id_info->ultra_dma&(U_DMA5|U_DMA4|U_DMA3|U_DMA2|U_DMA1|U_DMA0))==0)
-			return PRINT_ERR(ENOSYS,"change_mode");
 
-		/*
-		 * ULTRA DMA対応のドライブについては、BIOSでIDEがULTRA DMAに
-		 * 設定されているものとみなす
-		 */
-		if((error=init_ide_busmaster(host,&ide))!=0)return error;
+	/* キューから外す */
+	for(p=&q->head;*p!=req;p=&(*p)->next);
+	*p=req->next;
 
-		switch(ide.vender)
+	/*
+	 * 連続する要求をまとめる
+	 * overlapのATAPIはバスを解放している間にmerge_segを他の要求が使うので、まとめない
+	 */
+	last=req;
+	if((q->param.elevator!=0)&&(req->mode!=CTRL)&&((conect_dev[host][req->dev].flag&ATAPI_OVL)==0))
+	{
+		max=conect_dev[host][req->dev].max_count;
+		if((q->param.max_merge>0)&&(q->param.max_merge<max))max=q->param.max_merge;
+		count=req->count;
+		nseg=req->nseg;
+		while((*p!=NULL)&&((*p)->dev==req->dev)&&((*p)->mode==req->mode)&&((*p)->flag==req->flag)&&
+			((*p)->prio==req->prio)&&((*p)->skip==0)&&((*p)->begin==last->begin+last->count)&&(count+(*p)->count<=max)&&(nseg+(*p)->nseg<=PRD_MAX))
 		{
-			case 0x24CB8086:		/* Intel ICH4 */
-			case 0x248a8086:		/* Intel ICH3 mobile */
-    		case 0x248b8086:		/* Intel ICH3 */
-    		case 0x244a8086:		/* Intel ICH2 mobile */
-    		case 0x244b8086:		/* Intel ICH2 */
-    			if(id_info->ultra_dma&U_DMA5)
-    			{
-					subcm=SUB_U_DMA|5;
-					goto INTEL;
-				}
-			case 0x24118086:		/* Intel ICH */
-    		case 0x76018086:		/* Intel ICH */
-    			if(id_info->ultra_dma&U_DMA4)
-    			{
-					subcm=SUB_U_DMA|4;
-					goto INTEL;
-				}
-				if(id_info->ultra_dma&U_DMA3)
-				{
-					subcm=SUB_U_DMA|3;
-					goto INTEL;
-				}
-			case 0x24218086:		/* Intel ICH0 */
-			case 0x71118086:		/* Intel PIIX4 */
-    		case 0x84CA8086:		/* Intel PIIX4 */
-    		case 0x71998086:		/* Intel PIIX4e */
-    			if(id_info->ultra_dma&U_DMA2)
-    			{
-					subcm=SUB_U_DMA|2;
-					goto INTEL;
-				}
-				if(id_info->ultra_dma&U_DMA1)
-				{
-					subcm=SUB_U_DMA|1;
-					goto INTEL;
-				}
-				if(id_info->ultra_dma&U_DMA0)subcm=SUB_U_DMA|0;
-INTEL:			value=read_pci_config(ide.bus,ide.dev,ide.func,0x48);
-    			writedw_pci_config(ide.bus,ide.dev,ide.func,0x48,value|(1<<(host*2+dev)));
-				break;
-    		case 0x74411022:		/* AMD 768 */
-    		case 0x74111022:		/* AMD 766 */
-    			if(id_info->ultra_dma&U_DMA5)
-    			{
-					subcm=SUB_U_DMA|5;
-					goto VIA;
-				}
-    		case 0x74091022:		/* AMD 756 */
-    			if(id_info->ultra_dma&U_DMA4)
-    			{
-					subcm=SUB_U_DMA|4;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA3)
-				{
-					subcm=SUB_U_DMA|3;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA2)
-    			{
-					subcm=SUB_U_DMA|2;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA1)
-				{
-					subcm=SUB_U_DMA|1;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA0)
-				{
-					subcm=SUB_U_DMA|0;
-					goto VIA;
-				}
-    		/*case 0x05711106:*/	/* VIA 82C571, 82C586, 82C596, 82C686 , 8231, 8233 */
-    		case 0x31471106:		/* VIA 8233a */
-    			if(id_info->ultra_dma&U_DMA6)
-				{
-					subcm=SUB_U_DMA|6;
-					goto VIA;
-				}
-    		case 0x06861106:		/* VIA 82C686b */
-    		case 0x82311106:		/* VIA 8231 */
-    		case 0x30741106:		/* VIA 8233 */
-    		case 0x31091106:		/* VIA 8233c */
-    			if(id_info->ultra_dma&U_DMA5)
-				{
-					subcm=SUB_U_DMA|5;
-					goto VIA;
-				}
-    		/*case 0x06861106:*/	/* VIA 82C686a */
-    		case 0x05961106:		/* VIA 82C596b */
-    			if(id_info->ultra_dma&U_DMA4)
-				{
-					subcm=SUB_U_DMA|4;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA3)
-				{
-					subcm=SUB_U_DMA|3;
-					goto VIA;
-				}
-    		/*case 0x06861106:*/	/* VIA 82C686 */
-    		/*case 0x05961106:*/	/* VIA 82C596a */
-    		case 0x05861106:		/* VIA 82C586b */
-    			if(id_info->ultra_dma&U_DMA2)
-				{
-					subcm=SUB_U_DMA|2;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA1)
-				{
-					subcm=SUB_U_DMA|1;
-					goto VIA;
-				}
-				if(id_info->ultra_dma&U_DMA0)subcm=SUB_U_DMA|0;
-VIA:   			value=read_pci_config(ide.bus,ide.dev,ide.func,0x50);
-    			writedw_pci_config(ide.bus,ide.dev,ide.func,0x50,value|(0x40000000>>(host*16+dev*8)));
-    			break;
-    		case 0x55131039:		/* SiS 5591 */
-    		case 0x06301039:		/* SiS 630 */
-    		case 0x06331039:		/* SiS 633 */
-    		case 0x06351039:		/* SiS 635 */
-    		case 0x06401039:		/* SiS 640 */
-    		case 0x06451039:		/* SiS 645 */
-    		case 0x06501039:		/* SiS 650 */
-    		case 0x07301039:		/* SiS 730 */
-    		case 0x07331039:		/* SiS 733 */
-    		case 0x07351039:		/* SiS 735 */
-    		case 0x07401039:		/* SiS 740 */
-    		case 0x07451039:		/* SiS 745 */
-    		case 0x07501039:		/* SiS 750 */
-    			if(id_info->ultra_dma&U_DMA5)
-				{
-					subcm=SUB_U_DMA|5;
-					value=read_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4);
-    				writedw_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4,value|(0x8000<<dev*16));
-    				break;
-				}
-    			if(id_info->ultra_dma&U_DMA4)
-				{
-					subcm=SUB_U_DMA|4;
-					value=read_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4);
-    				writedw_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4,value|(0x9000<<dev*16));
-    				break;
-				}
-				if(id_info->ultra_dma&U_DMA2)
-				{
-					subcm=SUB_U_DMA|2;
-					value=read_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4);
-    				writedw_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4,value|(0xb000<<dev*16));
-    				break;
-				}
-    		case 0x05301039:		/* SiS 530 */
-    		case 0x05401039:		/* SiS 540 */
-    		case 0x06201039:		/* SiS 620 */
-    			if(id_info->ultra_dma&U_DMA4)
-				{
-					subcm=SUB_U_DMA|4;
-					value=read_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4);
-    				writedw_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4,value|(0x9000<<dev*16));
-    				break;
-				}
-				if(id_info->ultra_dma&U_DMA2)
-				{
-					subcm=SUB_U_DMA|2;
-					value=read_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4);
-    				writedw_pci_config(ide.bus,ide.dev,ide.func,0x40+host*4,value|(0xa000<<dev*16));
-    				break;
-				}
-			default:
-				return PRINT_ERR(ENOSYS,"change_mode");
+			last->next=*p;
+			last=*p;
+			*p=last->next;
+			count+=last->count;
+			nseg+=last->nseg;
+			++q->stat.merge;
 		}
 	}
-	else return PRINT_ERR(EINVAL,"change_mode");
+	last->next=NULL;
+	if(req->mode==CTRL)return req;
 
-	conect_dev[host][dev].mode=mode;
-
-	kfree(id_info);
+	/* Statistics */
+	++q->stat.dispatch;
+	if((req->dev!=q->last_dev)||(req->begin!=q->pos[req->dev]))
+	{
+		++q->stat.seek;
+		q->stat.seek_dist+=(req->begin>q->pos[req->dev])?req->begin-q->pos[req->dev]:q->pos[req->dev]-req->begin;
+	}
+	q->last_dev=req->dev;
+	q->pos[req->dev]=last->begin+last->count;
 
-	return set_features(host,dev,SET_TRANSFER,subcm);
+	return req;
 }
 
 
 /*
- * Init IDE Bus Master
- * parameters : Host number,PCI_INFO buffer
- * return : 0 or Error number
+ * 転送する要求のセグメントリストを設定する
+ * まとめた要求はmerge_segにつなげる
+ * parameters : Host number
  */
-int init_ide_busmaster(int host,PCI_INFO *ide)
+void set_request_seg(int host)
 {
-	ushort com;
+	REQ_QUEUE *q;
+	ATA_REQ *req;
 
 
-	/* Serch IDE */
-	if(search_pci_class(PCI_CLS_IDE,ide)==-1)return PRINT_ERR(ENODEV,"init_ide_busmaster");
+	q=&req_queue[host];
+	req=q->cur;
+	if(req->next==NULL)
+	{
+		q->seg=req->seg;
+		q->nseg=req->nseg;
+		q->bytes=req->count*conect_dev[host][req->dev].sector_size;
+		return;
+	}
 
-	/* Test Bus Master enable bit on */
-	com=read_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_COM);
-	writew_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_COM,com|PCI_COM_BM_BIT);
-	if((read_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_COM)&PCI_COM_BM_BIT)==0)return PRINT_ERR(ENOSYS,"init_ide_busmaster");
+	for(q->nseg=0,q->bytes=0;req!=NULL;req=req->next)
+	{
+		memcpy(&merge_seg[host][q->nseg],req->seg,req->nseg*sizeof(ATA_SEG));
+		q->nseg+=req->nseg;
+		q->bytes+=req->count*conect_dev[host][req->dev].sector_size;
+	}
+	q->seg=merge_seg[host];
+}
 
-	/* Get IO base address */
-	if((ide_base[0]=read_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_BMBASE))==0)return PRINT_ERR(ENOSYS,"init_ide_busmaster");
-	ide_base[0]&=0xfff0;
-	ide_base[1]=ide_base[0]+IDE_BMIO_SECOND;
 
-	/* Reset Bus Master */
-	outb(ide_base[host]+IDE_BMIC,0);
+/*
+ * 割り込みで完了させる転送のコマンドを発行する
+ * parameters : Host number
+ * return : 0 or Error number
+ */
+int issue_request(int host)
+{
+	REQ_QUEUE *q;
+	CONECT_DEV *cd;
+	int nchunk;
 
-	return 0;
+
+	q=&req_queue[host];
+	cd=&conect_dev[host][q->cur->dev];
+
+	nchunk=make_chunk(host,q->seg,q->nseg,q->done,cd->max_count*cd->sector_size,cd->sector_size,&q->size);
+	if(q->size==0)return PRINT_ERR(EINVAL,"issue_request");
+
+	q->time=rdtsc();
+	q->intr=1;
+	return ((cd->type==ATA)?issue_ata:issue_atapi)(host,q->cur->dev,q->cur->mode,chunk_seg[host],nchunk,
+		q->size/cd->sector_size,q->cur->begin+q->done/cd->sector_size);
 }
 
 
 /*
- * PIO read data
- * parameters : Host number,Device number,buffer,Block size,Block count
- * return : Status coad
+ * 上のクラスの要求が待っていれば、転送中の要求をコマンドの区切りで中断してキューに戻す
+ * 転送し終わった要求は完了させ、途中の要求は転送済みバイト数をskipに残して続きから出し直す
+ * 割り込みで呼ぶ
+ * parameters : Host number
+ * return : 1=中断した,0=続ける
  */
-int read_pio(int host,int dev,void *buf,int block,int count)
+int preempt_request(int host)
 {
-	int error;
-	int dtr;
-	int i,j,last;
+	REQ_QUEUE *q;
+	ATA_REQ *req,*next,*done,**tail;
+	uint64 now;
+	uint eflags;
+	uint bytes,off;
+	int rank;
+
+
+	q=&req_queue[host];
+	if((rank=prio_rank(q->cur->prio))==0)return 0;
+
+	now=rdtsc();
+	eflags=enter_queue(host);
+	for(req=q->head;req!=NULL;req=req->next)
+		if((req->mode!=CTRL)&&(prio_rank(req->prio)<rank)&&(wait_ovl(q,req)==0))break;
+	if(req==NULL)
+	{
+		exit_queue(host,eflags);
+		return 0;
+	}
 
+	for(done=NULL,tail=&done,off=q->done,req=q->cur;req!=NULL;req=next)
+	{
+		next=req->next;
+		bytes=req->count*conect_dev[host][req->dev].sector_size;
+		if(off>=bytes)
+		{
+			off-=bytes;
+			account_request(host,req,0,q->start,now);
+			*tail=req;
+			tail=&req->next;
+		}
+		else
+		{
+			req->skip=off;
+			off=0;
+			insert_request(host,req);
+		}
+	}
+	*tail=NULL;
+	q->cur=NULL;
+	++q->stat.preempt;
+	exit_queue(host,eflags);
 
-	dtr=reg[host].dtr;
-	last=block/2;
-	for(i=0;i<count;++i)
+	for(req=done;req!=NULL;req=next)
 	{
-		if(((error=check_busy(reg[host].str))&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return error;
-		for(j=0;j<last;++j)((short*)buf)[j]=inw(dtr);
-		(uint)buf+=block;
+		next=req->next;
+		complete_request(host,req,0);
 	}
+	start_queue(host);
 
-	return check_busy(reg[host].str);
+	return 1;
 }
 
 
 /*
- * PIO write data
- * parameters : Host number,Device number,buffer,Block size,Block count
- * return : Status coad
+ * overlapのATAPIがバスを解放したなら、要求をovlに移して他の要求を始める
+ * 割り込みで呼ぶ
+ * parameters : Host number
+ * return : 1=解放した,0=解放していない
  */
-int write_pio(int host,int dev,void *buf,int block,int count)
+int release_atapi(int host)
 {
-	int error;
-	int dtr;
-	int i,j,last;
+	REQ_QUEUE *q;
+	uint eflags;
 
 
-	dtr=reg[host].dtr;
-	last=block/2;
-	for(i=0;i<count;++i)
-	{
-		if(((error=check_busy(reg[host].str))&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return error;
-		for(j=0;j<last;++j)outw(dtr,((short*)buf)[j]);
-		(uint)buf+=block;
-	}
+	q=&req_queue[host];
+	if(((conect_dev[host][q->cur->dev].flag&ATAPI_OVL)==0)||(conect_dev[host][q->cur->dev].type!=ATAPI))return 0;
+	if((inb(reg[host].irr)&REL_BIT)==0)return 0;
+	if(inb(reg[host].str)&(BSY_BIT|DRQ_BIT|ERR_BIT))return 0;
 
-	return check_busy(reg[host].str);
+	outb(ide_base[host]+IDE_BMIC,0);			/* Stop Bus Master */
+	bounce_num[host]=0;
+
+	eflags=enter_queue(host);
+	q->ovl=q->cur;
+	q->ovl_done=q->done;
+	q->ovl_start=q->start;
+	q->ovl_time=rdtsc();
+	q->cur=NULL;
+	q->intr=0;
+	++dev_stat[host][q->ovl->dev].release;
+	exit_queue(host,eflags);
+
+	start_queue(host);
+
+	return 1;
 }
 
 
 /*
- * DMA read data
- * parameters : Host number,Device number,buffer,Block size,Block count
- * return : Status coad
+ * SERVICEを要求していれば、バスを解放したoverlapのATAPI要求の転送を再開する
+ * PRDテーブルとバウンスバッファーは他の要求が使ったので作り直す。
+ * 要求していなければデバイスを選んだままにして、SERVICE割り込みを待つ
+ * curをovlにしてバスを確保してから呼ぶ
+ * parameters : Host number
+ * return : 1=再開した,0=まだ,Error number
  */
-int read_dma(int host,int dev,void *buf,int block,int count)
+int service_atapi(int host)
 {
-	/* Set PRD */
-	prd[host].phys_addr=buf;
-	prd[host].count=block*count|PRD_EOT;
-	outdw(ide_base[host]+IDE_BMIDTP,(uint)&prd[host]);
-	/*
-	 * バスマスターステータスレジスタの割り込みフラグをクリアーしないと
-	 * 割り込みが発生しないようだ
-	 */
-	outb(ide_base[host]+IDE_BMIS,0x6);			/* Clear interrupt bit and error bit */
-	outb(ide_base[host]+IDE_BMIC,0x9);			/* Start read Bus Master */
-	wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
-	if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"read_dma");
-	outb(ide_base[host]+IDE_BMIC,0);			/* Stop Bus Master */
+	REQ_QUEUE *q;
+	CONECT_DEV *cd;
+	int nchunk;
+	int error;
 
-	return inb(reg[host].str);
+
+	q=&req_queue[host];
+	cd=&conect_dev[host][q->ovl->dev];
+
+	if((error=device_select(host,q->ovl->dev<<4))==0)
+	{
+		set_intr(host,INTR_ENABLE);
+		if((inb(reg[host].str)&SRV_BIT)==0)return 0;
+	}
+
+	/* エラーでもcurに戻して終わらせる */
+	q->ovl=NULL;
+	q->done=q->ovl_done;
+	q->start=q->ovl_start;
+	set_request_seg(host);
+	if(error!=0)return error;
+
+	nchunk=make_chunk(host,q->seg,q->nseg,q->done,cd->max_count*cd->sector_size,cd->sector_size,&q->size);
+	if((error=set_prd(host,chunk_seg[host],nchunk,q->cur->mode))!=0)return error;
+
+	outb(reg[host].cmr,0xa2);					/* Issue service command */
+	micro_timer(1);								/* 400ns wait */
+	if((check_busy(reg[host].str)&(BSY_BIT|DRQ_BIT|ERR_BIT))!=DRQ_BIT)return PRINT_ERR(EDERRE,"service_atapi");
+
+	q->time=rdtsc();
+	q->intr=1;
+	start_dma(host,q->cur->mode);
+
+	return 1;
 }
 
 
 /*
- * DMA write data
- * parameters : Host number,Device number,buffer,Block size,Block count
- * return : Status coad
+ * ヒストグラムの区間
+ * parameters : Clock
+ * return : log2(clock)
  */
-int write_dma(int host,int dev,void *buf,int block,int count)
+static inline int hist_index(uint64 clock)
 {
-	/* Set PRD */
-	prd[host].phys_addr=buf;
-	prd[host].count=block*count|PRD_EOT;
-	outdw(ide_base[host]+IDE_BMIDTP,(uint)&prd[host]);
-	/*
-	 * バスマスターステータスレジスタの割り込みフラグをクリアーしないと
-	 * 割り込みが発生しないようだ
-	 */
-	outb(ide_base[host]+IDE_BMIS,0x6);		/* Clear interrupt bit and error bit */
-	outb(ide_base[host]+IDE_BMIC,0x1);		/* Start write Bus Master */
-	wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
-	if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"write_dma");
-	outb(ide_base[host]+IDE_BMIC,0);		/* Stop Bus Master */
+	uint high,low;
+	int n;
 
-	return inb(reg[host].str);
+
+	high=(uint)(clock>>32);
+	low=(uint)clock;
+	if(high!=0)
+	{
+		asm("bsrl %1,%0":"=r"(n):"rm"(high));
+		n+=32;
+	}
+	else if(low!=0)asm("bsrl %1,%0":"=r"(n):"rm"(low));
+	else n=0;
+
+	return (n<ATA_HIST_NUM)?n:ATA_HIST_NUM-1;
 }
 
 
 /*
- * reset host
- * parameters : host number
- * return : 0 or error number
+ * 完了した要求をデバイスの統計に加える
+ * キューのロック中に呼ぶ
+ * parameters : Host number,Request,0 or Error number,Dispatch clock,Complete clock
  */
-int reset_host(int host)
+void account_request(int host,ATA_REQ *req,int error,uint64 start,uint64 now)
 {
-	int error;
-	int i;
+	ATA_DEV_STAT *st;
+	uint64 queue,wire;
 
 
-	/* soft reset */
-	if((error=soft_reset(host))!=0)return error;
+	if(req->mode==CTRL)return;
 
-	/* set transfer mode */
-	for(i=0;i<2;++i)change_mode(host,i,conect_dev[host][i].mode);
+	st=&dev_stat[host][req->dev];
+	queue=start-req->time;
+	wire=now-start;
 
-	return 0;
+	if(req->mode==READ)
+	{
+		++st->read;
+		st->read_sect+=req->count;
+	}
+	else
+	{
+		++st->write;
+		st->write_sect+=req->count;
+	}
+	if(conect_dev[host][req->dev].mode==PIO)++st->pio;
+	else ++st->dma;
+	if(error!=0)
+	{
+		++st->error;
+		if(error==-ETIMEOUT)++st->timeout;
+	}
+
+	st->queue_time+=queue;
+	st->wire_time+=wire;
+	++st->queue_hist[hist_index(queue)];
+	++st->wire_hist[hist_index(wire)];
+	++st->total_hist[hist_index(queue+wire)];
 }
 
 
-/************************************************************************************************
- *
- * ATA initialize
- *
- ************************************************************************************************/
+/*
+ * 要求の完了を知らせる
+ * callbackのある要求はcallbackを呼んだ後は触らない
+ * parameters : Host number,Request,0 or Error number
+ */
+void complete_request(int host,ATA_REQ *req,int error)
+{
+	uint eflags;
+
+
+	req->error=error;
+	if(req->callback!=NULL)req->callback(req);
+	else
+	{
+		eflags=enter_queue(host);
+		req->done=1;
+		wake_intr(&req->wait);
+		exit_queue(host,eflags);
+	}
+}
 
 
 /*
- * ATAの初期化
- * return : 0 or Error number
+ * 転送中の要求を完了させてキューの次の要求を開始する
+ * callbackのある要求はcallbackを呼んだ後は触らない
+ * parameters : Host number,0 or Error number
  */
-int init_ata()
+void end_request(int host,int error)
 {
-	uchar cl,ch;
-	int error;
-	ID_INFO *id_info;
-	int i,j;
+	REQ_QUEUE *q;
+	ATA_REQ *req,*next;
+	uint64 now;
+	uint eflags;
 
 
-	/* タイムアウト値の代入 */
-	time_out=clock_1m*TIME_OUT;
+	q=&req_queue[host];
 
-	if((id_info=(ID_INFO*)kmalloc(IDENTIFY_SIZE))==NULL)return PRINT_ERR(ENOMEM,"init_ata");
+	now=rdtsc();
+	eflags=enter_queue(host);
+	req=q->cur;
+	q->cur=NULL;
+	q->intr=0;
+	for(next=req;next!=NULL;next=next->next)account_request(host,next,error,q->start,now);
+	exit_queue(host,eflags);
+	if((req!=NULL)&&(req->mode!=CTRL))check_error(host,req->dev,error);
 
-	/* 接続デバイスを判定する */
-	for(i=0;i<2;++i)
+	for(;req!=NULL;req=next)
 	{
-		/* ソフトリセット */
-		if(soft_reset(i)!=0)continue;
-		current_intr[i]=0;
+		next=req->next;
+		complete_request(host,req,error);
+	}
 
-		for(j=0;j<2;++j)
+	start_queue(host);
+}
+
+
+/*
+ * キューの次の要求を開始する
+ * 割り込みで完了できない要求は、要求したプロセスに処理を渡す
+ * parameters : Host number
+ */
+void start_queue(int host)
+{
+	REQ_QUEUE *q;
+	ATA_REQ *req;
+	uint eflags;
+	int tag;
+	int srv;
+	int error;
+
+
+	q=&req_queue[host];
+	for(srv=1;;)
+	{
+		eflags=enter_queue(host);
+		if((q->cur!=NULL)||(q->tcq_cur>=0))
+		{
+			if((q->ovl!=NULL)&&(q->cur==q->ovl))q->srv_intr=1;
+			exit_queue(host,eflags);
+			return;
+		}
+
+		/*
+		 * バスを解放したoverlapのATAPIがSERVICEを要求していれば、先に転送を再開する
+		 * 調べる間はcurをovlにしてバスを確保する。その間に来たSERVICE割り込みはsrv_intrに残るので、もう一度調べる
+		 */
+		if((q->ovl!=NULL)&&srv)
+		{
+			q->cur=q->ovl;
+			q->srv_intr=0;
+			exit_queue(host,eflags);
+			if((error=service_atapi(host))>0)return;
+			if(error<0)
+			{
+				q->intr=0;
+				end_request(host,error);
+				continue;
+			}
+			eflags=enter_queue(host);
+			q->cur=NULL;
+			srv=q->srv_intr;
+			exit_queue(host,eflags);
+			continue;
+		}
+
+		/* TCQ */
+		if((req=pick_tcq(host,&tag))!=NULL)
 		{
+			q->tag[tag]=req;
+			q->tag_start[tag]=rdtsc();
+			q->tcq_dev=req->dev;
+			++q->ntag;
+			q->tcq_cur=TCQ_MAX;			/* 発行し終わるまでバスを確保する */
+			exit_queue(host,eflags);
+
 			/*
-			 * ソフトリセット後ATAならATA_CLR=0 ATA_CHR=0、ATAPIならATA_CLR=0x14 ATA_CHR=0xeb
-			 * になる
+			 * 発行中に来たSERVICE割り込みは、tcq_curがTCQ_MAXなのでintr_tcq()が無視する
+			 * SERVICEはステータスに残るので、発行したコマンドの次の割り込みで処理される
 			 */
-			outb(reg[i].dhr,j<<4);
-			mili_timer(5);
-			cl=inb(reg[i].clr);
-			ch=inb(reg[i].chr);
+			if((error=issue_tcq(host,tag))==0)return;
+			q->tcq_cur=-1;
+			end_tcq(host,tag,error);
+			continue;
+		}
 
-			/* ATA disk */
-			if((cl==0)&&(ch==0))
-			{
-				id_info->model[0]=0xff;
-				if(identify_device(i,j,ATA,id_info)!=0)continue;	/* Read identify infomation */
-				if(id_info->model[0]==0xff)continue;				/* 読み出しているかをチェック */
+		/* TCQの要求が残っている間は、他の要求はTCQが空くのを待つ */
+		if((q->ntag>0)||((req=pick_request(host))==NULL))
+		{
+			exit_queue(host,eflags);
+			return;
+		}
+		q->cur=req;
+		q->done=req->skip;
+		q->start=rdtsc();
 
-				/* Print device infomation */
-				cnv_idinfo_str(id_info->model,40);
-				printk("%s : %s, %s\n",hd_info[i][j].name,id_info->model,"ATA DISK drive");
+		if(req->flag&REQ_PROC)
+		{
+			req->run=1;
+			wake_intr(&req->wait);
+			exit_queue(host,eflags);
+			return;
+		}
+		exit_queue(host,eflags);
 
-				/* LBA all sectors */
-				conect_dev[i][j].all_sectors=(uint)id_info->lba_all_sect[1]<<16|(uint)id_info->lba_all_sect[0];
-				if(conect_dev[i][j].all_sectors==0)
-				{
-					printk("This device is not support LBA. Stop initialize!");
-					continue;
-				}
-				conect_dev[i][j].type=ATA;
-				conect_dev[i][j].transfer=_transfer_ata;
+		set_request_seg(host);
+		if((error=issue_request(host))==0)return;
+		q->intr=0;
+		end_request(host,error);
+	}
+}
 
-				/* Init device parameters */
-				init_device_param(i,j,(uchar)id_info->n_head,id_info->n_sect);
 
-				hd_info[i][j].last_blk=conect_dev[i][j].all_sectors-1;
-				hd_info[i][j].sector_size=ATA_SECTOR_SIZE;
-			}
+/*
+ * 割り込みによる転送完了処理
+ * まだ転送が残っていれば次のコマンドを発行する
+ * parameters : Host number
+ */
+void intr_request(int host)
+{
+	REQ_QUEUE *q;
+	int error;
 
-			/* ATAPI device */
-			else if((cl==0x14)&&(ch==0xeb))
-			{
-				char *media;
 
+	q=&req_queue[host];
+	if(q->ntag>0)
+	{
+		intr_tcq(host);
+		return;
+	}
+	if(release_atapi(host))return;
+	q->intr=0;
+	update_dma_hist(host,q->cur->dev,q->size,rdtsc()-q->time);
 
-				if(identify_device(i,j,ATAPI,id_info)!=0)continue;	/* Read identify infomation */
+	error=end_dma(host);
+	if(error>=0)
+	{
+		if(error&(DRQ_BIT|ERR_BIT))error=PRINT_ERR(EDERRE,"intr_request");
+		else if(error&BSY_BIT)error=PRINT_ERR(EDBUSY,"intr_request");
+		else error=0;
+	}
 
-				/* Print device infomation */
-				cnv_idinfo_str(id_info->model,40);
-				switch((id_info->config>>8)&0x1f)		/* Medium name */
-				{
-					case 0x5:
-						media="ATAPI CDROM drive";
-						break;
-					default:
-						media="ATAPI OTHER drive";
-						break;
-				}
-				printk("%s : %s, %s\n",hd_info[i][j].name,id_info->model,media);
+	if(error==0)
+	{
+		q->done+=q->size;
+		if(q->done<q->bytes)
+		{
+			if(preempt_request(host))return;
+			if((error=issue_request(host))==0)return;
+			q->intr=0;
+		}
+	}
+
+	end_request(host,error);
+}
 
-				conect_dev[i][j].flag=id_info->iordy;
-				conect_dev[i][j].type=ATAPI;
-				conect_dev[i][j].transfer=_transfer_atapi;
-			}
-			else continue;
 
-			/* Idle device */
-			idle_immediate_device(i,j);
+/*
+ * PRDテーブルのエントリー数
+ * ページごとに1エントリーとして数える
+ * parameters : Segment list,Number of segments
+ * return : Number of entries or -1(バウンスバッファーが要る)
+ */
+int prd_count(ATA_SEG *seg,int nseg)
+{
+	uint addr,size,len,phys;
+	int odd;
+	int n;
+	int i;
 
-			/* Set PIO mode */
-			if((error=change_mode(i,j,PIO))!=0)
-				printk("Transfer mode set error : %x\n",error);
 
-			/* Regster to dev filesystem */
-			regist_device(&hd_info[i][j]);
+	for(n=0,odd=0,i=0;i<nseg;++i)
+	{
+		addr=(uint)seg[i].addr;
+		for(size=seg[i].size;size>0;addr+=len,size-=len,++n)
+		{
+			len=DMA_PAGE-(addr&(DMA_PAGE-1));
+			if(len>size)len=size;
+			if(need_bounce(addr,len,&phys,&odd))return -1;
 		}
 	}
 
-	kfree(id_info);
+	return n;
+}
 
-	/*
-	 * もう一度確認
-	 * デバイスによっては、同一ホストが存在しない場合確認処理によって
-	 * ビジー状態のままになってしまう。
-	 */
-	for(i=0;i<2;++i)
-		for(j=0;j<2;++j)
+
+/*
+ * TCQで発行する要求をキューから取り出す
+ * 並べ替えはドライブに任せるので、I/O priority classの高い順、同じクラスは到着順に出す。
+ * 下のクラスの要求は期限が来れば上のクラスより先に出す
+ * 選んだ要求がTCQで出せない場合は、発行中のTCQが終わるのを待って通常の順番で出す
+ * キューのロック中に呼ぶ
+ * parameters : Host number,Return tag
+ * return : Request or NULL
+ */
+ATA_REQ *pick_tcq(int host,int *tag)
+{
+	REQ_QUEUE *q;
+	CONECT_DEV *cd;
+	ATA_REQ **p,*req,*r;
+	uint64 now;
+	int top,rank,k;
+	int depth;
+	int i;
+
+
+	q=&req_queue[host];
+	if((q->head==NULL)||(q->param.queue_depth==0)||(q->ovl!=NULL))return NULL;
+
+	now=rdtsc();
+	for(top=ATA_PRIO_NUM,r=q->head;r!=NULL;r=r->next)
+		if(prio_rank(r->prio)<top)top=prio_rank(r->prio);
+	for(req=NULL,rank=0,r=q->head;r!=NULL;r=r->next)
+	{
+		k=prio_rank(r->prio);
+		if((k>top)&&(now-r->time>clock_1m*prio_expire(q,r)))k=-1;
+		if((req==NULL)||(k<rank)||((k==rank)&&(r->time<req->time)))
 		{
-			outb(reg[i].dhr,j<<4);
-			mili_timer(5);
-			if((inb(reg[i].str)&BSY_BIT)==BSY_BIT)reset_host(i);
+			req=r;
+			rank=k;
 		}
+	}
+	if(req->mode==CTRL)return NULL;
+
+	cd=&conect_dev[host][req->dev];
+	if((cd->tcq_depth==0)||(cd->mode==PIO))return NULL;
+	if((q->ntag>0)&&(req->dev!=q->tcq_dev))return NULL;
+
+	depth=(q->param.queue_depth<cd->tcq_depth)?q->param.queue_depth:cd->tcq_depth;
+	if(depth>TCQ_MAX)depth=TCQ_MAX;
+	if(q->ntag>=depth)return NULL;
+
+	/* 1コマンドで転送できる要求だけ */
+	if((req->count>ATA_COUNT_MAX)||((uint64)req->begin+req->count>LBA28_MAX))return NULL;
+	if((uint)(prd_count(req->seg,req->nseg)-1)>=PRD_MAX)return NULL;
+
+	/* 重なる書き込みをドライブの中で追い越させない */
+	for(i=0;i<TCQ_MAX;++i)
+	{
+		r=q->tag[i];
+		if((r!=NULL)&&((r->mode==WRITE)||(req->mode==WRITE))&&
+			(r->begin<req->begin+req->count)&&(req->begin<r->begin+r->count))return NULL;
+	}
+
+	for(i=0;q->tag[i]!=NULL;++i);
+	*tag=i;
+
+	for(p=&q->head;*p!=req;p=&(*p)->next);
+	*p=req->next;
+	req->next=NULL;
+
+	/* Statistics */
+	++q->stat.dispatch;
+	if((req->dev!=q->last_dev)||(req->begin!=q->pos[req->dev]))
+	{
+		++q->stat.seek;
+		q->stat.seek_dist+=(req->begin>q->pos[req->dev])?req->begin-q->pos[req->dev]:q->pos[req->dev]-req->begin;
+	}
+	q->last_dev=req->dev;
+	q->pos[req->dev]=req->begin+req->count;
+
+	return req;
+}
+
+
+/*
+ * READ/WRITE DMA QUEUEDを発行する
+ * ドライブはすぐに転送するか、バスを解放して後でSERVICE割り込みを出す
+ * parameters : Host number,Tag
+ * return : 0 or Error number
+ */
+int issue_tcq(int host,int tag)
+{
+	REQ_QUEUE *q;
+	ATA_REQ *req;
+	int error;
+
+
+	q=&req_queue[host];
+	req=q->tag[tag];
+
+	if((error=set_prd(host,req->seg,req->nseg,req->mode))!=0)return error;
+	if((error=device_select(host,req->begin>>24|(req->dev<<4)|LBA_BIT))!=0)return error;
+	set_intr(host,INTR_ENABLE);
+
+	outb(reg[host].ftr,(uchar)req->count);
+	outb(reg[host].scr,tag<<3);
+	outb(reg[host].snr,(uchar)req->begin);
+	outb(reg[host].clr,(uchar)(req->begin>>8));
+	outb(reg[host].chr,(uchar)(req->begin>>16));
+
+	q->tcq_cur=tag;
+	q->time=rdtsc();
+	q->intr=1;
+	outb(reg[host].cmr,(req->mode==READ)?0xc7:0xcc);
+	start_dma(host,req->mode);
+
+	return 0;
+}
+
+
+/*
+ * TCQの要求を完了させる
+ * parameters : Host number,Tag,0 or Error number
+ */
+void end_tcq(int host,int tag,int error)
+{
+	REQ_QUEUE *q;
+	ATA_REQ *req;
+	uint eflags;
+
+
+	q=&req_queue[host];
+
+	eflags=enter_queue(host);
+	req=q->tag[tag];
+	q->tag[tag]=NULL;
+	--q->ntag;
+	account_request(host,req,error,q->tag_start[tag],rdtsc());
+	exit_queue(host,eflags);
+	check_error(host,req->dev,error);
+
+	complete_request(host,req,error);
+}
+
+
+/*
+ * 発行中のTCQの要求を全てエラーで終わらせる
+ * エラーになるとドライブはキューの全てのコマンドを捨てる
+ * parameters : Host number,Error number
+ */
+void abort_tcq(int host,int error)
+{
+	REQ_QUEUE *q;
+	int i;
+
+
+	q=&req_queue[host];
+	q->intr=0;
+	q->tcq_cur=TCQ_MAX;
+	outb(ide_base[host]+IDE_BMIC,0);			/* Stop Bus Master */
+	for(i=0;i<TCQ_MAX;++i)
+		if(q->tag[i]!=NULL)end_tcq(host,i,error);
+	q->tcq_cur=-1;
+
+	start_queue(host);
+}
+
+
+/*
+ * SERVICEを発行して、ドライブが選んだtagの転送を始める
+ * parameters : Host number
+ * return : 0 or Error number
+ */
+int service_tcq(int host)
+{
+	REQ_QUEUE *q;
+	ATA_REQ *req;
+	int status;
+	int tag;
+	int error;
+
+
+	q=&req_queue[host];
+
+	outb(reg[host].cmr,0xa2);					/* Issue service command */
+	micro_timer(1);								/* 400ns wait */
+	status=check_busy(reg[host].str);
+	if(status&(BSY_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"service_tcq");
+
+	tag=inb(reg[host].scr)>>3;
+	if((tag>=TCQ_MAX)||((req=q->tag[tag])==NULL))return PRINT_ERR(EDERRE,"service_tcq");
+	if((error=set_prd(host,req->seg,req->nseg,req->mode))!=0)return error;
+
+	q->tcq_cur=tag;
+	q->time=rdtsc();
+	q->intr=1;
+	start_dma(host,req->mode);
+
+	return 0;
+}
+
+
+/*
+ * TCQの割り込み処理
+ * バス解放ならtagはドライブのキューに入り、そうでなければtagの転送が終わった
+ * SERVICEが要求されていればSERVICEを発行し、なければ次の要求を発行する
+ * parameters : Host number
+ */
+void intr_tcq(int host)
+{
+	REQ_QUEUE *q;
+	uint eflags;
+	int status;
+	int tag;
+	int error;
+
+
+	q=&req_queue[host];
 
 	/*
-	 * 割り込みの設定
-	 * 8259PICの場合マスクしても割り込みは保持されているので、マスク解除の後
-	 * タイマーを入れて、ハンドラ設定前に割り込みを発生させる。
+	 * 発行中に来た前の割り込みは、発行時にクリアーされているので無視する
+	 * 処理中はtcq_curをTCQ_MAXにしてバスを確保する。発行中や処理中に来た割り込みも無視する
 	 */
-	release_irq_mask(PRIM_IRQ);
-	release_irq_mask(SECOND_IRQ);
-	mili_timer(2);
-	irq_entry[IRQ14]=prim_intr_handler;
-	irq_entry[IRQ15]=second_intr_handler;
+	eflags=enter_queue(host);
+	if((q->tcq_cur==TCQ_MAX)||((inb(ide_base[host]+IDE_BMIS)&(BMIS_INTR|BMIS_ERR))==0))
+	{
+		exit_queue(host,eflags);
+		return;
+	}
+	tag=q->tcq_cur;
+	q->tcq_cur=TCQ_MAX;
+	q->intr=0;
+	exit_queue(host,eflags);
+
+	status=end_dma(host);
+	outb(ide_base[host]+IDE_BMIS,0x6);			/* Clear interrupt bit and error bit */
+
+	if(status&(ERR_BIT|DF_BIT))
+	{
+		abort_tcq(host,PRINT_ERR(EDERRE,"intr_tcq"));
+		return;
+	}
+
+	/* バス解放でなければtagの転送完了 */
+	if((tag>=0)&&(tag<TCQ_MAX)&&((inb(reg[host].irr)&REL_BIT)==0))end_tcq(host,tag,0);
+
+	q->time=rdtsc();
+	if(status&SRV_BIT)
+	{
+		if((error=service_tcq(host))!=0)abort_tcq(host,error);
+		return;
+	}
+
+	q->tcq_cur=-1;
+	start_queue(host);
+}
+
+
+/*
+ * 割り込みを待っているコマンドのタイムアウトを調べる
+ * タイムアウトならバスマスターを止めてホストをリセットする
+ * リセットでバスを解放しているoverlapのATAPIのコマンドも消えるので、一緒にエラーにする
+ * parameters : Host number
+ */
+void check_timeout(int host)
+{
+	REQ_QUEUE *q;
+	ATA_REQ *ovl;
+	uint eflags;
+	int timeout;
+	int error;
+
+
+	q=&req_queue[host];
+
+	eflags=enter_queue(host);
+	timeout=((q->intr!=0)||(q->ntag>0))&&(rdtsc()-q->time>time_out);
+	if(timeout)q->intr=0;
+	else if((q->cur==NULL)&&(q->ovl!=NULL)&&(rdtsc()-q->ovl_time>time_out))
+	{
+		/* SERVICEを要求してこない */
+		q->cur=q->ovl;
+		q->ovl=NULL;
+		q->start=q->ovl_start;
+		timeout=1;
+	}
+	ovl=NULL;
+	if(timeout)
+	{
+		ovl=q->ovl;
+		q->ovl=NULL;
+	}
+	exit_queue(host,eflags);
+	if(timeout==0)return;
+
+	outb(ide_base[host]+IDE_BMIC,0);			/* Stop Bus Master */
+	reset_host(host);
+	error=PRINT_ERR(ETIMEOUT,"check_timeout");
+	if(ovl!=NULL)
+	{
+		eflags=enter_queue(host);
+		account_request(host,ovl,error,q->ovl_start,rdtsc());
+		exit_queue(host,eflags);
+		complete_request(host,ovl,error);
+	}
+	if(q->ntag>0)abort_tcq(host,error);
+	else end_request(host,error);
+}
+
+
+/*
+ * 要求をキューに入れる
+ * parameters : Host number,Request
+ * return : 0 or Error number
+ */
+int queue_request(int host,ATA_REQ *req)
+{
+	CONECT_DEV *cd;
+	uint eflags;
+	uint bytes;
+	int i;
+
+
+	cd=&conect_dev[host][req->dev];
+
+	req->host=host;
+	req->time=rdtsc();
+	req->run=0;
+	req->done=0;
+	req->error=0;
+	req->skip=0;
+	req->wait.proc=NULL;
+	req->wait.flag=0;
+
+	/* 割り込みで完了できない転送はプロセスで処理する */
+	req->flag=((req->mode==CTRL)||(intr_transfer(cd)==0))?REQ_PROC:0;
+
+	if(req->mode==CTRL)req->count=0;
+	else
+	{
+		if(cd->sector_size==0)return PRINT_ERR(ENODEV,"queue_request");
+		for(bytes=0,i=0;i<req->nseg;++i)bytes+=req->seg[i].size;
+		if(bytes%cd->sector_size!=0)return PRINT_ERR(EINVAL,"queue_request");
+		req->count=bytes/cd->sector_size;
+		if((uint64)req->begin+req->count>cd->all_sectors)return PRINT_ERR(EINVAL,"queue_request");
+
+		/* 転送なし */
+		if(req->count==0)
+		{
+			if(req->callback!=NULL)req->callback(req);
+			else req->done=1;
+			return 0;
+		}
+	}
+
+	eflags=enter_queue(host);
+	insert_request(host,req);
+	++req_queue[host].stat.request;
+	exit_queue(host,eflags);
+
+	start_queue(host);
+
+	return 0;
+}
+
+
+/*
+ * 要求の完了を待つ
+ * プロセスで処理する要求は、順番が来たらここで処理する
+ * parameters : Host number,Request
+ * return : 0 or Error number
+ */
+int wait_request(int host,ATA_REQ *req)
+{
+	ATA_REQ *r;
+	uint eflags;
+	int done,run;
+	int count;
+
+
+	for(;;)
+	{
+		/*
+		 * 完了フラグはロック中に見る
+		 * ロックを外した後は、完了させた側がreqに触ることはない
+		 */
+		eflags=enter_queue(host);
+		done=req->done;
+		run=req->run;
+		req->run=0;
+		exit_queue(host,eflags);
+
+		if(done)return req->error;
+		if(run)
+		{
+			/* 順番が来るまでに他のデバイスの割り込みで起こされていても、それはこのコマンドの割り込みではない */
+			wait_intr_queue[host].flag=0;
+
+			/* ホスト占有要求は、順番が来たら占有したまま戻る */
+			if(req->mode==CTRL)return 0;
+
+			for(count=0,r=req;r!=NULL;r=r->next)count+=r->count;
+			set_request_seg(host);
+			end_request(host,do_transfer(host,req->dev,req->mode,req_queue[host].seg,req_queue[host].nseg,count,req->begin));
+		}
+		else
+		{
+			/* 割り込みで転送中の要求は、短ければ寝ずに待つ */
+			if((req_queue[host].cur==req)&&((req->flag&REQ_PROC)==0))
+			{
+				if(spin_dma(host,req->dev,req_queue[host].size,&req->wait,&req_queue[host].time)&&(req->wait.flag>0))
+					++dev_stat[host][req->dev].poll;
+				else ++dev_stat[host][req->dev].sleep;
+			}
+			wait_intr(&req->wait,TIME_OUT);
+			if(req->wait.flag==-1)check_timeout(host);
+		}
+	}
+}
+
+
+/*
+ * キューの順番でホストを占有する
+ * 転送以外のコマンドを発行する前に呼ぶ
+ * parameters : Host number,Device number,Request buffer
+ */
+void lock_host(int host,int dev,ATA_REQ *req)
+{
+	req->dev=dev;
+	req->mode=CTRL;
+	req->prio=dev_prio[host][dev];
+	req->begin=0;
+	req->seg=NULL;
+	req->nseg=0;
+	req->callback=NULL;
+	queue_request(host,req);
+	wait_request(host,req);
+}
+
+
+/*
+ * ホストの占有を解除する
+ * parameters : Host number,Request buffer
+ */
+void unlock_host(int host,ATA_REQ *req)
+{
+	end_request(host,0);
+}
+
+
+/*
+ * 転送モードを切り替えたデバイスの、キューに残っている要求の処理方法を決め直す
+ * 割り込みで完了できなくなった要求は、待っているプロセスがいれば順番が来た時にそのプロセスが処理する。
+ * callbackで完了させる要求は待つプロセスがいないので、ホストを占有しているここで転送して完了させる
+ * lock_host()中に呼ぶ
+ * parameters : Host number,Device number
+ */
+void requeue_mode(int host,int dev)
+{
+	REQ_QUEUE *q;
+	ATA_REQ **p,*req,*next,*list,**tail;
+	uint64 start;
+	uint eflags;
+	int flag;
+	int error;
+
+
+	q=&req_queue[host];
+	flag=intr_transfer(&conect_dev[host][dev])?0:REQ_PROC;
+
+	eflags=enter_queue(host);
+	for(list=NULL,tail=&list,p=&q->head;(req=*p)!=NULL;)
+	{
+		if((req->dev==dev)&&(req->mode!=CTRL))
+		{
+			if(flag&&(req->callback!=NULL))
+			{
+				*p=req->next;
+				*tail=req;
+				tail=&req->next;
+				continue;
+			}
+			req->flag=flag;
+		}
+		p=&req->next;
+	}
+	*tail=NULL;
+	exit_queue(host,eflags);
+
+	for(req=list;req!=NULL;req=next)
+	{
+		next=req->next;
+		req->next=NULL;
+		start=rdtsc();
+		error=do_transfer(host,dev,req->mode,req->seg,req->nseg,req->count,req->begin);
+		eflags=enter_queue(host);
+		account_request(host,req,error,start,rdtsc());
+		exit_queue(host,eflags);
+		complete_request(host,req,error);
+	}
+}
+
+
+/*
+ * Scatter gather data transfer
+ * parameters : Host number,Device number,Mode=READ or WRITE,Segment list,Number of segments,begin block
+ * return : Transfer blocks or Error number
+ */
+int transfer_sg(int host,int dev,int mode,ATA_SEG *seg,int nseg,size_t begin)
+{
+	ATA_REQ req;
+	int error;
+
+
+	if(conect_dev[host][dev].downgrade)downgrade_mode(host,dev);
+
+	req.host=host;
+	req.dev=dev;
+	req.mode=mode;
+	req.seg=seg;
+	req.nseg=nseg;
+	req.begin=begin;
+	req.callback=NULL;
+	req.prio=dev_prio[host][dev];
+	if((error=queue_request(host,&req))!=0)return error;
+
+	return ((error=wait_request(host,&req))!=0)?error:req.count;
+}
+
+
+/*
+ * Data transfer
+ * parameters : Host number,Device number,Mode=READ or WRITE,buffer,Transfer blocks,begin block
+ * return : Transfer size or Error number
+ */
+extern inline int transfer(int host,int dev,int mode,void *buf,size_t blocks,size_t begin)
+{
+	ATA_SEG seg;
+
+
+	seg.addr=buf;
+	seg.size=blocks*conect_dev[host][dev].sector_size;
+
+	return transfer_sg(host,dev,mode,&seg,1,begin);
+}
+
+
+/*
+ * Check busy flag in status register
+ * parameters : Stat register,Mask,Compare rest value
+ * return : Status value
+ */
+int check_busy(int str)
+{
+	uchar in;
+	uint64 count;
+
+
+	count=rdtsc();
+	while((in=inb(str))&BSY_BIT)
+		if(rdtsc()-count>time_out)return in;
+
+	return in;
+}
+
+
+/*
+ * Set interrupt mode
+ * parameters : Host,Interrupt mode
+ */
+void set_intr(int host,int flag)
+{
+	if(flag==current_intr[host])return;
+
+	if(flag==INTR_DISABLE)
+	{
+		set_irq_mask(irq_num[host]);
+		outb(reg[host].ctr,0x2);			/* Disable interrupt */
+		mili_timer(5);						/* wait */
+		current_intr[host]=INTR_DISABLE;
+	}
+	else
+	{
+		/*
+		 * ポーリングしたコマンドのINTRQが残っていると、nIENを落とした時点で割り込みが入るので
+		 * 選択中のデバイスのステータスを読んで落としておく
+		 */
+		inb(reg[host].str);
+		outb(reg[host].ctr,0);				/* Enable interrupt */
+		release_irq_mask(irq_num[host]);
+		mili_timer(5);						/* wait */
+		current_intr[host]=INTR_ENABLE;
+	}
+}
+
+
+/*
+ * 割り込みトレースを記録する
+ * CPUごとのリングに割り込みハンドラーだけが書き込むので、ロックはいらない
+ * 満杯の場合は捨てて数える
+ * parameters : Host number,Bus Master IDE status
+ */
+void trace_intr(int host,uchar bmis)
+{
+	TRACE_RING *ring;
+	ATA_TRACE *rec;
+	uint head;
+	int cpu;
+
+
+	if(trace_on==0)return;
+
+	cpu=(MFPS_addres)?get_current_cpu():0;
+	if((uint)cpu>=TRACE_CPU)return;
+	ring=&trace_ring[cpu];
+
+	head=ring->head;
+	if(head-ring->tail>=TRACE_SIZE)
+	{
+		++ring->lost;
+		return;
+	}
+	rec=&ring->rec[head&(TRACE_SIZE-1)];
+	rec->time=rdtsc();
+	rec->irq=irq_num[host];
+	rec->bmis=bmis;
+	rec->status=inb(reg[host].astr);			/* Alternate statusは割り込みを解除しない */
+	rec->cpu=cpu;
+
+	/* レコードを書き終えてからheadを進める */
+	asm volatile("":::"memory");
+	ring->head=head+1;
+}
+
+
+/*
+ * 割り込みトレースを読み出す
+ * 全CPUのリングから読み出したレコードは捨てる
+ * lostは割り込みハンドラーが他のCPUで増やすので0に戻さず、前回読んだ値からの増分を返す
+ * parameters : Read parameters
+ * return : 0
+ */
+int read_trace(ATA_TRACE_READ *param)
+{
+	TRACE_RING *ring;
+	uint head,tail,lost;
+	int num;
+	int i;
+
+
+	wait_proc(&trace_lock);
+
+	param->lost=0;
+	for(num=0,i=0;i<TRACE_CPU;++i)
+	{
+		ring=&trace_ring[i];
+		head=ring->head;
+		asm volatile("":::"memory");
+		for(tail=ring->tail;(tail!=head)&&(num<param->num);++tail,++num)
+			memcpy(&param->buf[num],&ring->rec[tail&(TRACE_SIZE-1)],sizeof(ATA_TRACE));
+		asm volatile("":::"memory");
+		ring->tail=tail;
+		lost=ring->lost;
+		param->lost+=lost-ring->lost_read;
+		ring->lost_read=lost;
+	}
+	param->num=num;
+
+	wake_proc(&trace_lock);
+
+	return 0;
+}
+
+
+/*
+ * 割り込みが発行中のコマンドのものか
+ * バスマスターを起動する前の割り込みは、選んだデバイスに残っていた前のコマンドのINTRQなので無視する
+ * parameters : Host number,Bus Master IDE status
+ * return : 1=発行中のコマンドの割り込み,0=違う
+ */
+static inline int own_intr(int host,uchar bmis)
+{
+	if((bmis&(BMIS_INTR|BMIS_ERR))==0)return 0;
+	if(req_queue[host].ntag>0)return 1;
+	return req_queue[host].intr&&(inb(ide_base[host]+IDE_BMIC)&BMIC_START);
+}
+
+
+/*
+ * Primary ATA interrupt handler
+ * return : Task switch on
+ */
+int prim_intr_handler()
+{
+	uchar bmis;
+
+
+	bmis=(ide_base[0]!=0)?inb(ide_base[0]+IDE_BMIS):0;
+	trace_intr(0,bmis);
+	intr_clock[0]=rdtsc();
+	if(own_intr(0,bmis))intr_request(0);
+	else if(req_queue[0].ovl!=NULL)start_queue(0);	/* overlapのATAPIのSERVICE要求 */
+	else wake_intr(&wait_intr_queue[0]);
+
+	return (spinning[0])?0:1;					/* ポーリング中のプロセスが動いていればタスクスイッチしない */
+}
+
+
+/*
+ * Secondary ATA interrupt handler
+ * return : Task switch on
+ */
+int second_intr_handler()
+{
+	uchar bmis;
+
+
+	bmis=(ide_base[1]!=0)?inb(ide_base[1]+IDE_BMIS):0;
+	trace_intr(1,bmis);
+	intr_clock[1]=rdtsc();
+	if(own_intr(1,bmis))intr_request(1);
+	else if(req_queue[1].ovl!=NULL)start_queue(1);	/* overlapのATAPIのSERVICE要求 */
+	else wake_intr(&wait_intr_queue[1]);
+
+	return (spinning[1])?0:1;					/* ポーリング中のプロセスが動いていればタスクスイッチしない */
+}
+
+
+/*
+ * 転送モードを一段下げる
+ * ULTRA DMAは一つ下のモード、なくなればMulti DMA、その次はPIOにする
+ * parameters : Host number,Device number
+ */
+void downgrade_mode(int host,int dev)
+{
+	CONECT_DEV *cd;
+	ATA_REQ req;
+	int error;
+
+
+	cd=&conect_dev[host][dev];
+	lock_host(host,dev,&req);
+
+	cd->downgrade=0;
+	cd->err_count=0;
+	error=-1;
+	if(cd->mode==U_DMA)
+	{
+		cd->udma_mask&=(1<<(cd->xfer&0x7))-1;
+		if(cd->udma_mask!=0)error=change_mode(host,dev,U_DMA);
+		if(error!=0)error=change_mode(host,dev,M_DMA);
+	}
+	if(error!=0)error=change_mode(host,dev,PIO);
+	requeue_mode(host,dev);
+
+	unlock_host(host,&req);
+
+	printk("%s : transfer mode down %x\n",hd_info[host][dev].name,cd->xfer);
+}
+
+
+/*
+ * 繰り返すCRCエラーとタイムアウトを数える
+ * 割り込み中にも呼ばれるので、モードを下げるのはプロセスに任せる
+ * parameters : Host number,Device number,0 or Error number
+ */
+void check_error(int host,int dev,int error)
+{
+	CONECT_DEV *cd;
+
+
+	cd=&conect_dev[host][dev];
+	if(error==0)
+	{
+		cd->err_count=0;
+		return;
+	}
+
+	/* ATAPIはメディアが変わったかもしれないので、次のopenで調べ直す */
+	if(cd->type==ATAPI)cd->flag&=~MEDIA_BIT;
+
+	if((cd->mode==PIO)||((error!=-ETIMEOUT)&&((error!=-EDERRE)||((inb(reg[host].err)&ICRC_BIT)==0))))return;
+
+	if(++cd->err_count>=ERR_DOWNGRADE)cd->downgrade=1;
+}
+
+
+/*
+ * 転送を止めて転送モードを切り替える
+ * 下げたULTRA DMAモードの制限は解除する
+ * parameters : Host number,Device number,Transfer mode
+ * return : 0 or Error number
+ */
+int set_mode(int host,int dev,int mode)
+{
+	ATA_REQ req;
+	int error;
+
+
+	if((mode!=PIO)&&(mode!=M_DMA)&&(mode!=U_DMA))return PRINT_ERR(EINVAL,"set_mode");
+	if(conect_dev[host][dev].type==0)return PRINT_ERR(ENODEV,"set_mode");
+
+	lock_host(host,dev,&req);
+	conect_dev[host][dev].udma_mask=0x7f;
+	conect_dev[host][dev].err_count=0;
+	conect_dev[host][dev].downgrade=0;
+	error=change_mode(host,dev,mode);
+	requeue_mode(host,dev);
+	unlock_host(host,&req);
+
+	return error;
+}
+
+
+/*
+ * 転送モードを選んでチップセットのタイミングを設定する
+ * ドライブへのSET FEATURESは呼び出し側で出す
+ * parameters : Host number,Device number,Transfer mode(PIO=1 or Multi DMA=2 or Ultra DMA=3),Return subcommand
+ * return : 0 or Error number
+ */
+int prepare_mode(int host,int dev,int mode,uchar *subcm)
+{
+	int level;
+	int error;
+	ushort udma;
+	ID_INFO *id_info;
+	PCI_INFO ide;
+	IDE_CHIP *chip;
+
+
+	/* リセット後の再設定もあるので、同じモードでも設定し直す */
+	id_info=&dev_id[host][dev];
+
+	/* 80芯ケーブルでなければULTRA DMA2まで */
+	udma=id_info->ultra_dma&conect_dev[host][dev].udma_mask;
+	if((id_info->hard_reset_info&CBLID_BIT)==0)udma&=U_DMA2|U_DMA1|U_DMA0;
+
+	if(mode==PIO)
+	{
+		if(id_info->pio&PIO4)level=4;
+		else if(id_info->pio&PIO3)level=3;
+		else level=0;
+		*subcm=(level!=0)?SUB_PIO_FLO|level:SUB_PIO_DEF;
+
+		/* PIOはバスマスターがなくても使える。知っているチップセットならタイミングも合わせる */
+		chip=(search_pci_class(PCI_CLS_IDE,&ide)==-1)?NULL:find_chipset(ide.vender);
+	}
+	else if(mode==M_DMA)
+	{
+		/* Set ATA transfer mode */
+		if(id_info->multi_dma&M_DMA2)level=2;
+		else if(id_info->multi_dma&M_DMA1)level=1;
+		else if(id_info->multi_dma&M_DMA0)level=0;
+		else return PRINT_ERR(ENOSYS,"prepare_mode");
+		*subcm=SUB_M_DMA|level;
+
+		/*
+		 * ULTRA DMA対応のドライブについては、BIOSでIDEがULTRA DMAに
+		 * 設定されているので、その設定を取り消す必要がある
+		 * 知らないチップセットはBIOSの設定のまま使う
+		 */
+		if((error=init_ide_busmaster(host,&ide))!=0)return error;
+		chip=find_chipset(ide.vender);
+	}
+	else if(mode==U_DMA)
+	{
+		/* ULTRA DMAはタイミングを設定できるチップセットだけ */
+		if((error=init_ide_busmaster(host,&ide))!=0)return error;
+		if((chip=find_chipset(ide.vender))==NULL)return PRINT_ERR(ENOSYS,"prepare_mode");
+
+		/* ドライブとチップセットの両方が使える一番速いモード */
+		udma&=chip->udma;
+		for(level=6;level>=0;--level)
+			if(udma&(1<<level))break;
+		if(level<0)return PRINT_ERR(ENOSYS,"prepare_mode");
+		*subcm=SUB_U_DMA|level;
+	}
+	else return PRINT_ERR(EINVAL,"prepare_mode");
+
+	if(chip!=NULL)set_chip_timing(chip,&ide,host,dev,mode,level);
+
+	return 0;
+}
+
+
+/*
+ * Change transfer mode
+ * parameters : Host number,Device number,Transfer mode(PIO=1 or Multi DMA=2 or Ultra DMA=3)
+ * return : 0 or Error number
+ */
+int change_mode(int host,int dev,int mode)
+{
+	uchar subcm;
+	int error;
+
+
+	if((error=prepare_mode(host,dev,mode,&subcm))!=0)return error;
+	if((error=set_features(host,dev,SET_TRANSFER,subcm))!=0)return error;
+	conect_dev[host][dev].mode=mode;
+	conect_dev[host][dev].xfer=subcm;
+
+	return 0;
+}
+
+
+/*
+ * チップセット表を探す
+ * parameters : PCI device id|vender id
+ * return : IDE_CHIP or NULL
+ */
+IDE_CHIP *find_chipset(uint id)
+{
+	IDE_CHIP *chip;
+
+
+	for(chip=ide_chip;chip->id!=0;++chip)
+		if(chip->id==id)return chip;
+
+	return NULL;
+}
+
+
+/*
+ * PCIコンフィギュレーションレジスタのビットを書き換える
+ * 4byte境界に合わせて読み書きするので、byteやwordのレジスタにも使える
+ * parameters : PCI_INFO,Register offset,Clear bits,Set bits
+ */
+void change_pci_config(PCI_INFO *ide,int offset,uint clear,uint set)
+{
+	int shift;
+	uint value;
+
+
+	shift=(offset&0x3)*8;
+	offset&=~0x3;
+	value=read_pci_config(ide->bus,ide->dev,ide->func,offset);
+	value=(value&~(clear<<shift))|(set<<shift);
+	writedw_pci_config(ide->bus,ide->dev,ide->func,offset,value);
+}
+
+
+/*
+ * チップセットのタイミングレジスタを設定する
+ * ULTRA DMAは有効ビットとサイクル、PIOとMulti DMAはULTRA DMAを止めてコマンドタイミングを設定する
+ * parameters : IDE_CHIP,PCI_INFO,Host number,Device number,Transfer mode,Mode number
+ */
+void set_chip_timing(IDE_CHIP *chip,PCI_INFO *ide,int host,int dev,int mode,int level)
+{
+	int dn;
+	uint timing,control;
+
+
+	dn=host*2+dev;
+	timing=(mode==PIO)?chip_timing[chip->family].pio[level]:chip_timing[chip->family].mdma[level];
+
+	switch(chip->family)
+	{
+		case CHIP_INTEL:
+			if(mode==U_DMA)
+			{
+				/* 0x48 UDMA enable,0x4a UDMA cycle,0x54 66MHz/100MHz clock */
+				change_pci_config(ide,0x48,0,1<<dn);
+				change_pci_config(ide,0x4a,0x3<<(dn*4),(chip->udma_val[level]&0x3)<<(dn*4));
+				if(chip->udma&U_DMA3)
+					change_pci_config(ide,0x54,(0x1<<dn)|(0x1000<<dn),
+						(((chip->udma_val[level]>>4)==1)?0x1<<dn:0)|(((chip->udma_val[level]>>4)==2)?0x1000<<dn:0));
+				break;
+			}
+			change_pci_config(ide,0x48,1<<dn,0);
+
+			/* IDETIM control : Fast timing,IORDY,Prefetch(ATAのみ) */
+			control=0;
+			if(level>=2)control|=0x1;
+			if((mode==PIO)&&(level>2))control|=0x2;
+			if(conect_dev[host][dev].type==ATA)control|=0x4;
+			if(dev==0)change_pci_config(ide,0x40+host*2,0x330f,control|timing);
+			else
+			{
+				change_pci_config(ide,0x40+host*2,0x00f0,0x4000|(control<<4));
+				change_pci_config(ide,0x44,0xf<<(host*4),(((timing>>10)&0xc)|((timing>>8)&0x3))<<(host*4));
+			}
+			break;
+		case CHIP_VIA:
+			if(mode==U_DMA)change_pci_config(ide,0x50+3-dn,0xff,chip->udma_val[level]);
+			else
+			{
+				change_pci_config(ide,0x50+3-dn,0x40,0);
+				change_pci_config(ide,0x48+3-dn,0xff,timing);
+			}
+			break;
+		case CHIP_SIS:
+			if(mode==U_DMA)change_pci_config(ide,0x40+dn*2,0xf000,chip->udma_val[level]<<8);
+			else change_pci_config(ide,0x40+dn*2,0xf000|0x870f,timing);
+			break;
+	}
+}
+
+
+/*
+ * Init IDE Bus Master
+ * parameters : Host number,PCI_INFO buffer
+ * return : 0 or Error number
+ */
+int init_ide_busmaster(int host,PCI_INFO *ide)
+{
+	ushort com;
+
+
+	/* Serch IDE */
+	if(search_pci_class(PCI_CLS_IDE,ide)==-1)return PRINT_ERR(ENODEV,"init_ide_busmaster");
+
+	/* Test Bus Master enable bit on */
+	com=read_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_COM);
+	writew_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_COM,com|PCI_COM_BM_BIT);
+	if((read_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_COM)&PCI_COM_BM_BIT)==0)return PRINT_ERR(ENOSYS,"init_ide_busmaster");
+
+	/* Get IO base address */
+	if((ide_base[0]=read_pci_config(ide->bus,ide->dev,ide->func,PCI_CONF_BMBASE))==0)return PRINT_ERR(ENOSYS,"init_ide_busmaster");
+	ide_base[0]&=0xfff0;
+	ide_base[1]=ide_base[0]+IDE_BMIO_SECOND;
+
+	/* Reset Bus Master */
+	outb(ide_base[host]+IDE_BMIC,0);
+
+	return 0;
+}
+
+
+/*
+ * PIOのDRQブロックを待つ
+ * 割り込みが有効なら割り込みで起こされるまで寝る。ステータスを読むと割り込みが解除される
+ * 割り込み無効のホストではBSYが落ちるまでポーリングする
+ * parameters : Host number
+ * return : Status coad or Error number
+ */
+int wait_pio(int host)
+{
+	if(current_intr[host]==INTR_ENABLE)
+	{
+		wait_intr(&wait_intr_queue[host],TIME_OUT);		/* Wait interrupt */
+		if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"wait_pio");
+	}
+
+	/* 前のコマンドの割り込みで起こされた場合はここで待つ */
+	return check_busy(reg[host].str);
+}
+
+
+/*
+ * データポートから読み込む
+ * 32bit PIOが有効なら2ワードずつ読み、端数のワードは16bitで読む
+ * parameters : Data port,Buffer,Words,32bit flag
+ */
+static inline void in_pio(int port,void *buf,int count,int pio32)
+{
+	int dcount;
+
+
+#ifdef ATA_SIM
+	sim_in_pio(port,buf,count,pio32);
+	return;
+#endif
+	if(pio32&&(count>=2))
+	{
+		dcount=count/2;
+		asm volatile("cld;rep insl":"+D"(buf),"+c"(dcount):"d"(port):"memory");
+		if((count&1)==0)return;
+		count=1;
+	}
+	asm volatile("cld;rep insw":"+D"(buf),"+c"(count):"d"(port):"memory");
+}
+
+
+/*
+ * データポートに書き込む
+ * parameters : Data port,Buffer,Words,32bit flag
+ */
+static inline void out_pio(int port,void *buf,int count,int pio32)
+{
+	int dcount;
+
+
+#ifdef ATA_SIM
+	sim_out_pio(port,buf,count,pio32);
+	return;
+#endif
+	if(pio32&&(count>=2))
+	{
+		dcount=count/2;
+		asm volatile("cld;rep outsl":"+S"(buf),"+c"(dcount):"d"(port):"memory");
+		if((count&1)==0)return;
+		count=1;
+	}
+	asm volatile("cld;rep outsw":"+S"(buf),"+c"(count):"d"(port):"memory");
+}
+
+
+/*
+ * PIO read data
+ * ブロックがセグメントを跨ぐ場合は次のセグメントに続けて読み込む
+ * 割り込みが有効なら、各ブロックの前の割り込みを寝て待つ
+ * 1ブロック(DRQ)ごとにblockバイトずつ、最後のブロックは残りを転送する
+ * parameters : Host number,Device number,Segment list,Number of segments,Block size,Transfer bytes
+ * return : Status coad
+ */
+int read_pio(int host,int dev,ATA_SEG *seg,int nseg,int block,uint bytes)
+{
+	int error;
+	int dtr;
+	short *buf;
+	uint rest;
+	uint size;
+	int pio32;
+	int j,last;
+
+
+	dtr=reg[host].dtr;
+	pio32=conect_dev[host][dev].flag&PIO32_BIT;
+	buf=(short*)seg->addr;
+	rest=seg->size;
+	for(;bytes>0;bytes-=size)
+	{
+		size=(bytes<block)?bytes:block;
+		if(((error=wait_pio(host))&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return error;
+		for(last=size/2;last>0;last-=j)
+		{
+			while(rest<2)
+			{
+				if(--nseg==0)return PRINT_ERR(EINVAL,"read_pio");
+				buf=(short*)(++seg)->addr;
+				rest=seg->size;
+			}
+			j=(last<rest/2)?last:rest/2;
+			in_pio(dtr,buf,j,pio32);
+			buf+=j;
+			rest-=j*2;
+		}
+	}
+
+	return check_busy(reg[host].str);
+}
+
+
+/*
+ * PIO write data
+ * ブロックがセグメントを跨ぐ場合は次のセグメントから続けて書き込む
+ * 割り込みが有効なら、2番目以降の各ブロックの前と最後のブロックの後の割り込みを寝て待つ
+ * 1ブロック(DRQ)ごとにblockバイトずつ、最後のブロックは残りを転送する
+ * parameters : Host number,Device number,Segment list,Number of segments,Block size,Transfer bytes
+ * return : Status coad
+ */
+int write_pio(int host,int dev,ATA_SEG *seg,int nseg,int block,uint bytes)
+{
+	int error;
+	int dtr;
+	short *buf;
+	uint rest;
+	uint size;
+	int pio32;
+	int first;
+	int j,last;
+
+
+	dtr=reg[host].dtr;
+	pio32=conect_dev[host][dev].flag&PIO32_BIT;
+	buf=(short*)seg->addr;
+	rest=seg->size;
+	for(first=1;bytes>0;bytes-=size,first=0)
+	{
+		/* 最初のブロックは割り込みが来ないのでDRQを待つ */
+		size=(bytes<block)?bytes:block;
+		error=first?check_busy(reg[host].str):wait_pio(host);
+		if((error&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return error;
+		for(last=size/2;last>0;last-=j)
+		{
+			while(rest<2)
+			{
+				if(--nseg==0)return PRINT_ERR(EINVAL,"write_pio");
+				buf=(short*)(++seg)->addr;
+				rest=seg->size;
+			}
+			j=(last<rest/2)?last:rest/2;
+			out_pio(dtr,buf,j,pio32);
+			buf+=j;
+			rest-=j*2;
+		}
+	}
+
+	return wait_pio(host);
+}
+
+
+/*
+ * 仮想アドレスを物理アドレスに変換する
+ * CR3からページテーブルをたどる。ページテーブルはカーネルの物理アドレスと同じ番地にあること
+ * parameters : Virtual address
+ * return : Physical address or PHYS_NONE
+ */
+uint virt_to_phys(uint addr)
+{
+#ifdef ATA_SIM
+	return addr;
+#else
+	uint cr0,cr3,pde,pte;
+
+
+	asm volatile("movl %%cr0,%0":"=r"(cr0));
+	if((cr0&CR0_PG)==0)return addr;
+
+	asm volatile("movl %%cr3,%0":"=r"(cr3));
+	pde=((uint*)(cr3&~(DMA_PAGE-1)))[addr>>22];
+	if((pde&PG_PRESENT)==0)return PHYS_NONE;
+	if(pde&PG_LARGE)return (pde&0xffc00000)|(addr&0x3fffff);
+
+	pte=((uint*)(pde&~(DMA_PAGE-1)))[(addr>>12)&0x3ff];
+	if((pte&PG_PRESENT)==0)return PHYS_NONE;
+
+	return (pte&~(DMA_PAGE-1))|(addr&(DMA_PAGE-1));
+#endif
+}
+
+
+/*
+ * ページ内の領域をそのままDMAできるか調べる
+ * ページが無い、ワード境界でない領域はバウンスバッファーを通す。
+ * バウンスバッファーに奇数バイトを入れたら、偶数になるまで続けてバウンスバッファーを使う
+ * parameters : Virtual address,Bytes in page,Return physical address,Odd flag
+ * return : 1=バウンスバッファーを使う,0=そのままDMAする
+ */
+int need_bounce(uint addr,uint len,uint *phys,int *odd)
+{
+	if((*odd==0)&&(((addr|len)&1)==0)&&((*phys=virt_to_phys(addr))!=PHYS_NONE))return 0;
+
+	*odd^=len&1;
+
+	return 1;
+}
+
+
+/*
+ * Set PRD table
+ * セグメントをページごとに物理アドレスに変換し、物理的に連続していれば1つのエントリーにまとめる。
+ * DMAできないページはバウンスバッファーを通す。書き込みはここでコピーし、読み込みはend_dma()でコピーする
+ * parameters : Host number,Segment list,Number of segments,Mode=READ or WRITE
+ * return : 0 or Error number
+ */
+int set_prd(int host,ATA_SEG *seg,int nseg,int mode)
+{
+	PRD *table;
+	ATA_SEG *bseg;
+	char *bounce;
+	uint addr,size,len,phys,last,count;
+	int odd;
+	int i,n;
+
+
+	table=prd[host];
+	bseg=bounce_seg[host];
+	bounce=bounce_buf[host];
+	bounce_num[host]=0;
+	for(n=0,last=PHYS_NONE,count=0,odd=0,i=0;i<nseg;++i)
+	{
+		addr=(uint)seg[i].addr;
+		for(size=seg[i].size;size>0;addr+=len,size-=len)
+		{
+			len=DMA_PAGE-(addr&(DMA_PAGE-1));
+			if(len>size)len=size;
+
+			if(need_bounce(addr,len,&phys,&odd))
+			{
+				if(bounce+len>bounce_buf[host]+BOUNCE_SIZE)return PRINT_ERR(EINVAL,"set_prd");
+				if(mode==WRITE)memcpy(bounce,(void*)addr,len);
+				else if((bounce_num[host]>0)&&((uint)bseg[bounce_num[host]-1].addr+bseg[bounce_num[host]-1].size==addr))
+					bseg[bounce_num[host]-1].size+=len;
+				else
+				{
+					if(bounce_num[host]==PRD_MAX)return PRINT_ERR(EINVAL,"set_prd");
+					bseg[bounce_num[host]].addr=(void*)addr;
+					bseg[bounce_num[host]++].size=len;
+				}
+				phys=virt_to_phys((uint)bounce);
+				bounce+=len;
+			}
+
+			/* 物理アドレスが続いていて64Kbyte境界を跨がなければ前のエントリーにつなげる */
+			if((phys==last)&&((phys&(PRD_BOUNDARY-1))!=0))count+=len;
+			else
+			{
+				if(n==PRD_MAX)return PRINT_ERR(EINVAL,"set_prd");
+				if(n>0)table[n-1].count=count&(PRD_BOUNDARY-1);		/* 0は64Kbyte */
+				table[n++].phys_addr=(void*)phys;
+				count=len;
+			}
+			last=phys+len;
+		}
+	}
+	if(n==0)return PRINT_ERR(EINVAL,"set_prd");
+	table[n-1].count=(count&(PRD_BOUNDARY-1))|PRD_EOT;
+
+	outdw(ide_base[host]+IDE_BMIDTP,virt_to_phys((uint)table));
+
+	return 0;
+}
+
+
+/*
+ * Start Bus Master
+ * PRDテーブルを設定してから呼ぶ
+ * parameters : Host number,Mode=READ or WRITE
+ */
+void start_dma(int host,int trans_mode)
+{
+	/*
+	 * バスマスターステータスレジスタの割り込みフラグをクリアーしないと
+	 * 割り込みが発生しないようだ
+	 */
+	outb(ide_base[host]+IDE_BMIS,0x6);			/* Clear interrupt bit and error bit */
+	outb(ide_base[host]+IDE_BMIC,(trans_mode==READ)?0x9:0x1);	/* Start Bus Master */
+}
+
+
+/*
+ * Stop Bus Master
+ * バウンスバッファーに読み込んだデータを要求のバッファーにコピーする
+ * parameters : Host number
+ * return : Status coad
+ */
+int end_dma(int host)
+{
+	char *bounce;
+	int i;
+
+
+	outb(ide_base[host]+IDE_BMIC,0);			/* Stop Bus Master */
+
+	for(bounce=bounce_buf[host],i=0;i<bounce_num[host];bounce+=bounce_seg[host][i++].size)
+		memcpy(bounce_seg[host][i].addr,bounce,bounce_seg[host][i].size);
+	bounce_num[host]=0;
+
+	return inb(reg[host].str);
+}
+
+
+/*
+ * 短いDMAコマンドの完了時間を履歴に入れる
+ * parameters : Host number,Device number,Transfer bytes,コマンドの開始から完了割り込みまでのclock
+ */
+void update_dma_hist(int host,int dev,uint bytes,uint64 clock)
+{
+	DMA_HIST *hist;
+
+
+	if(bytes>SPIN_BYTES)return;
+
+	hist=&dma_hist[host][dev];
+	if(clock<spin_max)
+	{
+		hist->ratio+=(256-hist->ratio)>>SPIN_SHIFT;
+		if(hist->fast==0)hist->fast=(clock!=0)?clock:1;
+		else hist->fast+=(int)(clock-hist->fast)>>SPIN_SHIFT;
+	}
+	else hist->ratio-=hist->ratio>>SPIN_SHIFT;
+}
+
+
+/*
+ * DMAの完了をポーリングで待つ
+ * SPIN_BYTES以下の転送で、最近SPIN_MAXより短く完了することが多いデバイスは、コマンドの開始から
+ * 短いコマンドの平均の1.5倍まで寝ずにバスマスターステータスを見る。
+ * 割り込みのwake upと再スケジュールより早く終わるなら寝ない方が速い。割り込みハンドラーはポーリング中は完了処理をしてもタスクスイッチしない
+ * parameters : Host number,Device number,Transfer bytes,Wait queue,Command start clock
+ * return : 1=完了した,0=寝て待つ
+ */
+int spin_dma(int host,int dev,uint bytes,WAIT_INTR *wait,uint64 *start)
+{
+	DMA_HIST *hist;
+	uint64 budget;
+	int done;
+
+
+	hist=&dma_hist[host][dev];
+	if((bytes>SPIN_BYTES)||(hist->fast==0)||(hist->ratio<SPIN_RATIO))return 0;
+	budget=hist->fast+hist->fast/2;
+	if(budget>spin_max)budget=spin_max;
+
+	spinning[host]=1;
+	for(done=0;rdtsc()<*start+budget;)
+	{
+		if((wait->flag>0)||(inb(ide_base[host]+IDE_BMIS)&(BMIS_INTR|BMIS_ERR)))
+		{
+			done=1;
+			break;
+		}
+		asm volatile("":::"memory");
+	}
+	spinning[host]=0;
+
+	return done;
+}
+
+
+/*
+ * DMA転送の完了を待つ
+ * 短いDMAはポーリングしてから割り込みを待つ。割り込みが来ていればwait_intr()は寝ずに戻る
+ * parameters : Host number,Device number,Transfer bytes
+ * return : Status coad or Error number
+ */
+int wait_dma(int host,int dev,uint bytes)
+{
+	uint64 start,done;
+	int polled;
+
+
+	start=rdtsc();
+	polled=spin_dma(host,dev,bytes,&wait_intr_queue[host],&start);
+	done=rdtsc();
+
+	/* ポーリングで完了を見ても、割り込みがまだ来ていなければwait_intr()で寝る */
+	polled=polled&&(wait_intr_queue[host].flag>0);
+
+	wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
+	if(wait_intr_queue[host].flag==-1)
+	{
+		end_dma(host);
+		return PRINT_ERR(ETIMEOUT,"wait_dma");
+	}
+
+	/* 寝た場合は割り込みの時刻で完了時間を測る */
+	if(polled)++dev_stat[host][dev].poll;
+	else
+	{
+		++dev_stat[host][dev].sleep;
+		done=intr_clock[host];
+	}
+	update_dma_hist(host,dev,bytes,(done>start)?done-start:0);
+
+	return end_dma(host);
+}
+
+
+/*
+ * DMA read data
+ * parameters : Host number,Device number,Segment list,Number of segments
+ * return : Status coad
+ */
+int read_dma(int host,int dev,ATA_SEG *seg,int nseg)
+{
+	uint bytes;
+	int error;
+	int i;
+
+
+	/* Set PRD */
+	if((error=set_prd(host,seg,nseg,READ))!=0)return error;
+	start_dma(host,READ);
+
+	for(bytes=0,i=0;i<nseg;++i)bytes+=seg[i].size;
+	return wait_dma(host,dev,bytes);
+}
+
+
+/*
+ * DMA write data
+ * parameters : Host number,Device number,Segment list,Number of segments
+ * return : Status coad
+ */
+int write_dma(int host,int dev,ATA_SEG *seg,int nseg)
+{
+	uint bytes;
+	int error;
+	int i;
+
+
+	/* Set PRD */
+	if((error=set_prd(host,seg,nseg,WRITE))!=0)return error;
+	start_dma(host,WRITE);
+
+	for(bytes=0,i=0;i<nseg;++i)bytes+=seg[i].size;
+	return wait_dma(host,dev,bytes);
+}
+
+
+/*
+ * DMAバッファープールの初期化
+ * ページ境界に揃えたページを切り出すので、1ページは1つのPRDエントリーになり64Kbyte境界も跨がない
+ * parameters : Host number
+ */
+void init_dma_pool(int host)
+{
+	DMA_POOL *pool;
+	char *p;
+	int n,i;
+
+
+	pool=&dma_pool[host];
+
+	/* 確保できなければページ数を減らす */
+	for(n=DMA_POOL_BLOCKS;(n>0)&&((pool->mem=(char*)kmalloc(n*DMA_PAGE+DMA_PAGE-1))==NULL);n/=2);
+	if(n==0)return;
+
+	p=(char*)ROUNDUP((uint)pool->mem,DMA_PAGE);
+	for(i=n-1;i>=0;--i)
+	{
+		*(void**)(p+i*DMA_PAGE)=pool->free;
+		pool->free=p+i*DMA_PAGE;
+	}
+	pool->num=pool->min=n;
+}
+
+
+/*
+ * DMAバッファーを1ページ確保する
+ * parameters : Host number
+ * return : Buffer or NULL
+ */
+void *alloc_dma_buf(int host)
+{
+	DMA_POOL *pool;
+	void *buf;
+	uint eflags;
+
+
+	pool=&dma_pool[host];
+	eflags=enter_queue(host);
+	if((buf=pool->free)!=NULL)
+	{
+		pool->free=*(void**)buf;
+		if(--pool->num<pool->min)pool->min=pool->num;
+	}
+	exit_queue(host,eflags);
+
+	return buf;
+}
+
+
+/*
+ * DMAバッファーを返す
+ * parameters : Host number,Buffer
+ */
+void free_dma_buf(int host,void *buf)
+{
+	DMA_POOL *pool;
+	uint eflags;
+
+
+	pool=&dma_pool[host];
+	eflags=enter_queue(host);
+	*(void**)buf=pool->free;
+	pool->free=buf;
+	++pool->num;
+	exit_queue(host,eflags);
+}
+
+
+/*
+ * reset host
+ * parameters : host number
+ * return : 0 or error number
+ */
+int reset_host(int host)
+{
+	int error;
+	int i;
+
+
+	/* soft reset */
+	if((error=soft_reset(host))!=0)return error;
+
+	/* set transfer mode */
+	for(i=0;i<2;++i)
+		if(conect_dev[host][i].type!=0)change_mode(host,i,conect_dev[host][i].mode);
+
+	/* TCQの割り込みを有効にする */
+	for(i=0;i<2;++i)
+		if((conect_dev[host][i].tcq_depth!=0)&&
+			((set_features(host,i,SET_REL_INTR,0)!=0)||(set_features(host,i,SET_SRV_INTR,0)!=0)))
+			conect_dev[host][i].tcq_depth=0;
+
+	/* リセットでMULTIPLEのセクター数が戻っている場合があるので設定し直す */
+	for(i=0;i<2;++i)
+		if((conect_dev[host][i].multiple!=0)&&(set_multiple(host,i,conect_dev[host][i].multiple)!=0))
+			conect_dev[host][i].multiple=0;
+
+	/* ライトキャッシュと先読みも電源投入時の設定に戻るので設定し直す */
+	for(i=0;i<2;++i)
+		if(conect_dev[host][i].type==ATA)
+		{
+			if(dev_id[host][i].cmd1&WCACHE_SUP_BIT)
+				set_drive_cache(host,i,WCACHE_BIT,(conect_dev[host][i].flag&WCACHE_BIT)!=0);
+			if(dev_id[host][i].cmd1&LOOKAHEAD_SUP_BIT)
+				set_drive_cache(host,i,LOOKAHEAD_BIT,(conect_dev[host][i].flag&LOOKAHEAD_BIT)!=0);
+		}
+
+	return 0;
+}
+
+
+/************************************************************************************************
+ *
+ * ATA initialize
+ *
+ ************************************************************************************************/
+
+
+/*
+ * ATAの初期化
+ * 待ち時間の長いソフトリセット、IDENTIFY、設定コマンドは両方のホストに出してからまとめて待つ
+ * return : 0 or Error number
+ */
+int init_ata()
+{
+	uchar cl,ch;
+	int present[2];
+	int drv[2][2];
+	int issued[2];
+	int mode[2];
+	uchar subcm[2];
+	ID_INFO *id_info;
+	int i,j,step;
+
+
+	/* タイムアウト値の代入 */
+	time_out=clock_1m*TIME_OUT;
+	spin_max=clock_1m*SPIN_MAX/1000;
+
+	/* DMAバッファーを先に確保して、以後は一般のアロケーターを使わない */
+	init_dma_pool(0);
+	init_dma_pool(1);
+	if((id_info=(ID_INFO*)alloc_dma_buf(0))==NULL)return PRINT_ERR(ENOMEM,"init_ata");
+
+	/* Buffer cache */
+	init_cache(0);
+	init_cache(1);
+
+	/*
+	 * 両方のホストを同時にソフトリセットして待ち時間を重ねる
+	 * ステータスが0xffならバスがフロートしていてデバイスはない
+	 */
+	for(i=0;i<2;++i)
+	{
+		present[i]=(inb(reg[i].str)!=0xff);
+		if(present[i])outb(reg[i].ctr,0x4);		/* ソフトリセット */
+	}
+	mili_timer(5);								/* 5ms wait */
+	for(i=0;i<2;++i)
+		if(present[i])outb(reg[i].ctr,0x2);		/* リセット解除|割り込み禁止 */
+	mili_timer(20);								/* 20ms wait */
+
+	for(i=0;i<2;++i)
+	{
+		if(present[i]==0)continue;
+		if((check_busy(reg[i].astr)&BSY_BIT)!=0)present[i]=0;
+		else current_intr[i]=0;
+	}
+
+	/*
+	 * 接続デバイスを判定して、両方のホストにIDENTIFYを出してから読む
+	 * ソフトリセット後ATAならATA_CLR=0 ATA_CHR=0、ATAPIならATA_CLR=0x14 ATA_CHR=0xeb
+	 * になる。Identify infomationは1ページにデバイスごとに並べる
+	 */
+	for(j=0;j<2;++j)
+	{
+		for(i=0;i<2;++i)
+		{
+			drv[i][j]=0;
+			if(present[i]==0)continue;
+
+			outb(reg[i].dhr,j<<4);
+			micro_timer(1);						/* 400ns wait */
+			cl=inb(reg[i].clr);
+			ch=inb(reg[i].chr);
+			if((cl==0)&&(ch==0))drv[i][j]=ATA;
+			else if((cl==0x14)&&(ch==0xeb))drv[i][j]=ATAPI;
+			else continue;
+
+			id_info[i*2+j].model[0]=0xff;
+			if(issue_identify(i,j,drv[i][j])!=0)drv[i][j]=0;
+		}
+		for(i=0;i<2;++i)
+			if((drv[i][j]!=0)&&(read_identify(i,j,&id_info[i*2+j])!=0))drv[i][j]=0;
+	}
+
+	for(i=0;i<2;++i)
+		for(j=0;j<2;++j)
+			if(drv[i][j]!=0)setup_device(i,j,drv[i][j],&id_info[i*2+j]);
+	free_dma_buf(0,id_info);
+
+	/* 設定コマンドも1つずつ両方のホストに出してから待つ */
+	for(j=0;j<2;++j)
+		for(step=0;step<INIT_STEP_NUM;++step)
+		{
+			for(i=0;i<2;++i)
+				issued[i]=(conect_dev[i][j].type!=0)?issue_init_step(i,j,step,&mode[i],&subcm[i]):1;
+			for(i=0;i<2;++i)
+				if(issued[i]!=1)end_init_step(i,j,step,mode[i],subcm[i],(issued[i]==0)?wait_nodata(i,"init_ata"):issued[i]);
+		}
+
+	/*
+	 * もう一度確認
+	 * デバイスによっては、同一ホストが存在しない場合確認処理によって
+	 * ビジー状態のままになってしまう。
+	 * フロートしているホストとデバイスのないホストは調べない
+	 */
+	for(i=0;i<2;++i)
+	{
+		if((present[i]==0)||((conect_dev[i][0].type==0)&&(conect_dev[i][1].type==0)))continue;
+		for(j=0;j<2;++j)
+		{
+			outb(reg[i].dhr,j<<4);
+			micro_timer(1);						/* 400ns wait */
+			if((inb(reg[i].astr)&BSY_BIT)==BSY_BIT)reset_host(i);
+		}
+	}
+
+	/* Regster to dev filesystem */
+	for(i=0;i<2;++i)
+		for(j=0;j<2;++j)
+			if(conect_dev[i][j].type!=0)regist_device(&hd_info[i][j]);
+
+	/*
+	 * 割り込みの設定
+	 * 8259PICの場合マスクしても割り込みは保持されているので、マスク解除の後
+	 * タイマーを入れて、ハンドラ設定前に割り込みを発生させる。
+	 */
+	release_irq_mask(PRIM_IRQ);
+	release_irq_mask(SECOND_IRQ);
+	mili_timer(2);
+	irq_entry[IRQ14]=prim_intr_handler;
+	irq_entry[IRQ15]=second_intr_handler;
+
+	return 0;
+}
+
+
+/*
+ * Identify infomationから接続デバイスを設定する
+ * TCQとREAD/WRITE MULTIPLEは使える値を入れておき、設定コマンドが失敗したら0に戻す
+ * parameters : Host number,Device number,ATA or ATAPI,Identify infomation
+ * return : 0 or Error number
+ */
+int setup_device(int host,int dev,int drv,ID_INFO *id_info)
+{
+	CONECT_DEV *cd;
+	char *media;
+
+
+	cd=&conect_dev[host][dev];
+
+	/* ATA disk */
+	if(drv==ATA)
+	{
+		if(id_info->model[0]==0xff)return PRINT_ERR(EDERRE,"setup_device");	/* 読み出しているかをチェック */
+
+		/* Print device infomation */
+		cnv_idinfo_str(id_info->model,40);
+		printk("%s : %s, %s\n",hd_info[host][dev].name,id_info->model,"ATA DISK drive");
+
+		/* LBA all sectors */
+		cd->flag=id_info->cmd2_enable&LBA48_BIT;
+		if(cd->flag&LBA48_BIT)
+		{
+			cd->all_sectors=(uint64)id_info->lba48_all_sect[3]<<48|(uint64)id_info->lba48_all_sect[2]<<32|
+				(uint64)id_info->lba48_all_sect[1]<<16|(uint64)id_info->lba48_all_sect[0];
+			cd->max_count=ATA_COUNT48_MAX;
+		}
+		else
+		{
+			cd->all_sectors=(uint)id_info->lba_all_sect[1]<<16|(uint)id_info->lba_all_sect[0];
+			cd->max_count=ATA_COUNT_MAX;
+		}
+		if(cd->all_sectors==0)
+		{
+			printk("This device is not support LBA. Stop initialize!");
+			return PRINT_ERR(ENOSYS,"setup_device");
+		}
+
+		/* size_tのブロック番号で指定できる範囲まで */
+		if(cd->all_sectors>0xffffffff)cd->all_sectors=0xffffffff;
+
+		cd->type=ATA;
+		cd->sector_size=ATA_SECTOR_SIZE;
+		cd->transfer=_transfer_ata;
+
+		/* TCQはリリース割り込みとSERVICE割り込みが使える場合だけ */
+		cd->tcq_depth=0;
+		if((id_info->cmd2&TCQ_BIT)&&((id_info->cmd1&(REL_INTR_BIT|SRV_INTR_BIT))==(REL_INTR_BIT|SRV_INTR_BIT)))
+			cd->tcq_depth=(id_info->max_cue_size&0x1f)+1;
+
+		/* ライトキャッシュと先読みは電源投入時の設定のまま使い、リセット後に戻す */
+		if(id_info->cmd1_enable&WCACHE_SUP_BIT)cd->flag|=WCACHE_BIT;
+		if(id_info->cmd1_enable&LOOKAHEAD_SUP_BIT)cd->flag|=LOOKAHEAD_BIT;
+
+		/* 1回のDRQで転送できる最大セクター数でREAD/WRITE MULTIPLEを使う */
+		cd->multiple=((id_info->multi_intr&0xff)>1)?id_info->multi_intr&0xff:0;
+
+		hd_info[host][dev].last_blk=cd->all_sectors-1;
+		hd_info[host][dev].sector_size=ATA_SECTOR_SIZE;
+	}
+
+	/* ATAPI device */
+	else
+	{
+		/* Print device infomation */
+		cnv_idinfo_str(id_info->model,40);
+		switch((id_info->config>>8)&0x1f)		/* Medium name */
+		{
+			case 0x5:
+				media="ATAPI CDROM drive";
+				break;
+			default:
+				media="ATAPI OTHER drive";
+				break;
+		}
+		printk("%s : %s, %s\n",hd_info[host][dev].name,id_info->model,media);
+
+		cd->flag=id_info->iordy;
+		cd->max_count=ATAPI_COUNT_MAX;
+		cd->type=ATAPI;
+		cd->transfer=_transfer_atapi;
+	}
+
+	/* Identify infomationはここで保存して以後読み直さない */
+	memcpy(&dev_id[host][dev],id_info,IDENTIFY_SIZE);
+
+	return 0;
+}
+
+
+/*
+ * 初期化の設定コマンドを発行する
+ * 完了はwait_nodata()で待ってend_init_step()に渡す
+ * parameters : Host number,Device number,INIT_*,Return transfer mode,Return subcommand
+ * return : 0=発行した,1=出すコマンドがない,or Error number
+ */
+int issue_init_step(int host,int dev,int step,int *mode,uchar *subcm)
+{
+	CONECT_DEV *cd;
+	ID_INFO *id_info;
+
+
+	cd=&conect_dev[host][dev];
+	id_info=&dev_id[host][dev];
+
+	switch(step)
+	{
+		case INIT_PARAM:
+			if((cd->type!=ATA)||((uchar)id_info->n_head>0xf))return 1;
+			return issue_nodata(host,(dev<<4)|(uchar)id_info->n_head,0,(uchar)id_info->n_sect,0x91);
+		case INIT_REL_INTR:
+			if(cd->tcq_depth==0)return 1;
+			return issue_nodata(host,dev<<4,SET_REL_INTR,0,0xef);
+		case INIT_SRV_INTR:
+			if(cd->tcq_depth==0)return 1;
+			return issue_nodata(host,dev<<4,SET_SRV_INTR,0,0xef);
+		case INIT_MULTIPLE:
+			if(cd->multiple==0)return 1;
+			return issue_nodata(host,dev<<4,0,(uchar)cd->multiple,0xc6);
+		case INIT_IDLE:
+			return issue_nodata(host,dev<<4,0,0,0xe1);
+		case INIT_MODE:
+			/* ドライブとチップセットが対応する一番速いモードにする */
+			cd->udma_mask=0x7f;
+			for(*mode=U_DMA;*mode>=PIO;--*mode)
+				if(prepare_mode(host,dev,*mode,subcm)==0)return issue_nodata(host,dev<<4,SET_TRANSFER,*subcm,0xef);
+			return PRINT_ERR(ENOSYS,"issue_init_step");
+	}
+	return 1;
+}
+
+
+/*
+ * 初期化の設定コマンドの結果を反映する
+ * 転送モードの設定に失敗したら、遅いモードを順に試す
+ * parameters : Host number,Device number,INIT_*,Transfer mode,Subcommand,0 or Error number
+ */
+void end_init_step(int host,int dev,int step,int mode,uchar subcm,int error)
+{
+	CONECT_DEV *cd;
+
+
+	cd=&conect_dev[host][dev];
+
+	switch(step)
+	{
+		case INIT_REL_INTR:
+		case INIT_SRV_INTR:
+			if(error!=0)cd->tcq_depth=0;
+			break;
+		case INIT_MULTIPLE:
+			if(error!=0)cd->multiple=0;
+			break;
+		case INIT_MODE:
+			if(error==0)
+			{
+				cd->mode=mode;
+				cd->xfer=subcm;
+				break;
+			}
+			for(--mode;mode>=PIO;--mode)
+				if((error=change_mode(host,dev,mode))==0)break;
+			if(error!=0)printk("Transfer mode set error : %x\n",error);
+			break;
+	}
+}
+
+
+/*
+ * ワードのビッグエンディアンをリトルエンディアンに変える
+ * parameters : string address,string length
+ * return : string address
+ */
+char *cnv_idinfo_str(char *str,int len)
+{
+	char c;
+	int count;
+	int i;
+
+
+	/*
+	 * ' 'が２つつづいたら'\0'を入れる
+	 */
+	count=0;
+	for(i=0;i<len;++i)
+	{
+		c=str[i];
+		str[i]=str[i+1];
+		str[i+1]=c;
+
+		if(str[i]==' ')++count;
+		else count=0;
+		if(count==2)break;
+		if(str[++i]==' ')++count;
+		else count=0;
+		if(count==2)break;
+	}
+	str[--i]='\0';
+
+	return str;
+}
+
+
+/*
+ * ソフトウェアリセット
+ * parameters : コントロールレジスタ
+ * return : 0 or Error number
+ */
+int soft_reset(int host)
+{
+	outb(reg[host].ctr,0x4);	/* ソフトリセット */
+	mili_timer(5);				/* 5ms wait */
+	outb(reg[host].ctr,0x2);	/* リセット解除|割り込み禁止 */
+	mili_timer(20);				/* 20ms wait */
+	if((check_busy(reg[host].astr)&BSY_BIT)!=0)return PRINT_ERR(EDBUSY,"soft_reset");
+
+	return 0;
+}
+
+
+/************************************************************************************************
+ *
+ * ATA command protocol
+ *
+ ************************************************************************************************/
+
+
+/*
+ * デバイスセレクション
+ * parameters : Device number,Host number
+ * return : 0 or Error number
+ */
+int device_select(int host,int dev)
+{
+	int error;
+
+
+	if(((error=check_busy(reg[host].astr))&(DRQ_BIT|BSY_BIT))!=0)
+	{
+		if(error&DRQ_BIT)return PRINT_ERR(EDERRE,"device_select");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"device_select");
+	}
+
+	/* Device select */
+	outb(reg[host].dhr,(uchar)dev|0xa0);
+	micro_timer(1);					/* 400ns wait */
+
+	if(((error=check_busy(reg[host].astr))&(DRQ_BIT|BSY_BIT))!=0)
+	{
+		if(error&DRQ_BIT)return PRINT_ERR(EDERRE,"device_select");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"device_select");
+	}
+	return 0;
+}
+
+
+/*
+ * ATA command issue
+ * レジスターを設定してコマンドを発行する。DMAならバスマスターを起動して戻る
+ * parameters : Host number,Device number,Mode=READ or WRITE,Segment list,Number of segments,sector count,begin sector
+ * return : 0 or Error number
+ */
+int issue_ata(int host,int dev,int trans_mode,ATA_SEG *seg,int nseg,int count,uint begin)
+{
+	static uchar command[3][2][2]={			/* [PIO or PIO multiple or DMA][48bit][READ or WRITE] */
+		{{0x20,0x30},{0x24,0x34}},
+		{{0xc4,0xc5},{0x29,0x39}},
+		{{0xc8,0xca},{0x25,0x35}}
+	};
+	int kind;
+	int dma;
+	int lba48;
+	int error;
+
+
+	dma=(conect_dev[host][dev].mode!=PIO);
+	if(dma)
+	{
+		/* Set PRD */
+		if((error=set_prd(host,seg,nseg,trans_mode))!=0)return error;
+	}
+
+	/*
+	 * 28bitで指定できない場合は48bitコマンドを使う
+	 * 48bitではレジスターにHOB(上位バイト)、下位バイトの順に書き込む
+	 */
+	lba48=(count>ATA_COUNT_MAX)||((uint64)begin+count>LBA28_MAX);
+	if(lba48)
+	{
+		if((conect_dev[host][dev].flag&LBA48_BIT)==0)return PRINT_ERR(EINVAL,"issue_ata");
+		if((error=device_select(host,(dev<<4)|LBA_BIT))!=0)return error;
+
+		outb(reg[host].scr,(uchar)(count>>8));
+		outb(reg[host].snr,(uchar)(begin>>24));
+		outb(reg[host].clr,0);						/* LBA 32-39 */
+		outb(reg[host].chr,0);						/* LBA 40-47 */
+	}
+	else if((error=device_select(host,begin>>24|(dev<<4)|LBA_BIT))!=0)return error;
+
+	/*
+	 * PIOでもDRQブロックごとの割り込みを待って寝る
+	 * デバイスを選んでから許可しないと、選んだデバイスの前のINTRQが割り込みになる
+	 */
+	set_intr(host,INTR_ENABLE);
+
+	outb(reg[host].scr,(uchar)count);
+	outb(reg[host].snr,(uchar)begin);
+	outb(reg[host].clr,(uchar)(begin>>8));
+	outb(reg[host].chr,(uchar)(begin>>16));
+
+	if(dma)kind=2;
+	else kind=(conect_dev[host][dev].multiple!=0)?1:0;
+	outb(reg[host].cmr,command[kind][lba48][trans_mode]);
+	if(dma)start_dma(host,trans_mode);
+
+	return 0;
+}
+
+
+/*
+ * ATA data transfer protocol
+ * parameters : Host number,Device number,Mode=READ or WRITE,Segment list,Number of segments,sector count,begin sector
+ * return : 0 or Error number
+ */
+int _transfer_ata(int host,int dev,int trans_mode,ATA_SEG *seg,int nseg,int count,uint begin)
+{
+	int block;
+	int error;
+
+
+	if((error=issue_ata(host,dev,trans_mode,seg,nseg,count,begin))!=0)return error;
+
+	/* PIO transfer */
+	if(conect_dev[host][dev].mode==PIO)
+	{
+		block=(conect_dev[host][dev].multiple!=0)?conect_dev[host][dev].multiple*ATA_SECTOR_SIZE:ATA_SECTOR_SIZE;
+		if(trans_mode==READ)error=read_pio(host,dev,seg,nseg,block,count*ATA_SECTOR_SIZE);
+		else error=write_pio(host,dev,seg,nseg,block,count*ATA_SECTOR_SIZE);
+	}
+	/* DMA transfer */
+	else error=wait_dma(host,dev,count*ATA_SECTOR_SIZE);
+
+	if(error<0)return error;
+	if((error&(BSY_BIT|DRQ_BIT|ERR_BIT))!=0)
+	{
+		if(error&(DRQ_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"_transfer_ata");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"_transfer_ata");
+	}
+
+	return 0;
+}
+
+
+/************************************************************************************************
+ *
+ * ATA command
+ *
+ ************************************************************************************************/
+
+
+/*
+ * Reset device
+ * parameters : Host number,Device number
+ * return : 0 or Error number
+ */
+int reset_device(int host,int dev)
+{
+	int error;
+
+
+	set_intr(host,INTR_DISABLE);
+
+	if((error=device_select(host,dev<<4))!=0)return error;
+
+	outb(reg[host].cmr,0x8);
+	micro_timer(1);			/* 400ns wait */
+
+	if(((error=check_busy(reg[host].astr))&(BSY_BIT|ERR_BIT))!=0)
+	{
+		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"reset_device");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"reset_device");
+	}
+	return 0;
+}
+
+
+/*
+ * IDENTIFY DEVICE,IDENTIFY PACKET DEVICEを発行する
+ * データはread_identify()で読む。2つのホストに続けて発行すれば待ち時間が重なる
+ * parameters : Host number,Device number,ATA or ATAPI
+ * return : 0 or Error number
+ */
+int issue_identify(int host,int dev,int drv)
+{
+	int error;
+
+
+	set_intr(host,INTR_DISABLE);
+
+	if((error=device_select(host,dev<<4))!=0)return error;
+
+	outb(reg[host].cmr,(drv==ATA)?0xec:0xa1);
+	micro_timer(1);					/* 400ns wait */
+
+	return 0;
+}
+
+
+/*
+ * Identify infomationを読む
+ * parameters : Host number,Device number,buffer
+ * return : 0 or Error number
+ */
+int read_identify(int host,int dev,void *buf)
+{
+	ATA_SEG seg;
+	int error;
+
+
+	seg.addr=buf;
+	seg.size=IDENTIFY_SIZE;
+	if(((error=read_pio(host,dev,&seg,1,IDENTIFY_SIZE,IDENTIFY_SIZE))&(BSY_BIT|DRQ_BIT|ERR_BIT))!=0)
+	{
+		if(error&(DRQ_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"read_identify");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"read_identify");
+	}
+	return 0;
+}
+
+
+/*
+ * データ転送のないコマンドを発行する
+ * 完了はwait_nodata()で待つ。2つのホストに続けて発行すれば待ち時間が重なる
+ * parameters : Host number,Device number<<4|head,Feature,Sector count,Command
+ * return : 0 or Error number
+ */
+int issue_nodata(int host,int dh,uchar feature,uchar count,uchar command)
+{
+	int error;
+
+
+	set_intr(host,INTR_DISABLE);
+
+	if((error=device_select(host,dh))!=0)return error;
+
+	outb(reg[host].ftr,feature);
+	outb(reg[host].scr,count);
+	outb(reg[host].cmr,command);
+	micro_timer(1);			/* 400ns wait */
+
+	return 0;
+}
+
+
+/*
+ * データ転送のないコマンドの完了を待つ
+ * parameters : Host number,エラー表示の関数名
+ * return : 0 or Error number
+ */
+int wait_nodata(int host,const char *func)
+{
+	int error;
+
+
+	if(((error=check_busy(reg[host].astr))&(BSY_BIT|ERR_BIT))!=0)
+	{
+		if(error&ERR_BIT)return PRINT_ERR(EDERRE,func);
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,func);
+	}
+	return 0;
+}
+
+
+/*
+ * Set multiple mode
+ * parameters : Host number,Device number,Sectors per DRQ block
+ * return : 0 or Error number
+ */
+int set_multiple(int host,int dev,int count)
+{
+	int error;
+
+
+	if((error=issue_nodata(host,dev<<4,0,(uchar)count,0xc6))!=0)return error;
+	return wait_nodata(host,"set_multiple");
+}
+
+
+/*
+ * デバイスの動作設定
+ * parameters : Host number,Device number,Subcommand,Transfer mode or 0
+ * return : 0 or Error number
+ */
+int set_features(int host,int dev,uchar subcommand,uchar trans_mode)
+{
+	int error;
+
+
+	if((error=issue_nodata(host,dev<<4,subcommand,trans_mode,0xef))!=0)return error;
+	return wait_nodata(host,"set_features");
+}
+
+
+/*
+ * ライトキャッシュ、先読みの有効無効
+ * ライトキャッシュを止める前に、キャッシュの中身をメディアに書かせる
+ * parameters : Host number,Device number,WCACHE_BIT or LOOKAHEAD_BIT,1=有効 0=無効
+ * return : 0 or Error number
+ */
+int set_drive_cache(int host,int dev,int bit,int on)
+{
+	CONECT_DEV *cd;
+	ushort support;
+	uchar subcm;
+	int error;
+
+
+	cd=&conect_dev[host][dev];
+	support=(bit==WCACHE_BIT)?WCACHE_SUP_BIT:LOOKAHEAD_SUP_BIT;
+	if(cd->type!=ATA)return PRINT_ERR(ENODEV,"set_drive_cache");
+	if((dev_id[host][dev].cmd1&support)==0)return PRINT_ERR(EINVAL,"set_drive_cache");
+
+	if((bit==WCACHE_BIT)&&(on==0)&&((error=flush_device(host,dev))!=0))return error;
+
+	if(bit==WCACHE_BIT)subcm=on?SET_WCACHE_ON:SET_WCACHE_OFF;
+	else subcm=on?SET_LOOKAHEAD_ON:SET_LOOKAHEAD_OFF;
+	if((error=set_features(host,dev,subcm,0))!=0)return error;
+
+	if(on)cd->flag|=bit;
+	else cd->flag&=~bit;
+
+	return 0;
+}
+
+
+/*
+ * FLUSH CACHE
+ * ドライブのライトキャッシュをメディアに書き込ませる。ライトキャッシュが無効なら何もしない
+ * 書き込みに時間がかかるので、割り込みを待って寝る
+ * parameters : Host number,Device number
+ * return : 0 or Error number
+ */
+int flush_device(int host,int dev)
+{
+	uchar cmd;
+	int error;
+
+
+	if((conect_dev[host][dev].type!=ATA)||((conect_dev[host][dev].flag&WCACHE_BIT)==0))return 0;
+
+	/* 48bitのドライブは全容量を書き込むFLUSH CACHE EXTを使う */
+	if((conect_dev[host][dev].flag&LBA48_BIT)&&(dev_id[host][dev].cmd2&FLUSH_EXT_SUP_BIT))cmd=0xea;
+	else cmd=0xe7;
+
+	if((error=device_select(host,dev<<4))!=0)return error;
+	set_intr(host,INTR_ENABLE);
+
+	outb(reg[host].cmr,cmd);
+	wait_intr(&wait_intr_queue[host],FLUSH_TIME_OUT);
+	if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"flush_device");
+
+	if(((error=inb(reg[host].str))&(BSY_BIT|ERR_BIT))!=0)
+	{
+		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"flush_device");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"flush_device");
+	}
+	return 0;
+}
+
+
+/************************************************************************************************
+ *
+ * Packet command
+ *
+ ************************************************************************************************/
+
+
+/*
+ * Issue packet command
+ * parameters : host,device,Packet parameters
+ * return : 0 or Error number
+ */
+int issue_packet_command(int host,int dev,PACKET_PARAM *param)
+{
+	ATA_SEG one,*seg;
+	int nseg;
+	int count;
+	int dtr;
+	int error;
+	int i;
+
+
+	dtr=reg[host].dtr;
+
+	/* 転送ブロック数 */
+	if((param->packet[0]==0x28)||(param->packet[0]==0x2a))
+		count=(uint)param->packet[7]<<8|(uint)param->packet[8];
+	else if((param->packet[0]==0xa8)||(param->packet[0]==0xaa))
+		count=(uint)param->packet[6]<<24|(uint)param->packet[7]<<16|(uint)param->packet[8]<<8|(uint)param->packet[9];
+	else count=1;
+
+	/* Transfer buffer */
+	if(param->seg==NULL)
+	{
+		one.addr=param->buf;
+		one.size=param->size*count;
+		seg=&one;
+		nseg=1;
+	}
+	else
+	{
+		seg=param->seg;
+		nseg=param->nseg;
+	}
+
+	/* デバイスセレクション */
+	if((error=device_select(host,dev<<4))!=0)return error;
+
+	/* Issue packet command  */
+	outb(reg[host].ftr,param->feutures);
+	outb(reg[host].scr,0);
+	outb(reg[host].clr,0xff);
+	outb(reg[host].chr,0xff);
+	outb(reg[host].cmr,0xa0);
+	if((check_busy(reg[host].str)&(DRQ_BIT|CHK_BIT))!=DRQ_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");
+	if((inb(reg[host].irr)&(CD_BIT|IO_BIT))!=CD_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");
+
+	/* DMA transfer */
+	if(param->feutures&PACK_DMA)
+	{
+		set_intr(host,INTR_ENABLE);		/* enable interrupt */
+
+		/* Send packet */
+		for(i=0;i<6;++i)outw(dtr,((short*)param->packet)[i]);
+
+		/* Overrapped */
+		if(param->feutures&PACK_OVL)
+		{
+			wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
+			if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"issue_packet_command");
+
+			error=(int)inb(reg[host].str);
+			if(error&ERR_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");			/* Packet command Error */
+			if((error&DRQ_BIT)==0)return 0;				/* Non data transfer */
+
+			if((error=device_select(host,dev<<4))!=0)return error;
+			wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
+			if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"issue_packet_command");
+			outb(reg[host].cmr,0xa2);					/* Issue service command */
+			if((check_busy(reg[host].str)&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return PRINT_ERR(EDBUSY,"issue_packet_command");
+		}
+
+		/* Data transfer */
+		if((param->packet[0]==0x2a)||(param->packet[0]==0xaa))error=write_dma(host,dev,seg,nseg);
+		else error=read_dma(host,dev,seg,nseg);
+	}
+
+	/* PIO transfer */
+	else
+	{
+		set_intr(host,INTR_DISABLE);
+
+		/* Send packet */
+		for(i=0;i<6;++i)outw(dtr,((short*)param->packet)[i]);
+
+		error=check_busy(reg[host].str);
+		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");		/* Packet command Error */
+		if((error&DRQ_BIT)==0)return 0;			/* Non data transfer */
+
+		/* Overrapped */
+		if(param->feutures&PACK_OVL)
+		{
+			if((error=device_select(host,dev<<4))!=0)return error;
+			wait_intr(&wait_intr_queue[host],2000);			/* Wait interrupt */
+			if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"issue_packet_command");
+			outb(reg[host].cmr,0xa2);						/* Issue service command */
+			if((check_busy(reg[host].str)&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return PRINT_ERR(EDBUSY,"issue_packet_command");
+		}
+
+		/* Data transfer */
+		if((param->packet[0]==0x2a)||(param->packet[0]==0xaa))error=write_pio(host,dev,seg,nseg,param->size,param->size*count);
+		else error=read_pio(host,dev,seg,nseg,param->size,param->size*count);
+	}
+
+	/* Last check */
+	if(error<0)return error;
+	if((error&(BSY_BIT|DRQ_BIT|ERR_BIT))!=0)
+	{
+		if(error&(DRQ_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"issue_packet_command");
+		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"issue_packet_command");
+	}
+	return 0;
+}
+
+
+/*
+ * Test unit ready
+ * parameters : Host number,Device number
+ * return : 0 or Error number
+ */
+int test_unit_ready(int host,int dev)
+{
+	PACKET_PARAM param;
+
+
+	/* Set packet parameters */
+	param.feutures=0;
+	param.size=0;
+	param.seg=NULL;
+	memset(param.packet,0,12);
+	param.packet[0]=0;
+
+	return issue_packet_command(host,dev,&param);
+}
+
+
+/*
+ * Request sense
+ * parameters : Host number,Device number
+ * return : Sense key<<16|ASC<<8|ASCQ or Error number
+ */
+int request_sense(int host,int dev)
+{
+	static char buf[14];
+	PACKET_PARAM param;
+	int error;
+
+
+	/* Set packet parameters */
+	param.feutures=conect_dev[host][dev].mode>>1;
+	param.size=14;
+	param.buf=buf;
+	param.seg=NULL;
+	memset(param.packet,0,12);
+	param.packet[0]=0x3;
+	param.packet[4]=14;
+
+	if((error=issue_packet_command(host,dev,&param))!=0)return error;
+
+	return (((uint)buf[2]&0xf)<<16)|((uint)(uchar)buf[12]<<8)|(uint)(uchar)buf[13];
+}
+
+
+/*
+ * メディアの変化を調べる
+ * GET EVENT STATUS NOTIFICATIONでメディアクラスのイベントを読む。
+ * 使えないドライブはTEST UNIT READYが通るかで調べる
+ * parameters : Host number,Device number
+ * return : 0=変わっていない,1=変わったかメディアがない
+ */
+int media_event(int host,int dev)
+{
+	static uchar buf[8];
+	PACKET_PARAM param;
+	int sense;
+
+
+	if((conect_dev[host][dev].flag&NO_GESN_BIT)==0)
+	{
+		param.feutures=conect_dev[host][dev].mode>>1;
+		param.size=8;
+		param.buf=buf;
+		param.seg=NULL;
+		memset(param.packet,0,12);
+		param.packet[0]=0x4a;
+		param.packet[1]=1;					/* Polled */
+		param.packet[4]=GESN_MEDIA_CLASS;
+		param.packet[8]=8;
+
+		if(issue_packet_command(host,dev,&param)==0)
+		{
+			if((buf[3]&GESN_MEDIA_CLASS)==0)conect_dev[host][dev].flag|=NO_GESN_BIT;
+			else if(buf[2]&GESN_NEA)return 0;
+			else return ((buf[4]&0xf)!=0)||((buf[5]&GESN_PRESENT)==0);
+		}
+		else
+		{
+			/* ILLEGAL REQUESTなら使えない */
+			if(((sense=request_sense(host,dev))<0)||((sense>>16)!=0x5))return 1;
+			conect_dev[host][dev].flag|=NO_GESN_BIT;
+		}
+	}
+
+	return test_unit_ready(host,dev)!=0;
+}
+
+
+/*
+ * Start stop unit
+ * parameters : Host number,Device number,Operation flag
+ * return : 0 or Error number
+ */
+int start_stop_unit(int host,int dev,uchar ope)
+{
+	PACKET_PARAM param;
+
+
+	/* Set packet parameters */
+	param.feutures=(conect_dev[host][dev].flag&ATAPI_OVL)>>12;
+	param.size=0;
+	param.seg=NULL;
+	memset(param.packet,0,12);
+	param.packet[0]=0x1b;
+	param.packet[4]=ope;
+
+	return issue_packet_command(host,dev,&param);
+}
+
+
+/*
+ * Read capacity
+ * parameters : Host number,Device number
+ * return : 0 or Error number
+ */
+int read_capacity(int host,int dev)
+{
+	static uchar buf[8];
+	PACKET_PARAM param;
+	int error;
+
+
+	/* Set packet parameters */
+	param.feutures=conect_dev[host][dev].mode>>1;
+	param.size=8;
+	param.buf=buf;
+	param.seg=NULL;
+	memset(param.packet,0,12);
+	param.packet[0]=0x25;
+
+	if((error=issue_packet_command(host,dev,&param))!=0)return error;
+
+	/* 最後のLBAとブロックサイズがビッグエンディアンで返る */
+	conect_dev[host][dev].all_sectors=((uint)buf[0]<<24|(uint)buf[1]<<16|(uint)buf[2]<<8|buf[3])+(uint64)1;
+
+	/*
+	 * 512byte単位で切捨て
+	 * ドライブによっては物理セクターサイズの場合がある
+	 */
+	conect_dev[host][dev].sector_size=ROUNDDOWN((uint)buf[4]<<24|(uint)buf[5]<<16|(uint)buf[6]<<8|buf[7],512);
+
+	return 0;
+}
+
+
+/*
+ * Set CD speed
+ * parameters : Host number,Device number,Read speed KB/s(CD_SPEED_MAX=最高速)
+ * return : 0 or Error number
+ */
+int set_cd_speed(int host,int dev,uint speed)
+{
+	PACKET_PARAM param;
+
+
+	/* Set packet parameters */
+	param.feutures=0;
+	param.size=0;
+	param.seg=NULL;
+	memset(param.packet,0,12);
+	param.packet[0]=0xbb;
+	param.packet[2]=(uchar)(speed>>8);
+	param.packet[3]=(uchar)speed;
+	param.packet[4]=(uchar)(CD_SPEED_MAX>>8);		/* Write speed */
+	param.packet[5]=(uchar)CD_SPEED_MAX;
+
+	return issue_packet_command(host,dev,&param);
+}
+
+
+/*
+ * 読み書きのパケットを作る
+ * ストリーミング読み込みはREAD(12)を使う
+ * parameters : Host number,Device number,Transfer mode,Block count,Begin sector,Packet
+ */
+void set_rw_packet(int host,int dev,int trans_mode,int count,uint begin,uchar *packet)
+{
+	memset(packet,0,12);
+	packet[2]=(uchar)(begin>>24);
+	packet[3]=(uchar)(begin>>16);
+	packet[4]=(uchar)(begin>>8);
+	packet[5]=(uchar)begin;
+	if((trans_mode==READ)&&(conect_dev[host][dev].flag&STREAM_BIT))
+	{
+		packet[0]=0xa8;
+		packet[6]=(uchar)(count>>24);
+		packet[7]=(uchar)(count>>16);
+		packet[8]=(uchar)(count>>8);
+		packet[9]=(uchar)count;
+	}
+	else
+	{
+		packet[0]=(trans_mode==READ)?0x28:0x2a;
+		packet[7]=(uchar)(count>>8);
+		packet[8]=(uchar)count;
+	}
+}
+
+
+/*
+ * 割り込みで完了させるDMA転送のパケットコマンドを発行する
+ * overlapできるドライブは、シーク中にバスを解放して後でSERVICEを要求する
+ * parameters : Host number,Device number,Transfer mode,Segment list,Number of segments,Block count,Begin sector
+ * return : 0 or Error number
+ */
+int issue_atapi(int host,int dev,int trans_mode,ATA_SEG *seg,int nseg,int count,uint begin)
+{
+	uchar packet[12];
+	int dtr;
+	int error;
+	int i;
+
+
+	dtr=reg[host].dtr;
+	set_rw_packet(host,dev,trans_mode,count,begin,packet);
+
+	/* Set PRD */
+	if((error=set_prd(host,seg,nseg,trans_mode))!=0)return error;
+
+	/* デバイスセレクション */
+	if((error=device_select(host,dev<<4))!=0)return error;
+
+	/* Issue packet command  */
+	outb(reg[host].ftr,PACK_DMA|((conect_dev[host][dev].flag&ATAPI_OVL)?PACK_OVL:0));
+	outb(reg[host].scr,0);
+	outb(reg[host].clr,0xff);
+	outb(reg[host].chr,0xff);
+	outb(reg[host].cmr,0xa0);
+	if((check_busy(reg[host].str)&(DRQ_BIT|CHK_BIT))!=DRQ_BIT)return PRINT_ERR(EDERRE,"issue_atapi");
+	if((inb(reg[host].irr)&(CD_BIT|IO_BIT))!=CD_BIT)return PRINT_ERR(EDERRE,"issue_atapi");
+
+	set_intr(host,INTR_ENABLE);
+
+	/* Send packet */
+	for(i=0;i<6;++i)outw(dtr,((short*)packet)[i]);
+	start_dma(host,trans_mode);
+
+	return 0;
+}
+
+
+/*
+ * Read data
+ * parameters : Host number,Device number,Transfer mode,Segment list,Number of segments,Block count,Begin sector
+ * rturn : 0 or Error number
+ */
+int _transfer_atapi(int host,int dev,int trans_mode,ATA_SEG *seg,int nseg,int count,uint begin)
+{
+	PACKET_PARAM param;
+
+
+	/*
+	 * Set packet parameters
+	 * プロセスで処理するのはPIOだけなので、overlapはしない
+	 */
+	param.feutures=conect_dev[host][dev].mode>>1;
+	param.size=conect_dev[host][dev].sector_size;
+	param.seg=seg;
+	param.nseg=nseg;
+	set_rw_packet(host,dev,trans_mode,count,begin,param.packet);
+
+	return issue_packet_command(host,dev,&param);
+}
+
+
+/************************************************************************************************
+ *
+ * Buffer cache
+ *
+ ************************************************************************************************/
+
+
+/*
+ * Hash number
+ * parameters : Device number,Cache block number
+ * return : Hash number
+ */
+static inline int cache_hash(int dev,uint block)
+{
+	return (block^(dev<<7))&(CACHE_HASH-1);
+}
+
+
+/*
+ * キャッシュブロックを探す
+ * parameters : Host number,Device number,Cache block number
+ * return : Cache block or NULL
+ */
+CACHE_BLK *find_cache(int host,int dev,uint block)
+{
+	CACHE_BLK *blk;
+
+
+	for(blk=cache[host].hash[cache_hash(dev,block)];blk!=NULL;blk=blk->hnext)
+		if((blk->block==block)&&(blk->dev==dev)&&((blk->valid!=0)||(blk->io_mask!=0)))return blk;
+
+	return NULL;
+}
+
+
+/*
+ * LRUリストの先頭に移す
+ * parameters : Host number,Cache block
+ */
+void touch_cache(int host,CACHE_BLK *blk)
+{
+	BLK_CACHE *c;
+
+
+	c=&cache[host];
+	if(c->lru_head==blk)return;
+
+	/* リストから外す */
+	if(blk->prev!=NULL)blk->prev->next=blk->next;
+	if(blk->next!=NULL)blk->next->prev=blk->prev;
+	if(c->lru_tail==blk)c->lru_tail=blk->prev;
+
+	/* 先頭に入れる */
+	blk->prev=NULL;
+	blk->next=c->lru_head;
+	if(c->lru_head!=NULL)c->lru_head->prev=blk;
+	c->lru_head=blk;
+	if(c->lru_tail==NULL)c->lru_tail=blk;
+}
+
+
+/*
+ * ハッシュから外す
+ * 外したブロックはLRUの最後に移して最初に再利用する
+ * parameters : Host number,Cache block
+ */
+void unhash_cache(int host,CACHE_BLK *blk)
+{
+	BLK_CACHE *c;
+	CACHE_BLK **p;
 
-	return 0;
+
+	c=&cache[host];
+	for(p=&c->hash[cache_hash(blk->dev,blk->block)];*p!=NULL;p=&(*p)->hnext)
+		if(*p==blk)
+		{
+			*p=blk->hnext;
+			break;
+		}
+	blk->valid=0;
+	blk->dirty=0;
+	blk->ra=0;
+
+	if(c->lru_tail==blk)return;
+	if(blk->prev!=NULL)blk->prev->next=blk->next;
+	else c->lru_head=blk->next;
+	blk->next->prev=blk->prev;
+	blk->prev=c->lru_tail;
+	blk->next=NULL;
+	c->lru_tail->next=blk;
+	c->lru_tail=blk;
 }
 
 
 /*
- * ワードのビッグエンディアンをリトルエンディアンに変える
- * parameters : string address,string length
- * return : string address
+ * 非同期転送完了の後処理
+ * 書き戻し中に書き込まれたセクターはdirtyのまま残す
+ * 先読みに失敗したブロックはキャッシュから外す
+ * parameters : Host number,完了数が変わっていなくても調べる場合は1
  */
-char *cnv_idinfo_str(char *str,int len)
+void reap_cache(int host,int force)
 {
-	char c;
-	int count;
+	BLK_CACHE *c;
+	CACHE_BLK *blk;
 	int i;
 
 
-	/*
-	 * ' 'が２つつづいたら'\0'を入れる
-	 */
-	count=0;
-	for(i=0;i<len;++i)
+	c=&cache[host];
+	if((force==0)&&(c->io_reaped==c->io_complete))return;
+	c->io_reaped=c->io_complete;
+
+	for(i=0;i<c->num;++i)
 	{
-		c=str[i];
-		str[i]=str[i+1];
-		str[i+1]=c;
+		blk=&c->blk[i];
+		if((blk->io_mask==0)||(blk->io_done==0))continue;
 
-		if(str[i]==' ')++count;
-		else count=0;
-		if(count==2)break;
-		if(str[++i]==' ')++count;
-		else count=0;
-		if(count==2)break;
+		if(blk->io==WRITE)
+		{
+			if((blk->io_error==0)&&(blk->gen==blk->wb_gen))blk->dirty&=~blk->io_mask;
+			blk->io_mask=0;
+			--c->writing;
+			if(blk->dirty==0)--c->ndirty;
+		}
+		else
+		{
+			if(blk->io_error==0)blk->valid|=blk->io_mask;
+			blk->io_mask=0;
+			--c->reading;
+			if(blk->valid==0)unhash_cache(host,blk);
+		}
+		blk->io_done=0;
 	}
-	str[--i]='\0';
-
-	return str;
 }
 
 
 /*
- * ソフトウェアリセット
- * parameters : コントロールレジスタ
- * return : 0 or Error number
+ * 非同期転送の完了を待つ
+ * キャッシュをロックしたまま呼ぶ
+ * parameters : Host number
  */
-int soft_reset(int host)
+void wait_cache_io(int host)
 {
-	outb(reg[host].ctr,0x4);	/* ソフトリセット */
-	mili_timer(5);				/* 5ms wait */
-	outb(reg[host].ctr,0x2);	/* リセット解除|割り込み禁止 */
-	mili_timer(20);				/* 20ms wait */
-	if((check_busy(reg[host].astr)&BSY_BIT)!=0)return PRINT_ERR(EDBUSY,"soft_reset");
-
-	return 0;
+	wait_intr(&cache[host].flush_wait,TIME_OUT);
+	if(cache[host].flush_wait.flag==-1)check_timeout(host);
+	reap_cache(host,1);
 }
 
 
-/************************************************************************************************
- *
- * ATA command protocol
- *
- ************************************************************************************************/
+/*
+ * 非同期転送の完了(割り込み中の場合もある)
+ * parameters : Request
+ */
+void cache_io_done(ATA_REQ *req)
+{
+	CACHE_BLK *blk;
+
+
+	blk=(CACHE_BLK*)req->arg;
+	blk->io_error=req->error;
+	blk->io_done=1;
+	++cache[req->host].io_complete;
+	wake_intr(&cache[req->host].flush_wait);
+}
 
 
 /*
- * デバイスセレクション
- * parameters : Device number,Host number
- * return : 0 or Error number
+ * dirtyセクターの最初の連続部分を返す
+ * parameters : Cache block,Return first sector,Return sectors
  */
-int device_select(int host,int dev)
+void dirty_run(CACHE_BLK *blk,int *first,int *num)
 {
-	int error;
+	int i;
 
 
-	if(((error=check_busy(reg[host].astr))&(DRQ_BIT|BSY_BIT))!=0)
-	{
-		if(error&DRQ_BIT)return PRINT_ERR(EDERRE,"device_select");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"device_select");
-	}
+	for(i=0;(blk->dirty&(1<<i))==0;++i);
+	*first=i;
+	for(;(i<32)&&(blk->dirty&(1<<i));++i);
+	*num=i-*first;
+}
 
-	/* Device select */
-	outb(reg[host].dhr,(uchar)dev|0xa0);
-	micro_timer(1);					/* 400ns wait */
 
-	if(((error=check_busy(reg[host].astr))&(DRQ_BIT|BSY_BIT))!=0)
+/*
+ * dirtyブロックの書き戻しを非同期に始める
+ * parameters : Host number,Cache block
+ */
+void start_writeback(int host,CACHE_BLK *blk)
+{
+	int sector_size;
+	int first,num;
+
+
+	sector_size=conect_dev[host][blk->dev].sector_size;
+	dirty_run(blk,&first,&num);
+
+	blk->io_mask=((1<<num)-1)<<first;
+	blk->io=WRITE;
+	blk->wb_gen=blk->gen;
+	blk->io_done=0;
+	blk->io_error=0;
+	++cache[host].writing;
+	++cache[host].stat[blk->dev].writeback;
+
+	blk->seg.addr=blk->buf+first*sector_size;
+	blk->seg.size=num*sector_size;
+	blk->req.host=host;
+	blk->req.dev=blk->dev;
+	blk->req.mode=WRITE;
+	blk->req.prio=dev_prio[host][blk->dev];
+	blk->req.seg=&blk->seg;
+	blk->req.nseg=1;
+	blk->req.begin=blk->block*(CACHE_BLK_SIZE/sector_size)+first;
+	blk->req.callback=cache_io_done;
+	blk->req.arg=blk;
+	if(submit_ata(&blk->req)!=0)
 	{
-		if(error&DRQ_BIT)return PRINT_ERR(EDERRE,"device_select");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"device_select");
+		blk->req.error=-1;
+		cache_io_done(&blk->req);
 	}
-	return 0;
 }
 
 
 /*
- * ATA data transfer protocol
- * parameters : Host number,Device number,Mode=READ or WRITE,buffer,sector count,begin sector
+ * dirtyブロックを同期して書き戻す
+ * parameters : Host number,Cache block
  * return : 0 or Error number
  */
-int _transfer_ata(int host,int dev,int trans_mode,void *buf,int count,uint begin)
+int write_cache_blk(int host,CACHE_BLK *blk)
 {
+	int sector_size;
+	int first,num;
 	int error;
 
 
-	if(conect_dev[host][dev].mode==PIO)set_intr(host,INTR_DISABLE);
-	else set_intr(host,INTR_ENABLE);
-
-	if((error=device_select(host,begin>>24|(dev<<4)|LBA_BIT))!=0)return error;
-
-	outb(reg[host].scr,(uchar)count);
-	outb(reg[host].snr,(uchar)begin);
-	outb(reg[host].clr,(uchar)(begin>>8));
-	outb(reg[host].chr,(uchar)(begin>>16));
-
-	/* PIO transfer */
-	if(conect_dev[host][dev].mode==PIO)
-	{
-		if(trans_mode==READ)
-		{
-			outb(reg[host].cmr,0x20);
-			error=read_pio(host,dev,buf,ATA_SECTOR_SIZE,count);
-		}
-		else
-		{
-			outb(reg[host].cmr,0x30);
-			error=write_pio(host,dev,buf,ATA_SECTOR_SIZE,count);
-		}
-	}
-	/* DMA transfer */
-	else
-	{
-		if(trans_mode==READ)
-		{
-			outb(reg[host].cmr,0xc8);
-			error=read_dma(host,dev,buf,ATA_SECTOR_SIZE,count);
-		}
-		else
-		{
-			outb(reg[host].cmr,0xca);
-			error=write_dma(host,dev,buf,ATA_SECTOR_SIZE,count);
-		}
-	}
-
-	if((error&(BSY_BIT|DRQ_BIT|ERR_BIT))!=0)
+	sector_size=conect_dev[host][blk->dev].sector_size;
+	while(blk->dirty!=0)
 	{
-		if(error&(DRQ_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"_transfer_ata");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"_transfer_ata");
+		dirty_run(blk,&first,&num);
+		++cache[host].stat[blk->dev].writeback;
+		if((error=transfer(host,blk->dev,WRITE,blk->buf+first*sector_size,num,
+			blk->block*(CACHE_BLK_SIZE/sector_size)+first))<0)return error;
+		blk->dirty&=~(((1<<num)-1)<<first);
 	}
+	--cache[host].ndirty;
 
 	return 0;
 }
 
 
-/************************************************************************************************
- *
- * ATA command
- *
- ************************************************************************************************/
-
-
 /*
- * Reset device
- * parameters : Host number,Device number
- * return : 0 or Error number
+ * 書き戻しを始める
+ * 古いdirtyブロックと、dirtyブロックが多すぎる場合は古い順に非同期で書き戻す
+ * タイマーもカーネルスレッドもないので、hdXの読み書きの最後に呼ぶ。
+ * 読み書きが止まったデバイスのdirtyブロックは次の読み書きかsync_ata()まで残るので、
+ * dirtyブロックを作るのはATA_IOCTL_SET_WRITEBACKでwrite-backにしたデバイスだけ
+ * parameters : Host number
  */
-int reset_device(int host,int dev)
+void flush_cache(int host)
 {
-	int error;
-
+	BLK_CACHE *c;
+	CACHE_BLK *blk;
+	uint64 now;
 
-	set_intr(host,INTR_DISABLE);
 
-	if((error=device_select(host,dev<<4))!=0)return error;
+	c=&cache[host];
+	reap_cache(host,0);
 
-	outb(reg[host].cmr,0x8);
-	micro_timer(1);			/* 400ns wait */
+	now=rdtsc();
+	if((c->ndirty<=DIRTY_MAX)&&(now-c->flush_time<clock_1m*FLUSH_INTERVAL))return;
+	c->flush_time=now;
 
-	if(((error=check_busy(reg[host].astr))&(BSY_BIT|ERR_BIT))!=0)
+	for(blk=c->lru_tail;(blk!=NULL)&&(c->writing<WRITEBACK_MAX);blk=blk->prev)
 	{
-		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"reset_device");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"reset_device");
+		if((blk->dirty==0)||(blk->io_mask!=0))continue;
+		if((c->ndirty-c->writing>DIRTY_MAX)||(now-blk->time>clock_1m*DIRTY_EXPIRE))start_writeback(host,blk);
 	}
-	return 0;
 }
 
 
 /*
- * Identif device
- * parameters : Host number,Device number,ATA or ATAPI,buffer
- * return : 0 or Error number
+ * 新しいキャッシュブロックを割り当てる
+ * LRUの最後から転送中でないブロックを再利用する
+ * parameters : Host number,Device number,Cache block number,dirtyブロックを追い出さない場合は1
+ * return : Cache block or NULL
  */
-int identify_device(int host,int dev,int drv,void *buf)
+CACHE_BLK *alloc_cache(int host,int dev,uint block,int clean)
 {
-	int error;
-
-
-	set_intr(host,INTR_DISABLE);
+	BLK_CACHE *c;
+	CACHE_BLK *blk;
 
-	if((error=device_select(host,dev<<4))!=0)return error;
 
-	outb(reg[host].cmr,(drv==ATA)?0xec:0xa1);
-	micro_timer(1);					/* 400ns wait */
+	c=&cache[host];
+	for(blk=c->lru_tail;blk!=NULL;blk=blk->prev)
+		if(blk->io_mask==0)break;
+	if(blk==NULL)return NULL;
 
-	/* Read data */
-	if(((error=read_pio(host,dev,buf,IDENTIFY_SIZE,1))&(BSY_BIT|DRQ_BIT|ERR_BIT))!=0)
+	if(blk->valid!=0)
 	{
-		if(error&(DRQ_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"identify_device");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"identify_device");
+		if(blk->dirty!=0)
+		{
+			if(clean)return NULL;
+			if(write_cache_blk(host,blk)!=0)return NULL;
+		}
+
+		/* 使われずに追い出された先読みは窓を縮める */
+		if(blk->ra)
+		{
+			++c->stat[blk->dev].ra_waste;
+			c->ra[blk->dev].window/=2;
+		}
+		unhash_cache(host,blk);
+		++c->stat[blk->dev].evict;
 	}
-	return 0;
+
+	blk->dev=dev;
+	blk->block=block;
+	blk->hnext=c->hash[cache_hash(dev,block)];
+	c->hash[cache_hash(dev,block)]=blk;
+
+	return blk;
 }
 
 
 /*
- * Idle device
- * parameters : Host number,Device number
+ * キャッシュブロックの無効なセクターを読み込む
+ * parameters : Host number,Cache block
  * return : 0 or Error number
  */
-int idle_immediate_device(int host,int dev)
+int fill_cache(int host,CACHE_BLK *blk)
 {
+	CONECT_DEV *cd;
+	uint begin;
+	int spb;
 	int error;
+	int i,j;
 
 
-	set_intr(host,INTR_DISABLE);
+	cd=&conect_dev[host][blk->dev];
+	spb=CACHE_BLK_SIZE/cd->sector_size;
+	begin=blk->block*spb;
 
-	if((error=device_select(host,dev<<4))!=0)return error;
+	for(i=0;(i<spb)&&(begin+i<cd->all_sectors);i=j)
+	{
+		if(blk->valid&(1<<i))
+		{
+			j=i+1;
+			continue;
+		}
+		for(j=i;(j<spb)&&(begin+j<cd->all_sectors)&&((blk->valid&(1<<j))==0);++j);
+		if((error=transfer(host,blk->dev,READ,blk->buf+i*cd->sector_size,j-i,begin+i))<0)return error;
+		blk->valid|=((1<<(j-i))-1)<<i;
+	}
 
-	outb(reg[host].cmr,0xe1);
-	micro_timer(1);			/* 400ns wait */
+	return 0;
+}
 
-	if(((error=check_busy(reg[host].astr))&(BSY_BIT|ERR_BIT))!=0)
+
+/*
+ * キャッシュブロックの先読みを非同期に始める
+ * parameters : Host number,Cache block
+ */
+void start_readahead(int host,CACHE_BLK *blk)
+{
+	CONECT_DEV *cd;
+	uint begin;
+	int count;
+
+
+	cd=&conect_dev[host][blk->dev];
+	count=CACHE_BLK_SIZE/cd->sector_size;
+	begin=blk->block*count;
+	if(begin+count>cd->all_sectors)count=cd->all_sectors-begin;
+
+	blk->valid=0;
+	blk->dirty=0;
+	blk->io_mask=(1<<count)-1;
+	blk->io=READ;
+	blk->io_done=0;
+	blk->io_error=0;
+	blk->ra=1;
+	++cache[host].reading;
+	++cache[host].stat[blk->dev].ra_issue;
+
+	blk->seg.addr=blk->buf;
+	blk->seg.size=count*cd->sector_size;
+	blk->req.host=host;
+	blk->req.dev=blk->dev;
+	blk->req.mode=READ;
+	blk->req.prio=dev_prio[host][blk->dev];
+	blk->req.seg=&blk->seg;
+	blk->req.nseg=1;
+	blk->req.begin=begin;
+	blk->req.callback=cache_io_done;
+	blk->req.arg=blk;
+	if(submit_ata(&blk->req)!=0)
 	{
-		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"idle_immediate_device");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"idle_immediate_device");
+		blk->req.error=-1;
+		cache_io_done(&blk->req);
 	}
-	return 0;
 }
 
 
 /*
- * Initialize device parameters
- * parameters : Host number,Device number,Number of heads,Number of sectors
- * return : 0 or Error number
+ * 連続読み込みの検出と先読み
+ * 連続している間は先読みの窓を広げ、途切れたら縮める
+ * 先読みの残りが窓の半分を切ったら窓の終わりまでまとめて出す
+ * parameters : Host number,Device number,Begin sector,Sectors
  */
-int init_device_param(int host,int dev,uchar head,uchar sectors)
+void readahead(int host,int dev,uint begin,uint blocks)
 {
-	int error;
+	BLK_CACHE *c;
+	RA_STREAM *ra;
+	CONECT_DEV *cd;
+	CACHE_BLK *blk;
+	uint block,last;
+	uint end;
+	int spb;
 
 
-	if(head>0xf)return EINVAL;
+	c=&cache[host];
+	ra=&c->ra[dev];
+	cd=&conect_dev[host][dev];
 
-	set_intr(host,INTR_DISABLE);
+	if(begin!=ra->next)
+	{
+		ra->window/=2;
+		ra->next=ra->end=begin+blocks;
+		return;
+	}
+	ra->next=begin+blocks;
+	if(ra->window==0)ra->window=RA_MIN;
+	else if(ra->window<RA_MAX)ra->window*=2;
 
-	if((error=device_select(host,(dev<<4)|head))!=0)return error;
+	/* 非同期に読めないデバイスは先読みしない */
+	if(cd->mode==PIO)return;
 
-	outb(reg[host].scr,sectors);
-	outb(reg[host].cmr,0x91);
-	micro_timer(1);			/* 400ns wait */
+	if(ra->end<ra->next)ra->end=ra->next;
+	if(ra->end-ra->next>=ra->window/2)return;
+	end=(ra->next+ra->window<cd->all_sectors)?ra->next+ra->window:cd->all_sectors;
+	if(ra->end>=end)return;
 
-	if(((error=check_busy(reg[host].astr))&(BSY_BIT|ERR_BIT))!=0)
+	spb=CACHE_BLK_SIZE/cd->sector_size;
+	last=(end-1)/spb;
+	for(block=ra->end/spb;(block<=last)&&(c->reading<READAHEAD_MAX);++block)
 	{
-		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"init_device_param");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"init_device_param");
+		if(find_cache(host,dev,block)==NULL)
+		{
+			if((blk=alloc_cache(host,dev,block,1))==NULL)break;
+			start_readahead(host,blk);
+		}
+		ra->end=(block+1)*spb;
 	}
-	return 0;
 }
 
 
 /*
- * デバイスの動作設定
- * parameters : Host number,Device number,Subcommand,Transfer mode or 0
+ * 範囲内のdirtyブロックを書き戻して、指定があればキャッシュから外す
+ * キャッシュを通さない転送の前後に呼ぶ
+ * parameters : Host number,Device number,Begin sector,Sectors,Invalidate flag
  * return : 0 or Error number
  */
-int set_features(int host,int dev,uchar subcommand,uchar trans_mode)
+int sync_range(int host,int dev,uint begin,uint count,int invalidate)
 {
+	BLK_CACHE *c;
+	CACHE_BLK *blk;
+	uint first,last;
+	int spb;
+	int busy;
 	int error;
+	int i;
 
 
-	set_intr(host,INTR_DISABLE);
+	c=&cache[host];
+	spb=CACHE_BLK_SIZE/conect_dev[host][dev].sector_size;
+	first=begin/spb;
+	last=(begin+count-1)/spb;
 
-	if((error=device_select(host,dev<<4))!=0)return error;
+	for(;;)
+	{
+		reap_cache(host,1);
+		for(busy=0,i=0;i<c->num;++i)
+		{
+			blk=&c->blk[i];
+			if(((blk->valid==0)&&(blk->io_mask==0))||(blk->dev!=dev)||(blk->block<first)||(blk->block>last))continue;
 
-	outb(reg[host].ftr,subcommand);
-	outb(reg[host].scr,trans_mode);
-	outb(reg[host].cmr,0xef);
-	micro_timer(1);			/* 400ns wait */
+			/* 転送中なら終わるのを待つ */
+			if(blk->io_mask!=0)
+			{
+				busy=1;
+				continue;
+			}
+			if((blk->dirty!=0)&&((error=write_cache_blk(host,blk))!=0))return error;
+			if(invalidate)unhash_cache(host,blk);
+		}
+		if(busy==0)return 0;
 
-	if(((error=check_busy(reg[host].astr))&(BSY_BIT|ERR_BIT))!=0)
-	{
-		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"set_features");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"set_features");
+		wait_cache_io(host);
 	}
-	return 0;
 }
 
 
-/************************************************************************************************
- *
- * Packet command
- *
- ************************************************************************************************/
-
-
 /*
- * Issue packet command
- * parameters : host,device,Packet parameters
- * return : 0 or Error number
+ * キャッシュを通したデータ転送
+ * 大きな転送とキャッシュしないデバイスは直接転送する
+ * write-backでないデバイスの書き込みは先にディスクに書き、キャッシュは書いたデータで更新するだけ
+ * parameters : Host number,Device number,Mode=READ or WRITE,buffer,Transfer blocks,begin block
+ * return : Transfer blocks or Error number
  */
-int issue_packet_command(int host,int dev,PACKET_PARAM *param)
+int cache_transfer(int host,int dev,int mode,void *buf,size_t blocks,size_t begin)
 {
-	int dtr;
+	BLK_CACHE *c;
+	CACHE_BLK *blk;
+	CONECT_DEV *cd;
+	uint lba,end;
+	uint mask;
+	int spb,first,num;
+	int through;
 	int error;
-	int i;
 
 
-	dtr=reg[host].dtr;
+	c=&cache[host];
+	cd=&conect_dev[host][dev];
+	if(blocks==0)return 0;
+	if(cd->flag&STREAM_BIT)
+	{
+		if(mode==READ)return read_stream(host,dev,buf,blocks,begin);
+		atapi_stream[host][dev].stale=1;
+	}
+	if((cd->type!=ATA)||(c->num==0))return transfer(host,dev,mode,buf,blocks,begin);
+	if(begin+blocks>cd->all_sectors)return PRINT_ERR(EINVAL,"cache_transfer");
 
-	/* デバイスセレクション */
-	if((error=device_select(host,dev<<4))!=0)return error;
+	/* 大きな転送はキャッシュを通さない */
+	if(blocks>=CACHE_BYPASS)
+	{
+		wait_proc(&c->lock);
+		++c->stat[dev].bypass;
+		error=sync_range(host,dev,begin,blocks,mode==WRITE);
+		wake_proc(&c->lock);
+		if(error!=0)return error;
+
+		error=transfer(host,dev,mode,buf,blocks,begin);
+		if(mode==WRITE)
+		{
+			wait_proc(&c->lock);
+			sync_range(host,dev,begin,blocks,1);
+			wake_proc(&c->lock);
+		}
+		return error;
+	}
 
-	/* Issue packet command  */
-	outb(reg[host].ftr,param->feutures);
-	outb(reg[host].scr,0);
-	outb(reg[host].clr,0xff);
-	outb(reg[host].chr,0xff);
-	outb(reg[host].cmr,0xa0);
-	if((check_busy(reg[host].str)&(DRQ_BIT|CHK_BIT))!=DRQ_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");
-	if((inb(reg[host].irr)&(CD_BIT|IO_BIT))!=CD_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");
+	spb=CACHE_BLK_SIZE/cd->sector_size;
+	end=begin+blocks;
+	error=0;
 
-	/* DMA transfer */
-	if(param->feutures&PACK_DMA)
-	{
-		set_intr(host,INTR_ENABLE);		/* enable interrupt */
+	wait_proc(&c->lock);
 
-		/* Send packet */
-		for(i=0;i<6;++i)outw(dtr,((short*)param->packet)[i]);
+	/* フラグはロックの中で見る。write-backを止めたsync_cache()の後にdirtyブロックを作らない */
+	through=(mode==WRITE)&&((cd->flag&WBACK_BIT)==0);
+	if(through&&((error=transfer(host,dev,WRITE,buf,blocks,begin))<0))
+	{
+		wake_proc(&c->lock);
+		return error;
+	}
+	error=0;
 
-		/* Overrapped */
-		if(param->feutures&PACK_OVL)
-		{
-			wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
-			if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"issue_packet_command");
+	for(lba=begin;lba<end;lba+=num)
+	{
+		first=lba%spb;
+		num=(end-lba<spb-first)?end-lba:spb-first;
+		mask=((1<<num)-1)<<first;
 
-			error=(int)inb(reg[host].str);
-			if(error&ERR_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");			/* Packet command Error */
-			if((error&DRQ_BIT)==0)return 0;				/* Non data transfer */
+		/* 先読み中なら終わるのを待つ */
+		while(((blk=find_cache(host,dev,lba/spb))!=NULL)&&(blk->io_mask!=0)&&(blk->io==READ))wait_cache_io(host);
 
-			if((error=device_select(host,dev<<4))!=0)return error;
-			wait_intr(&wait_intr_queue[host],2000);		/* Wait interrupt */
-			if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"issue_packet_command");
-			outb(reg[host].cmr,0xa2);					/* Issue service command */
-			if((check_busy(reg[host].str)&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return PRINT_ERR(EDBUSY,"issue_packet_command");
+		if(blk==NULL)
+		{
+			if((blk=alloc_cache(host,dev,lba/spb,0))==NULL)
+			{
+				/* write-throughならディスクには書いたので、残りの範囲の古いデータを捨てる */
+				if(through)error=sync_range(host,dev,lba,end-lba,1);
+				else error=PRINT_ERR(ENOMEM,"cache_transfer");
+				break;
+			}
+			blk->valid=0;
+			blk->dirty=0;
+		}
+		touch_cache(host,blk);
+		if(blk->ra)
+		{
+			if(mode==READ)++c->stat[dev].ra_hit;
+			blk->ra=0;
 		}
 
-		/* Data transfer */
-		if(param->packet[0]==0x28)
-			error=read_dma(host,dev,param->buf,param->size,(uint)param->packet[7]<<8|(uint)param->packet[8]);
-		else if(param->packet[0]==0x2a)
-			error=write_dma(host,dev,param->buf,param->size,(uint)param->packet[7]<<8|(uint)param->packet[8]);
+		if(mode==READ)
+		{
+			if((blk->valid&mask)==mask)++c->stat[dev].hit;
+			else
+			{
+				++c->stat[dev].miss;
+				if((error=fill_cache(host,blk))!=0)
+				{
+					if(blk->dirty==0)unhash_cache(host,blk);
+					break;
+				}
+			}
+			memcpy(buf,blk->buf+first*cd->sector_size,num*cd->sector_size);
+		}
 		else
-			error=read_dma(host,dev,param->buf,param->size,1);
+		{
+			++c->stat[dev].write;
+			memcpy(blk->buf+first*cd->sector_size,buf,num*cd->sector_size);
+			blk->valid|=mask;
+			if(through==0)
+			{
+				if(blk->dirty==0)
+				{
+					++c->ndirty;
+					blk->time=rdtsc();
+				}
+				blk->dirty|=mask;
+				++blk->gen;
+			}
+		}
+		buf=(char*)buf+num*cd->sector_size;
 	}
+	if((mode==READ)&&(error==0))readahead(host,dev,begin,blocks);
+	flush_cache(host);
+	wake_proc(&c->lock);
 
-	/* PIO transfer */
-	else
-	{
-		set_intr(host,INTR_DISABLE);
+	return (error!=0)?error:blocks;
+}
 
-		/* Send packet */
-		for(i=0;i<6;++i)outw(dtr,((short*)param->packet)[i]);
 
-		error=check_busy(reg[host].str);
-		if(error&ERR_BIT)return PRINT_ERR(EDERRE,"issue_packet_command");		/* Packet command Error */
-		if((error&DRQ_BIT)==0)return 0;			/* Non data transfer */
+/*
+ * キャッシュを通さないscatter gather転送
+ * parameters : Host number,Device number,Mode=READ or WRITE,Segment list,Number of segments,begin block
+ * return : Transfer blocks or Error number
+ */
+int direct_transfer(int host,int dev,int mode,ATA_SEG *seg,int nseg,size_t begin)
+{
+	BLK_CACHE *c;
+	CONECT_DEV *cd;
+	uint bytes;
+	int error;
+	int i;
 
-		/* Overrapped */
-		if(param->feutures&PACK_OVL)
-		{
-			if((error=device_select(host,dev<<4))!=0)return error;
-			wait_intr(&wait_intr_queue[host],2000);			/* Wait interrupt */
-			if(wait_intr_queue[host].flag==-1)return PRINT_ERR(ETIMEOUT,"issue_packet_command");
-			outb(reg[host].cmr,0xa2);						/* Issue service command */
-			if((check_busy(reg[host].str)&(BSY_BIT|DRQ_BIT))!=DRQ_BIT)return PRINT_ERR(EDBUSY,"issue_packet_command");
-		}
 
-		/* Data transfer */
-		if(param->packet[0]==0x28)
-			error=read_pio(host,dev,param->buf,param->size,(uint)param->packet[7]<<8|(uint)param->packet[8]);
-		else if(param->packet[0]==0x2a)
-			error=write_pio(host,dev,param->buf,param->size,(uint)param->packet[7]<<8|(uint)param->packet[8]);
-		else
-			error=read_pio(host,dev,param->buf,param->size,1);
-	}
+	c=&cache[host];
+	cd=&conect_dev[host][dev];
+	if((cd->type!=ATA)||(c->num==0))return transfer_sg(host,dev,mode,seg,nseg,begin);
 
-	/* Last check */
-	if((error&(BSY_BIT|DRQ_BIT|ERR_BIT))!=0)
+	for(bytes=0,i=0;i<nseg;++i)bytes+=seg[i].size;
+	if(bytes<cd->sector_size)return transfer_sg(host,dev,mode,seg,nseg,begin);
+
+	wait_proc(&c->lock);
+	error=sync_range(host,dev,begin,bytes/cd->sector_size,mode==WRITE);
+	wake_proc(&c->lock);
+	if(error!=0)return error;
+
+	error=transfer_sg(host,dev,mode,seg,nseg,begin);
+	if(mode==WRITE)
 	{
-		if(error&(DRQ_BIT|ERR_BIT))return PRINT_ERR(EDERRE,"issue_packet_command");
-		if(error&BSY_BIT)return PRINT_ERR(EDBUSY,"issue_packet_command");
+		wait_proc(&c->lock);
+		sync_range(host,dev,begin,bytes/cd->sector_size,1);
+		wake_proc(&c->lock);
 	}
-	return 0;
+
+	return error;
 }
 
 
 /*
- * Test unit ready
+ * キャッシュのdirtyブロックを全て書き戻す
  * parameters : Host number,Device number
  * return : 0 or Error number
  */
-int test_unit_ready(int host,int dev)
+int sync_cache(int host,int dev)
 {
-	PACKET_PARAM param;
+	int error;
 
 
-	/* Set packet parameters */
-	param.feutures=0;
-	param.size=0;
-	memset(param.packet,0,12);
-	param.packet[0]=0;
+	if((conect_dev[host][dev].type!=ATA)||(cache[host].num==0))return 0;
 
-	return issue_packet_command(host,dev,&param);
+	wait_proc(&cache[host].lock);
+	error=sync_range(host,dev,0,conect_dev[host][dev].all_sectors,0);
+	wake_proc(&cache[host].lock);
+
+	return error;
 }
 
 
 /*
- * Request sense
- * parameters : Host number,Device number
- * return : Ready=0 or Retry=1 or Error number
+ * キャッシュの初期化
+ * ブロックはDMAバッファープールから取る。メモリーが確保できなければキャッシュを使わない
+ * parameters : Host number
  */
-int request_sense(int host,int dev)
+void init_cache(int host)
 {
-	static char buf[14];
-	PACKET_PARAM param;
+	BLK_CACHE *c;
+	int i;
 
 
-	/* Set packet parameters */
-	param.feutures=conect_dev[host][dev].mode>>1;
-	param.size=14;
-	param.buf=buf;
-	memset(param.packet,0,12);
-	param.packet[0]=0x3;
-	param.packet[4]=14;
+	c=&cache[host];
+	if((c->blk=(CACHE_BLK*)kmalloc(sizeof(CACHE_BLK)*CACHE_BLOCKS))==NULL)return;
+	memset(c->blk,0,sizeof(CACHE_BLK)*CACHE_BLOCKS);
 
-	if(issue_packet_command(host,dev,&param)!=0)return -1;
-	switch((((uint)buf[2]&0xf)<<16)|((uint)buf[12]<<8)|((uint)buf[13]))
+	for(i=0;i<CACHE_BLOCKS;++i)
 	{
-		case 0x62800:return 0;			/* Not ready to ready change */
-		case 0x62900:					/* Power on,Reset */
-		case 0x20401:return 1;			/* Becoming ready */
-		case 0x63a00:return PRINT_ERR(ENOMEDIUM,"request_sense");	/* Medium not present */
-		default:return PRINT_ERR(EDERRE,"request_sense");
+		if((c->blk[i].buf=(char*)alloc_dma_buf(host))==NULL)break;
+		c->blk[i].prev=c->lru_tail;
+		if(c->lru_tail!=NULL)c->lru_tail->next=&c->blk[i];
+		else c->lru_head=&c->blk[i];
+		c->lru_tail=&c->blk[i];
 	}
+	c->num=i;
 }
 
 
+/************************************************************************************************
+ *
+ * ATAPI streaming read
+ *
+ ************************************************************************************************/
+
+
 /*
- * Start stop unit
- * parameters : Host number,Device number,Operation flag
+ * バッファーにnextから読み込み始める
+ * 最後まで読んでいれば空にする
+ * parameters : Host number,Device number,Buffer number
  * return : 0 or Error number
  */
-int start_stop_unit(int host,int dev,uchar ope)
+int start_stream(int host,int dev,int n)
 {
-	PACKET_PARAM param;
+	ATAPI_STREAM *s;
+	CONECT_DEV *cd;
+	uint count;
+	int error;
 
 
-	/* Set packet parameters */
-	param.feutures=(conect_dev[host][dev].flag&ATAPI_OVL)>>12;
-	memset(param.packet,0,12);
-	param.packet[0]=0x1b;
-	param.packet[4]=ope;
+	s=&atapi_stream[host][dev];
+	cd=&conect_dev[host][dev];
 
-	return issue_packet_command(host,dev,&param);
+	s->count[n]=0;
+	if(s->next>=cd->all_sectors)return 0;
+	count=STREAM_SIZE/cd->sector_size;
+	if(count>cd->all_sectors-s->next)count=cd->all_sectors-s->next;
+
+	s->seg[n].addr=s->buf[n];
+	s->seg[n].size=count*cd->sector_size;
+	s->req[n].host=host;
+	s->req[n].dev=dev;
+	s->req[n].mode=READ;
+	s->req[n].prio=dev_prio[host][dev];
+	s->req[n].seg=&s->seg[n];
+	s->req[n].nseg=1;
+	s->req[n].begin=s->next;
+	s->req[n].callback=NULL;
+	if((error=queue_request(host,&s->req[n]))!=0)return error;
+
+	s->begin[n]=s->next;
+	s->count[n]=count;
+	s->busy[n]=1;
+	s->next+=count;
+
+	return 0;
 }
 
 
 /*
- * Read capacity
- * parameters : Host number,Device number
+ * バッファーの読み込みが終わるのを待つ
+ * parameters : Host number,Device number,Buffer number
  * return : 0 or Error number
  */
-int read_capacity(int host,int dev)
+int wait_stream(int host,int dev,int n)
 {
-	PACKET_PARAM param;
-	char tmp,*buf;
+	ATAPI_STREAM *s;
 	int error;
-	int i,j;
 
 
-	buf=(char*)&conect_dev[host][dev].sector_size;
+	s=&atapi_stream[host][dev];
+	if(s->busy[n]==0)return 0;
 
-	/* Set packet parameters */
-	param.feutures=conect_dev[host][dev].mode>>1;
-	param.size=8;
-	param.buf=buf;
-	memset(param.packet,0,12);
-	param.packet[0]=0x25;
+	s->busy[n]=0;
+	if((error=wait_request(host,&s->req[n]))!=0)s->count[n]=0;
+
+	return error;
+}
+
+
+/*
+ * 読み込み中のコマンドを待って、バッファーを空にする
+ * ストリームのロック中に呼ぶ
+ * parameters : Host number,Device number
+ */
+void drop_stream(int host,int dev)
+{
+	ATAPI_STREAM *s;
+	int i;
 
-	if((error=issue_packet_command(host,dev,&param))!=0)return error;
 
-	for(i=0,j=7;i<4;++i,--j)
+	s=&atapi_stream[host][dev];
+	for(i=0;i<2;++i)
 	{
-		tmp=buf[i];
-		buf[i]=buf[j];
-		buf[j]=tmp;
+		wait_stream(host,dev,i);
+		s->count[i]=0;
 	}
+	s->stale=0;
+}
 
-	/*
-	 * 512byte単位で切捨て
-	 * ドライブによっては物理セクターサイズの場合がある
-	 */
-	conect_dev[host][dev].sector_size=ROUNDDOWN(conect_dev[host][dev].sector_size,512);
 
-	return 0;
+/*
+ * ストリーミング読み込み
+ * 2つのバッファーに交互にREAD(12)を出しておき、片方を読み終えたらすぐに続きを読み込ませる。
+ * ドライブはこちらがバッファーを使っている間も次のコマンドを転送する。
+ * 続きでない位置を読むとそこから読み直す
+ * parameters : Host number,Device number,Buffer,Transfer blocks,Begin block
+ * return : Transfer blocks or Error number
+ */
+int read_stream(int host,int dev,void *buf,size_t blocks,size_t begin)
+{
+	ATAPI_STREAM *s;
+	CONECT_DEV *cd;
+	uint lba,end,num;
+	int error;
+	int n;
+
+
+	s=&atapi_stream[host][dev];
+	cd=&conect_dev[host][dev];
+	if(begin+blocks>cd->all_sectors)return PRINT_ERR(EINVAL,"read_stream");
+	if(cd->downgrade)downgrade_mode(host,dev);
+
+	/* PIOではバッファーの読み込みを先に出しておけない */
+	if(intr_transfer(cd)==0)return transfer(host,dev,READ,buf,blocks,begin);
+
+	error=0;
+	wait_proc(&s->lock);
+	if(s->stale)drop_stream(host,dev);
+	for(lba=begin,end=begin+blocks;lba<end;lba+=num)
+	{
+		for(n=0;n<2;++n)
+			if((s->count[n]>0)&&(lba>=s->begin[n])&&(lba<s->begin[n]+s->count[n]))break;
+
+		if(n==2)
+		{
+			drop_stream(host,dev);
+			s->next=lba;
+			if((error=start_stream(host,dev,0))!=0)break;
+			start_stream(host,dev,1);
+			n=0;
+		}
+		if((error=wait_stream(host,dev,n))!=0)break;
+
+		num=s->begin[n]+s->count[n]-lba;
+		if(num>end-lba)num=end-lba;
+		memcpy(buf,s->buf[n]+(lba-s->begin[n])*cd->sector_size,num*cd->sector_size);
+		buf=(char*)buf+num*cd->sector_size;
+
+		/* 使い終わったバッファーにもう片方の続きを読み込ませる */
+		if(lba+num==s->begin[n]+s->count[n])start_stream(host,dev,n);
+	}
+	wake_proc(&s->lock);
+
+	return (error!=0)?error:blocks;
 }
 
 
 /*
- * Read data
- * parameters : Host number,Device number,Transfer mode,Buffer,Begin sector
- * rturn : 0 or Error number
+ * ストリーミング読み込みの切り替え
+ * 有効にする時はバッファーを確保して、ドライブを最高速にする
+ * parameters : Host number,Device number,1=有効 0=無効
+ * return : 0 or Error number
  */
-int _transfer_atapi(int host,int dev,int trans_mode,void *buf,int count,uint begin)
+int set_stream(int host,int dev,int on)
 {
-	PACKET_PARAM param;
+	ATAPI_STREAM *s;
+	CONECT_DEV *cd;
+	ATA_REQ req;
+	int i;
 
 
-	/* Set packet parameters */
-	param.feutures=((conect_dev[host][dev].flag&ATAPI_OVL)>>12)|(conect_dev[host][dev].mode>>1);
-	param.size=conect_dev[host][dev].sector_size;
-	param.buf=buf;
-	memset(param.packet,0,12);
-	param.packet[0]=(trans_mode==READ)?0x28:0x2a;
-	param.packet[2]=(uchar)begin>>24;
-	param.packet[3]=(uchar)begin>>16;
-	param.packet[4]=(uchar)begin>>8;
-	param.packet[5]=(uchar)begin;
-	param.packet[7]=(uchar)count>>8;
-	param.packet[8]=(uchar)count;
+	s=&atapi_stream[host][dev];
+	cd=&conect_dev[host][dev];
+	if(cd->type!=ATAPI)return PRINT_ERR(ENODEV,"set_stream");
 
-	return issue_packet_command(host,dev,&param);
+	wait_proc(&s->lock);
+	drop_stream(host,dev);
+	if(on)
+	{
+		for(i=0;i<2;++i)
+			if((s->buf[i]==NULL)&&((s->buf[i]=(char*)kmalloc(STREAM_SIZE))==NULL))
+			{
+				wake_proc(&s->lock);
+				return PRINT_ERR(ENOMEM,"set_stream");
+			}
+
+		/* 対応していないドライブもあるので、エラーは無視する */
+		lock_host(host,dev,&req);
+		set_cd_speed(host,dev,CD_SPEED_MAX);
+		unlock_host(host,&req);
+
+		cd->flag|=STREAM_BIT;
+	}
+	else
+	{
+		cd->flag&=~STREAM_BIT;
+		for(i=0;i<2;++i)
+			if(s->buf[i]!=NULL)
+			{
+				kfree(s->buf[i]);
+				s->buf[i]=NULL;
+			}
+	}
+	wake_proc(&s->lock);
+
+	return 0;
 }
 
 
@@ -1541,27 +5183,82 @@ int _transfer_atapi(int host,int dev,int trans_mode,void *buf,int count,uint beg
 
 /*
  * Test atapi and read capacity
+ * メディアが変わっていなければ、前に読んだ容量をそのまま使う
  * parameters : Host number,Device number
  * return : Redy=0 or Error number
  */
 int test_atapi(int host,int dev)
 {
+	CONECT_DEV *cd;
+	ATA_REQ req;
+	WAIT_INTR wait;
+	int backoff;
+	int sense;
+	int retry;
 	int error;
 
 
-	for(;test_unit_ready(host,dev)!=0;)
+	cd=&conect_dev[host][dev];
+
+	lock_host(host,dev,&req);
+
+	/* メディアが変わっていなければ前に読んだ容量を使う */
+	if((cd->flag&MEDIA_BIT)&&(media_event(host,dev)==0))
+	{
+		unlock_host(host,&req);
+		return 0;
+	}
+
+	/* 溜まっているイベントを捨ててから読み直す */
+	cd->flag&=~MEDIA_BIT;
+	atapi_stream[host][dev].stale=1;
+	media_event(host,dev);
+
+	for(retry=0,backoff=MEDIA_WAIT_MIN;(error=test_unit_ready(host,dev))!=0;++retry)
 	{
-		error=request_sense(host,dev);
-		if(error==0)break;
-		else if(error<0)return error;
+		if((sense=request_sense(host,dev))<0)
+		{
+			error=sense;
+			break;
+		}
+		if((sense&0xff00)==0x3a00)
+		{
+			error=PRINT_ERR(ENOMEDIUM,"test_atapi");		/* Medium not present */
+			break;
+		}
+		if(retry==MEDIA_RETRY_MAX)
+		{
+			error=PRINT_ERR(ETIMEOUT,"test_atapi");
+			break;
+		}
+
+		/* Unit attention(メディア交換,リセット)はすぐに再試行する */
+		if((sense>>16)==0x6)continue;
+		if(sense!=0x20401)
+		{
+			error=PRINT_ERR(EDERRE,"test_atapi");
+			break;
+		}
+
+		/* 起動中はホストを放して、待つ時間を倍にしていく */
+		unlock_host(host,&req);
+		wait.proc=NULL;
+		wait.flag=0;
+		wait_intr(&wait,backoff);
+		if((backoff*=2)>MEDIA_WAIT_MAX)backoff=MEDIA_WAIT_MAX;
+		lock_host(host,dev,&req);
 	}
 
 	/* Read sector size and max sector number */
-	if((error=read_capacity(host,dev))!=0)return error;
-	hd_info[host][dev].last_blk=conect_dev[host][dev].all_sectors-1;
-	hd_info[host][dev].sector_size=conect_dev[host][dev].sector_size;
+	if((error==0)&&((error=read_capacity(host,dev))==0))
+	{
+		hd_info[host][dev].last_blk=cd->all_sectors-1;
+		hd_info[host][dev].sector_size=cd->sector_size;
+		cd->flag|=MEDIA_BIT;
+	}
+	unlock_host(host,&req);
 
-	return 0;
+	return error;
 }
 
 
@@ -1610,69 +5307,305 @@ int open_hdd()
 
 int read_hda(void *buf,size_t size,size_t begin)
 {
-	return transfer(0,0,READ,buf,size,begin);
+	return cache_transfer(0,0,READ,buf,size,begin);
 }
 
 int read_hdb(void *buf,size_t size,size_t begin)
 {
-	return transfer(0,1,READ,buf,size,begin);
+	return cache_transfer(0,1,READ,buf,size,begin);
 }
 
 int read_hdc(void *buf,size_t size,size_t begin)
 {
-	return transfer(1,0,READ,buf,size,begin);
+	return cache_transfer(1,0,READ,buf,size,begin);
 }
 
 int read_hdd(void *buf,size_t size,size_t begin)
 {
-	return transfer(1,1,READ,buf,size,begin);
+	return cache_transfer(1,1,READ,buf,size,begin);
 }
 
 int write_hda(void *buf,size_t size,size_t begin)
 {
-	return transfer(0,0,WRITE,buf,size,begin);
+	return cache_transfer(0,0,WRITE,buf,size,begin);
 }
 
 int write_hdb(void *buf,size_t size,size_t begin)
 {
-	return transfer(0,1,WRITE,buf,size,begin);
+	return cache_transfer(0,1,WRITE,buf,size,begin);
 }
 
 int write_hdc(void *buf,size_t size,size_t begin)
 {
-	return transfer(1,0,WRITE,buf,size,begin);
+	return cache_transfer(1,0,WRITE,buf,size,begin);
 }
 
 int write_hdd(void *buf,size_t size,size_t begin)
 {
-	return transfer(1,1,WRITE,buf,size,begin);
+	return cache_transfer(1,1,WRITE,buf,size,begin);
 }
 
-int ioctl_hda(int command,void *param)
+/*
+ * Scatter gather interface
+ * parameters : Host number,Device number,Segment list,Number of segments,begin block
+ * return : Transfer blocks or Error number
+ */
+int read_sg_ata(int host,int dev,ATA_SEG *seg,int nseg,size_t begin)
 {
+	if((uint)host>1||(uint)dev>1)return PRINT_ERR(EINVAL,"read_sg_ata");
+	return direct_transfer(host,dev,READ,seg,nseg,begin);
+}
+
+int write_sg_ata(int host,int dev,ATA_SEG *seg,int nseg,size_t begin)
+{
+	if((uint)host>1||(uint)dev>1)return PRINT_ERR(EINVAL,"write_sg_ata");
+	return direct_transfer(host,dev,WRITE,seg,nseg,begin);
+}
+
+/*
+ * Asynchronous interface
+ * 要求をキューに入れてすぐに戻る。完了するとcallbackが呼ばれる(割り込み中の場合もある)。
+ * callbackがNULLならwait_ata()で完了を待つ。I/O priority classはreq->prioで指定する。
+ * 割り込みで完了できないPIOの要求は、完了してから戻る。
+ * parameters : Request
+ * return : 0 or Error number
+ */
+int submit_ata(ATA_REQ *req)
+{
+	void (*callback)(ATA_REQ*);
+	CONECT_DEV *cd;
+	int error;
+
+
+	if(((uint)req->host>1)||((uint)req->dev>1)||((req->mode!=READ)&&(req->mode!=WRITE))||((uint)req->prio>=ATA_PRIO_NUM))
+		return PRINT_ERR(EINVAL,"submit_ata");
+
+	cd=&conect_dev[req->host][req->dev];
+	if(intr_transfer(cd))return queue_request(req->host,req);
+
+	callback=req->callback;
+	req->callback=NULL;
+	if((error=queue_request(req->host,req))==0)error=wait_request(req->host,req);
+	req->callback=callback;
+	req->error=error;
+	if(callback!=NULL)callback(req);
+
 	return 0;
 }
 
+/*
+ * parameters : Request
+ * return : Transfer blocks or Error number
+ */
+int wait_ata(ATA_REQ *req)
+{
+	int error;
+
+
+	if(req->callback!=NULL)return PRINT_ERR(EINVAL,"wait_ata");
+	return ((error=wait_request(req->host,req))!=0)?error:req->count;
+}
+
+/*
+ * キャッシュの書き戻し
+ * write-backのデバイスのdirtyブロックは他に読み書きがないと書き戻されないので、書いたデータを残すにはこれを呼ぶ
+ * parameters : Host number,Device number
+ * return : 0 or Error number
+ */
+int sync_ata(int host,int dev)
+{
+	if((uint)host>1||(uint)dev>1)return PRINT_ERR(EINVAL,"sync_ata");
+	return sync_cache(host,dev);
+}
+
+/*
+ * Write barrier
+ * キャッシュを書き戻し、ドライブのライトキャッシュもメディアに書き込ませる。
+ * 戻った時点で、それまでに完了した書き込みは全てメディアにある。
+ * parameters : Host number,Device number
+ * return : 0 or Error number
+ */
+int flush_ata(int host,int dev)
+{
+	ATA_REQ req;
+	int error;
+
+
+	if((uint)host>1||(uint)dev>1)return PRINT_ERR(EINVAL,"flush_ata");
+	if((error=sync_cache(host,dev))!=0)return error;
+	if((conect_dev[host][dev].flag&WCACHE_BIT)==0)return 0;
+
+	lock_host(host,dev,&req);
+	error=flush_device(host,dev);
+	unlock_host(host,&req);
+
+	return error;
+}
+
+/*
+ * ライトキャッシュ、先読みの切り替え
+ * parameters : Host number,Device number,WCACHE_BIT or LOOKAHEAD_BIT,1=有効 0=無効
+ * return : 0 or Error number
+ */
+int ioctl_drive_cache(int host,int dev,int bit,int on)
+{
+	ATA_REQ req;
+	int error;
+
+
+	if(conect_dev[host][dev].type!=ATA)return PRINT_ERR(ENODEV,"ioctl_drive_cache");
+
+	lock_host(host,dev,&req);
+	error=set_drive_cache(host,dev,bit,on!=0);
+	unlock_host(host,&req);
+
+	return error;
+}
+
+int ioctl_hda(int command,void *param)
+{
+	return ioctl_ata(0,0,command,param);
+}
+
 int ioctl_hdb(int command,void *param)
 {
-	return 0;
+	return ioctl_ata(0,1,command,param);
 }
 
 int ioctl_hdc(int command,void *param)
 {
-	return 0;
+	return ioctl_ata(1,0,command,param);
 }
 
 int ioctl_hdd(int command,void *param)
 {
-	return 0;
+	return ioctl_ata(1,1,command,param);
+}
+
+/*
+ * ioctl
+ * parameters : Host number,Device number,Command,Parameter
+ * return : 0 or Error number
+ */
+int ioctl_ata(int host,int dev,int command,void *param)
+{
+	ATA_SCHED *sched;
+	IDE_CHIP *chip;
+	PCI_INFO ide;
+	uint eflags;
+
+
+	switch(command)
+	{
+		case ATA_IOCTL_GET_SCHED:
+			memcpy(param,&req_queue[host].param,sizeof(ATA_SCHED));
+			return 0;
+		case ATA_IOCTL_SET_SCHED:
+			sched=(ATA_SCHED*)param;
+			if((sched->max_merge<0)||(sched->read_expire<0)||(sched->write_expire<0)||(sched->queue_depth<0)||
+				(sched->rt_expire<0)||(sched->idle_expire<0))
+				return PRINT_ERR(EINVAL,"ioctl_ata");
+			eflags=enter_queue(host);
+			memcpy(&req_queue[host].param,sched,sizeof(ATA_SCHED));
+			exit_queue(host,eflags);
+			return 0;
+		case ATA_IOCTL_GET_SCHED_STAT:
+			memcpy(param,&req_queue[host].stat,sizeof(ATA_SCHED_STAT));
+			return 0;
+		case ATA_IOCTL_RESET_SCHED_STAT:
+			memset(&req_queue[host].stat,0,sizeof(ATA_SCHED_STAT));
+			return 0;
+		case ATA_IOCTL_GET_PIO32:
+			*(int*)param=(conect_dev[host][dev].flag&PIO32_BIT)!=0;
+			return 0;
+		case ATA_IOCTL_SET_PIO32:
+			if(*(int*)param)
+			{
+				/* データポートへの32bitアクセスを分解できるチップセットだけ */
+				chip=(search_pci_class(PCI_CLS_IDE,&ide)==-1)?NULL:find_chipset(ide.vender);
+				if((chip==NULL)||((chip->flag&CHIP_PIO32)==0))return PRINT_ERR(EINVAL,"ioctl_ata");
+				conect_dev[host][dev].flag|=PIO32_BIT;
+			}
+			else conect_dev[host][dev].flag&=~PIO32_BIT;
+			return 0;
+		case ATA_IOCTL_READ_TRACE:
+			return read_trace((ATA_TRACE_READ*)param);
+		case ATA_IOCTL_SET_TRACE:
+			trace_on=*(int*)param;
+			return 0;
+		case ATA_IOCTL_GET_DEV_STAT:
+			eflags=enter_queue(host);
+			memcpy(param,&dev_stat[host][dev],sizeof(ATA_DEV_STAT));
+			exit_queue(host,eflags);
+			return 0;
+		case ATA_IOCTL_RESET_DEV_STAT:
+			eflags=enter_queue(host);
+			memset(&dev_stat[host][dev],0,sizeof(ATA_DEV_STAT));
+			exit_queue(host,eflags);
+			return 0;
+		case ATA_IOCTL_GET_MODE:
+			*(int*)param=conect_dev[host][dev].mode;
+			return 0;
+		case ATA_IOCTL_SET_MODE:
+			return set_mode(host,dev,*(int*)param);
+		case ATA_IOCTL_SYNC:
+			return sync_cache(host,dev);
+		case ATA_IOCTL_FLUSH:
+			return flush_ata(host,dev);
+		case ATA_IOCTL_GET_WCACHE:
+			*(int*)param=(conect_dev[host][dev].flag&WCACHE_BIT)!=0;
+			return 0;
+		case ATA_IOCTL_GET_LOOKAHEAD:
+			*(int*)param=(conect_dev[host][dev].flag&LOOKAHEAD_BIT)!=0;
+			return 0;
+		case ATA_IOCTL_SET_WCACHE:
+		case ATA_IOCTL_SET_LOOKAHEAD:
+			return ioctl_drive_cache(host,dev,(command==ATA_IOCTL_SET_WCACHE)?WCACHE_BIT:LOOKAHEAD_BIT,*(int*)param);
+		case ATA_IOCTL_GET_WRITEBACK:
+			*(int*)param=(conect_dev[host][dev].flag&WBACK_BIT)!=0;
+			return 0;
+		case ATA_IOCTL_SET_WRITEBACK:
+			if(*(int*)param)
+			{
+				conect_dev[host][dev].flag|=WBACK_BIT;
+				return 0;
+			}
+			conect_dev[host][dev].flag&=~WBACK_BIT;
+			return sync_cache(host,dev);
+		case ATA_IOCTL_GET_STREAM:
+			*(int*)param=(conect_dev[host][dev].flag&STREAM_BIT)!=0;
+			return 0;
+		case ATA_IOCTL_SET_STREAM:
+			return set_stream(host,dev,*(int*)param);
+		case ATA_IOCTL_GET_PRIO:
+			*(int*)param=dev_prio[host][dev];
+			return 0;
+		case ATA_IOCTL_SET_PRIO:
+			if((uint)*(int*)param>=ATA_PRIO_NUM)return PRINT_ERR(EINVAL,"ioctl_ata");
+			dev_prio[host][dev]=*(int*)param;
+			return 0;
+		case ATA_IOCTL_GET_CACHE_STAT:
+			memcpy(param,&cache[host].stat[dev],sizeof(ATA_CACHE_STAT));
+			return 0;
+		case ATA_IOCTL_RESET_CACHE_STAT:
+			memset(&cache[host].stat[dev],0,sizeof(ATA_CACHE_STAT));
+			return 0;
+		default:
+			return PRINT_ERR(EINVAL,"ioctl_ata");
+	}
 }
 /******************************************************************/
 void test_hd()
 {
-	char *buf1=(char*)0x80000;
-	char *buf2=(char*)0x90000;
+	char *buf1,*buf2;
+
 
+	if((buf1=(char*)alloc_dma_buf(0))==NULL)return;
+	if((buf2=(char*)alloc_dma_buf(0))==NULL)
+	{
+		free_dma_buf(0,buf1);
+		return;
+	}
 
 	buf1[0]=0xaa;
 	buf1[0x1000-1]=0xbb;
@@ -1682,6 +5615,9 @@ void test_hd()
 	printk("transfer=%d\n",transfer(0,1,READ,buf2,8,0x3f+1600));
 	printk("buf2[0]=%x,buf2[0x10000-1]=%x\n",buf2[0],buf2[0x1000-1]);
 
+	free_dma_buf(0,buf1);
+	free_dma_buf(0,buf2);
+
 /*	int *buf=(int*)0x90000;
 
 	if(change_mode(1,0,M_DMA)!=0)printk("Fail change_mode!\n");
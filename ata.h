@@ -13,7 +13,173 @@
 #ifndef ASM_FILE
 
 
+/* Scatter gather segment */
+typedef struct{
+	void *addr;		/* Buffer virtual address,ワード境界でなくてもよい */
+	uint size;		/* Transfer bytes */
+}ATA_SEG;
+
+/* I/O priority class */
+enum{
+	ATA_PRIO_BE=0,			/* Best effort */
+	ATA_PRIO_RT=1,			/* Realtime,他のクラスより先に出す */
+	ATA_PRIO_IDLE=2,		/* Idle,他のクラスの要求がない時に出す */
+	ATA_PRIO_NUM=3,
+};
+
+/* Elevator parameters */
+typedef struct{
+	int elevator;			/* 0=FIFO,1=C-SCAN */
+	int max_merge;			/* Max sectors of merged command,0=device max */
+	int read_expire;		/* Read deadline ms */
+	int write_expire;		/* Write deadline ms */
+	int queue_depth;		/* TCQで同時に発行するコマンド数,0=TCQを使わない */
+	int rt_expire;			/* Realtime deadline ms */
+	int idle_expire;		/* Idleの要求がこれだけ待ったら他のクラスより先に出す ms */
+}ATA_SCHED;
+
+/* Elevator statistics */
+typedef struct{
+	uint request;			/* Queued requests */
+	uint dispatch;			/* Issued commands */
+	uint merge;				/* Merged requests */
+	uint expire;			/* Deadline dispatches */
+	uint preempt;			/* 上のクラスの要求に譲って中断した転送 */
+	uint seek;				/* Non sequential dispatches */
+	uint64 seek_dist;		/* Total seek distance sectors */
+}ATA_SCHED_STAT;
+
+/* Buffer cache statistics */
+typedef struct{
+	uint hit;				/* Read hit blocks */
+	uint miss;				/* Read miss blocks */
+	uint write;				/* Written blocks */
+	uint writeback;			/* Write back commands */
+	uint evict;				/* Evicted blocks */
+	uint bypass;			/* キャッシュを通さない転送 */
+	uint ra_issue;			/* Readahead blocks */
+	uint ra_hit;			/* 読まれた先読みブロック */
+	uint ra_waste;			/* 使われずに追い出された先読みブロック */
+}ATA_CACHE_STAT;
+
+/* Device statistics */
+enum{
+	ATA_HIST_NUM=48,		/* log2(rdtsc clock)のヒストグラムの区間数 */
+};
+
+typedef struct{
+	uint read;				/* Read requests */
+	uint write;				/* Write requests */
+	uint64 read_sect;		/* Read sectors */
+	uint64 write_sect;		/* Written sectors */
+	uint pio;				/* PIOで処理した要求 */
+	uint dma;				/* DMAで処理した要求 */
+	uint error;				/* Error requests */
+	uint timeout;			/* Timeout requests */
+	uint poll;				/* ポーリングで完了を待ったDMAコマンド */
+	uint sleep;				/* 割り込みまで寝て完了を待ったDMAコマンド */
+	uint release;			/* overlapでバスを解放したATAPIコマンド */
+	uint64 queue_time;		/* キューで待った合計clock */
+	uint64 wire_time;		/* 転送にかかった合計clock */
+	uint queue_hist[ATA_HIST_NUM];	/* Queue time histogram,[n]は2^n clock以上2^(n+1)未満 */
+	uint wire_hist[ATA_HIST_NUM];	/* Wire time histogram */
+	uint total_hist[ATA_HIST_NUM];	/* Queue+wire time histogram */
+}ATA_DEV_STAT;
+
+/* Interrupt trace record */
+typedef struct{
+	uint64 time;			/* rdtsc */
+	uchar irq;				/* IRQ number */
+	uchar bmis;				/* Bus Master IDE status */
+	uchar status;			/* Device alternate status */
+	uchar cpu;				/* CPU number */
+}ATA_TRACE;
+
+/* Interrupt trace read parameters */
+typedef struct{
+	ATA_TRACE *buf;			/* Record buffer */
+	int num;				/* Buffer records,戻り値は読み出したレコード数 */
+	uint lost;				/* 前回読み出してから満杯で捨てたレコード数 */
+}ATA_TRACE_READ;
+
+/* Transfer mode */
+enum{
+	ATA_READ=0,
+	ATA_WRITE=1,
+};
+
+/* Transfer type */
+enum{
+	ATA_PIO=1,			/* PIO */
+	ATA_MDMA=2,			/* Multi word DMA */
+	ATA_UDMA=3,			/* Ultra DMA */
+};
+
+/* Asynchronous I/O request */
+typedef struct ATA_REQ{
+	/* 呼び出し側で設定する */
+	int host;				/* Host number */
+	int dev;				/* Device number */
+	int mode;				/* ATA_READ or ATA_WRITE */
+	ATA_SEG *seg;			/* Segment list */
+	int nseg;				/* Number of segments */
+	uint begin;				/* Begin block */
+	void (*callback)(struct ATA_REQ*);	/* Complete function or NULL */
+	void *arg;				/* Callback argument */
+	int prio;				/* I/O priority class ATA_PRIO_* */
+
+	/* 完了時にドライバーが設定する */
+	int error;				/* 0 or Error number */
+	int done;				/* callbackがNULLの場合の完了フラグ */
+	WAIT_INTR wait;			/* 完了待ち */
+
+	/* ドライバー内部で使用 */
+	struct ATA_REQ *next;	/* Queue link,dispatch時はまとめた要求のリンク */
+	uint count;				/* Block count */
+	uint64 time;			/* Queued clock */
+	int flag;				/* Request flag */
+	int run;				/* プロセスで処理する順番が来た */
+	uint skip;				/* 中断してキューに戻した要求の転送済みバイト数 */
+}ATA_REQ;
+
+/* ioctl command */
+enum{
+	ATA_IOCTL_GET_SCHED=0x100,		/* Get elevator parameters(ATA_SCHED*) */
+	ATA_IOCTL_SET_SCHED,			/* Set elevator parameters(ATA_SCHED*) */
+	ATA_IOCTL_GET_SCHED_STAT,		/* Get elevator statistics(ATA_SCHED_STAT*) */
+	ATA_IOCTL_RESET_SCHED_STAT,		/* Reset elevator statistics */
+	ATA_IOCTL_SYNC,					/* Write back dirty cache blocks,write-backで読み書きが止まると自動では書き戻さない */
+	ATA_IOCTL_GET_CACHE_STAT,		/* Get cache statistics(ATA_CACHE_STAT*) */
+	ATA_IOCTL_RESET_CACHE_STAT,		/* Reset cache statistics */
+	ATA_IOCTL_GET_PIO32,			/* Get 32bit PIO flag(int*) */
+	ATA_IOCTL_SET_PIO32,			/* Set 32bit PIO flag(int*),対応していないチップセットならEINVAL */
+	ATA_IOCTL_READ_TRACE,			/* Drain interrupt trace(ATA_TRACE_READ*) */
+	ATA_IOCTL_SET_TRACE,			/* Interrupt trace on=1 off=0(int*) */
+	ATA_IOCTL_GET_DEV_STAT,			/* Get device statistics(ATA_DEV_STAT*) */
+	ATA_IOCTL_RESET_DEV_STAT,		/* Reset device statistics */
+	ATA_IOCTL_GET_MODE,				/* Get transfer type(int*) */
+	ATA_IOCTL_SET_MODE,				/* Set transfer type(int*),転送を止めて切り替える */
+	ATA_IOCTL_FLUSH,				/* Write barrier,キャッシュとドライブのライトキャッシュを書き込む */
+	ATA_IOCTL_GET_WCACHE,			/* Get drive write cache flag(int*) */
+	ATA_IOCTL_SET_WCACHE,			/* Set drive write cache flag(int*) */
+	ATA_IOCTL_GET_LOOKAHEAD,		/* Get drive read look-ahead flag(int*) */
+	ATA_IOCTL_SET_LOOKAHEAD,		/* Set drive read look-ahead flag(int*) */
+	ATA_IOCTL_GET_STREAM,			/* Get ATAPI streaming read flag(int*) */
+	ATA_IOCTL_SET_STREAM,			/* Set ATAPI streaming read flag(int*),順に読むならドライブを止めずに先に読ませる */
+	ATA_IOCTL_GET_PRIO,				/* Get I/O priority class(int*) */
+	ATA_IOCTL_SET_PRIO,				/* Set I/O priority class(int*),hdXの入口とキャッシュの転送に使う */
+	ATA_IOCTL_GET_WRITEBACK,		/* Get buffer cache write-back flag(int*) */
+	ATA_IOCTL_SET_WRITEBACK			/* Set buffer cache write-back flag(int*),0=write-through(default)に戻す時は書き戻す */
+};
+
+
 extern int init_ata();
+extern int read_sg_ata(int,int,ATA_SEG*,int,size_t);
+extern int write_sg_ata(int,int,ATA_SEG*,int,size_t);
+extern int submit_ata(ATA_REQ*);
+extern int wait_ata(ATA_REQ*);
+extern int sync_ata(int,int);
+extern int flush_ata(int,int);
 
 
 #endif
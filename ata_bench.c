@@ -0,0 +1,1031 @@
+/*
+ * ata_bench.c
+ *
+ * Copyright 2002, Minoru Murashima. All rights reserved.
+ * Distributed under the terms of the BSD License.
+ *
+ * ATA driver benchmark
+ * ata_sim.cのシミュレーターにディスクイメージをつなぎ、hdXの入り口から負荷をかけて
+ * IOPS、MB/s、1要求あたりのCPUサイクル、レイテンシーのパーセンタイルを測る。
+ * 時間はシミュレーターの時間なので、同じ引数なら毎回同じ結果になる。
+ *
+ * gcc -m32 -DATA_SIM -o ata_bench ata_bench.c ata.c ata_sim.c
+ * ata_bench --disk hda=disk.img --random --read 70 --bs 4096 --qd 8 --runtime 2000
+ * ata_bench --disk hda=disk.img --pio --pio-bench 1000
+ */
+
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<getopt.h>
+#include"ata_sim.h"
+#include"ata.h"
+
+
+enum{
+	DEV_MAX=4,
+	QD_MAX=32,				/* ドライバーのTCQの最大 */
+	TIME_OUT=2000,			/* wait_intrのタイムアウトms */
+	LAT_INIT=4096,			/* レイテンシー記録の初期数 */
+
+	/* PIOの測定 */
+	PRIM_DATA=0x1f0,		/* Primary data port */
+	SECN_DATA=0x170,		/* Secondary data port */
+	CNT_OFFSET=2,			/* Sector count register */
+	LBA_OFFSET=3,			/* LBA low,mid,high register */
+	DHR_OFFSET=6,			/* Device/head register */
+	STR_OFFSET=7,			/* Status,command register */
+	CTRL_OFFSET=0x206,		/* Device control register */
+	NIEN_CTRL=0x2,			/* 割り込みを止める */
+	BSY_STATUS=0x80,
+	DRQ_STATUS=0x8,
+	ERR_STATUS=0x1,
+	CMD_READ_SECTORS=0x20,
+	CMD_WRITE_SECTORS=0x30,
+	SECTOR_WORDS=256,
+	PIO_PATH_NUM=3,			/* ワードごと,rep insw/outsw,rep insl/outsl */
+};
+
+/* 発行中の要求 */
+typedef struct{
+	ATA_REQ req;
+	ATA_SEG seg;
+	void *buf;
+	uint64 start;			/* 発行したns */
+	uint64 end;				/* 完了したns */
+	int busy;				/* 発行中 */
+	int done;				/* callbackが呼ばれた */
+}SLOT;
+
+/* 負荷をかけるデバイス */
+typedef struct{
+	const char *name;		/* hda-hdd */
+	const char *image;
+	int type;				/* SIM_ATA or SIM_ATAPI */
+	int host;
+	int dev;
+	int prio;				/* I/O priority class ATA_PRIO_* */
+	DEV_INFO *info;
+	uint sectors;			/* 使えるセクター数 */
+	uint bs_sect;			/* 1要求のセクター数 */
+	uint pos;				/* シーケンシャルの次のセクター */
+	int inflight;
+	SLOT slot[QD_MAX];
+	uint read;
+	uint write;
+	uint error;
+	uint64 bytes;
+	uint unflushed;			/* 前のflushからの書き込み */
+	uint flush;				/* flush_ataの回数 */
+	uint64 lat_sum;			/* 完了した要求のレイテンシーの合計ns */
+	uint64 lat_max;
+}BENCH_DEV;
+
+/* ベンチマークの設定 */
+typedef struct{
+	int random;				/* 1=ランダム,0=シーケンシャル */
+	int read_pct;			/* 読み込みの割合% */
+	uint bs;				/* 1要求のバイト数 */
+	int qd;					/* デバイスごとの同時要求数 */
+	uint runtime;			/* 測定時間ms */
+	uint seed;
+	int json;				/* 1=JSONで出力 */
+	int verbose;
+	int pio;				/* PIOで測る */
+	uint tcq;				/* シミュレーターのドライブのTCQの深さ */
+	uint chipset;			/* IDEコントローラーのPCI ID */
+	uint flush;				/* この回数の書き込みごとにflush_ata,0ならしない */
+	int wcache;				/* ドライブのライトキャッシュ 1=有効 0=無効 -1=そのまま */
+	int lookahead;			/* ドライブの先読み 1=有効 0=無効 -1=そのまま */
+	int writeback;			/* ドライバーのキャッシュ 1=write-back 0=write-through -1=そのまま */
+	int stream;				/* ATAPIのストリーミング読み込み */
+	int overlap;			/* シミュレーターのCD-ROMのoverlap 1=有効 0=無効 -1=そのまま */
+	int elevator;			/* エレベーター 1=C-SCAN 0=FIFO -1=そのまま */
+	int pio32;				/* 32bit PIO */
+	uint pio_bench;			/* PIOの転送方法をこのセクター数で比べる,0ならしない */
+	int sweep;				/* キューの深さを1からqdまで変えて測る */
+}BENCH_CONF;
+
+
+static BENCH_CONF conf={0,100,4096,1,1000,1,0,0,0,0,0x24CB8086,0,-1,-1,-1,0,-1,-1,0,0,0};
+static BENCH_DEV bench_dev[DEV_MAX];
+static int dev_num;
+static WAIT_INTR bench_wait;			/* 非同期要求の完了待ち */
+static const char *prio_name[ATA_PRIO_NUM]={"be","rt","idle"};	/* ATA_PRIO_*の名前 */
+static const char *pio_path_name[PIO_PATH_NUM]={"word loop","rep insw/outsw","rep insl/outsl"};
+static uint64 *lat;						/* 完了した要求のレイテンシーns */
+static uint lat_num;
+static uint lat_size;
+static uint rand_state;
+
+
+/*
+ * 乱数
+ * 結果を再現できるように自前の線形合同法を使う
+ */
+static uint bench_rand()
+{
+	rand_state=rand_state*1103515245+12345;
+	return rand_state>>8;
+}
+
+
+/*
+ * レイテンシーを記録する
+ * parameters : Device,ns
+ */
+static void add_latency(BENCH_DEV *bd,uint64 ns)
+{
+	uint64 *p;
+
+
+	bd->lat_sum+=ns;
+	if(ns>bd->lat_max)bd->lat_max=ns;
+
+	if(lat_num==lat_size)
+	{
+		if((p=realloc(lat,sizeof(uint64)*(lat_size?lat_size*2:LAT_INIT)))==NULL)return;
+		lat=p;
+		lat_size=lat_size?lat_size*2:LAT_INIT;
+	}
+	lat[lat_num++]=ns;
+}
+
+
+static int cmp_latency(const void *a,const void *b)
+{
+	uint64 x=*(const uint64*)a,y=*(const uint64*)b;
+
+
+	return (x>y)-(x<y);
+}
+
+
+/*
+ * パーセンタイル
+ * parameters : 0.0-1.0
+ * return : ns
+ */
+static uint64 percentile(double p)
+{
+	uint i;
+
+
+	if(lat_num==0)return 0;
+	i=(uint)(p*lat_num);
+	if(i>=lat_num)i=lat_num-1;
+	return lat[i];
+}
+
+
+/*
+ * 次の要求の位置と向き
+ * parameters : Device,Return write flag
+ * return : Begin sector
+ */
+static uint next_lba(BENCH_DEV *bd,int *write)
+{
+	uint lba,n;
+
+
+	*write=(bd->type==SIM_ATA)&&((int)(bench_rand()%100)>=conf.read_pct);
+
+	if(conf.random)
+	{
+		n=bd->sectors/bd->bs_sect;
+		return (bench_rand()%n)*bd->bs_sect;
+	}
+
+	if(bd->pos+bd->bs_sect>bd->sectors)bd->pos=0;
+	lba=bd->pos;
+	bd->pos+=bd->bs_sect;
+	return lba;
+}
+
+
+/*
+ * 書き込みを数え、conf.flush回ごとにwrite barrierを入れる
+ * parameters : Device
+ */
+static void count_write(BENCH_DEV *bd)
+{
+	++bd->write;
+	if((conf.flush==0)||(++bd->unflushed<conf.flush))return;
+
+	bd->unflushed=0;
+	++bd->flush;
+	if(flush_ata(bd->host,bd->dev)!=0)++bd->error;
+}
+
+
+/*
+ * 非同期要求の完了
+ * 割り込みハンドラーから呼ばれるので、時刻を記録して起こすだけ
+ */
+static void bench_done(ATA_REQ *req)
+{
+	SLOT *slot;
+
+
+	slot=req->arg;
+	slot->end=sim_time();
+	slot->done=1;
+	wake_intr(&bench_wait);
+}
+
+
+/*
+ * 非同期要求を発行する
+ * parameters : Device,Slot
+ * return : 0 or Error number
+ */
+static int issue_slot(BENCH_DEV *bd,SLOT *slot)
+{
+	int write;
+	int error;
+
+
+	memset(&slot->req,0,sizeof(ATA_REQ));
+	slot->req.host=bd->host;
+	slot->req.dev=bd->dev;
+	slot->req.begin=next_lba(bd,&write);
+	slot->req.mode=write?ATA_WRITE:ATA_READ;
+	slot->seg.addr=slot->buf;
+	slot->seg.size=conf.bs;
+	slot->req.seg=&slot->seg;
+	slot->req.nseg=1;
+	slot->req.callback=bench_done;
+	slot->req.arg=slot;
+	slot->req.prio=bd->prio;
+	slot->busy=1;
+	slot->done=0;
+	slot->start=sim_time();
+	++bd->inflight;
+
+	if((error=submit_ata(&slot->req))!=0)
+	{
+		slot->busy=0;
+		--bd->inflight;
+		++bd->error;
+	}
+	return error;
+}
+
+
+/*
+ * 完了した要求を集計する
+ * parameters : Device
+ */
+static void reap(BENCH_DEV *bd)
+{
+	SLOT *slot;
+	int i;
+
+
+	for(i=0;i<conf.qd;++i)
+	{
+		slot=&bd->slot[i];
+		if((slot->busy==0)||(slot->done==0))continue;
+
+		slot->busy=0;
+		--bd->inflight;
+		if(slot->req.error!=0)
+		{
+			++bd->error;
+			continue;
+		}
+		if(slot->req.mode==ATA_WRITE)count_write(bd);
+		else ++bd->read;
+		bd->bytes+=conf.bs;
+		add_latency(bd,slot->end-slot->start);
+	}
+}
+
+
+/*
+ * 同期で測る
+ * hdXのread/writeを直接呼ぶので、ドライバーのキャッシュを通る
+ * parameters : End time
+ */
+static void run_sync(uint64 end)
+{
+	BENCH_DEV *bd;
+	uint64 start;
+	uint lba;
+	int write;
+	int r;
+	int i;
+
+
+	for(i=0;sim_time()<end;i=(i+1)%dev_num)
+	{
+		bd=&bench_dev[i];
+		lba=next_lba(bd,&write);
+		start=sim_time();
+		if(write)r=bd->info->write(bd->slot[0].buf,bd->bs_sect,lba);
+		else r=bd->info->read(bd->slot[0].buf,bd->bs_sect,lba);
+		if(r<0)
+		{
+			++bd->error;
+			continue;
+		}
+		bd->bytes+=conf.bs;
+		add_latency(bd,sim_time()-start);
+		if(write)count_write(bd);
+		else ++bd->read;
+	}
+}
+
+
+/*
+ * 非同期で測る
+ * デバイスごとにconf.qd個の要求を発行し続ける
+ * parameters : End time
+ */
+static void run_async(uint64 end)
+{
+	BENCH_DEV *bd;
+	int inflight;
+	int i,j;
+
+
+	for(;;)
+	{
+		inflight=0;
+		for(i=0;i<dev_num;++i)
+		{
+			bd=&bench_dev[i];
+			reap(bd);
+			for(j=0;(j<conf.qd)&&(sim_time()<end);++j)
+				if(bd->slot[j].busy==0)issue_slot(bd,&bd->slot[j]);
+			inflight+=bd->inflight;
+		}
+		if(inflight==0)break;
+
+		wait_intr(&bench_wait,TIME_OUT);
+		if(bench_wait.flag==-1)
+		{
+			fprintf(stderr,"ata_bench : request time out\n");
+			break;
+		}
+	}
+}
+
+
+/*
+ * PIOのデータポートを転送方法ごとに1セクター分アクセスする
+ * 以前のワードごとのinw/outwと、ドライバーのin_pio/out_pioが使うsim_in_pio/sim_out_pioを比べる
+ * parameters : Data port,Buffer,PIO_PATH_NUMの番号,1=書き込み
+ */
+static void pio_sector(int port,ushort *buf,int path,int write)
+{
+	int i;
+
+
+	if(path==0)
+	{
+		if(write)
+			for(i=0;i<SECTOR_WORDS;++i)outw(port,buf[i]);
+		else
+			for(i=0;i<SECTOR_WORDS;++i)buf[i]=inw(port);
+	}
+	else if(write)sim_out_pio(port,buf,SECTOR_WORDS,path==2);
+	else sim_in_pio(port,buf,SECTOR_WORDS,path==2);
+}
+
+
+/*
+ * BSYが落ちるまでステータスを読む
+ * parameters : Data port
+ * return : Status or -1(time out)
+ */
+static int pio_wait(int port)
+{
+	uint64 end;
+	uchar status;
+
+
+	for(end=sim_time()+(uint64)TIME_OUT*1000000;sim_time()<end;)
+		if(((status=inb(port+STR_OFFSET))&BSY_STATUS)==0)return status;
+	return -1;
+}
+
+
+/*
+ * READ SECTORS,WRITE SECTORSを発行する
+ * parameters : Data port,Device,LBA,Sectors(1-256),Command
+ * return : 0 or -1
+ */
+static int pio_command(int port,int dev,uint lba,uint count,uchar cmd)
+{
+	if(pio_wait(port)==-1)return -1;
+	outb(port+DHR_OFFSET,0xe0|dev<<4|((lba>>24)&0xf));
+	outb(port+CNT_OFFSET,count&0xff);
+	outb(port+LBA_OFFSET,lba);
+	outb(port+LBA_OFFSET+1,lba>>8);
+	outb(port+LBA_OFFSET+2,lba>>16);
+	outb(port+STR_OFFSET,cmd);
+	return 0;
+}
+
+
+/*
+ * 1つの転送方法で先頭からのセクターを読むか書く
+ * parameters : Data port,Device,Buffer,Sectors,PIO_PATH_NUMの番号,1=書き込み,Return DRQの間のサイクル数の合計
+ * return : 0 or -1
+ */
+static int pio_path(int port,int dev,ushort *buf,uint sectors,int path,int write,uint64 *sum)
+{
+	uint64 start;
+	uint lba,count,n;
+	int status;
+
+
+	for(*sum=0,lba=0;lba<sectors;lba+=count)
+	{
+		count=(sectors-lba<SECTOR_WORDS)?sectors-lba:SECTOR_WORDS;
+		if(pio_command(port,dev,lba,count,write?CMD_WRITE_SECTORS:CMD_READ_SECTORS)==-1)return -1;
+		for(n=0;n<count;++n)
+		{
+			if(((status=pio_wait(port))==-1)||((status&(DRQ_STATUS|ERR_STATUS))!=DRQ_STATUS))return -1;
+			start=rdtsc();
+			pio_sector(port,buf+(lba+n)*SECTOR_WORDS,path,write);
+			*sum+=rdtsc()-start;
+		}
+		if(((status=pio_wait(port))==-1)||(status&ERR_STATUS))return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * PIOの転送方法ごとの1セクターあたりのサイクル数
+ * 割り込みを止めてREAD SECTORS,WRITE SECTORSを直接発行し、DRQの間のデータポートのアクセスだけを測る
+ * 書き込みは読んだデータをそのまま書き戻すので、イメージは変わらない
+ * parameters : Device
+ */
+static void run_pio_bench(BENCH_DEV *bd)
+{
+	ushort *buf;
+	uint64 sum;
+	double cycles[PIO_PATH_NUM][2];
+	int port;
+	uint sectors;
+	int error;
+	int i,write;
+
+
+	port=(bd->host==0)?PRIM_DATA:SECN_DATA;
+	sectors=(conf.pio_bench<bd->sectors)?conf.pio_bench:bd->sectors;
+	if((buf=malloc(sectors*SECTOR_WORDS*2))==NULL)
+	{
+		fprintf(stderr,"ata_bench : no memory\n");
+		return;
+	}
+
+	outb(port+CTRL_OFFSET,NIEN_CTRL);
+	for(error=0,i=0;(i<PIO_PATH_NUM)&&(error==0);++i)
+		for(write=0;(write<2)&&((error=pio_path(port,bd->dev,buf,sectors,i,write,&sum))==0);++write)
+			cycles[i][write]=(double)sum/sectors;
+	outb(port+CTRL_OFFSET,0);
+	free(buf);
+
+	if(error!=0)
+	{
+		fprintf(stderr,"ata_bench : %s PIO %s failed\n",bd->name,write?"write":"read");
+		return;
+	}
+
+	if(conf.json)
+	{
+		printf("{\"device\":\"%s\",\"sectors\":%u,\"pio\":[",bd->name,sectors);
+		for(i=0;i<PIO_PATH_NUM;++i)
+			printf("%s{\"path\":\"%s\",\"read_cycles\":%.0f,\"write_cycles\":%.0f,\"port_access\":%d}",
+				(i!=0)?",":"",pio_path_name[i],cycles[i][0],cycles[i][1],(i==2)?SECTOR_WORDS/2:SECTOR_WORDS);
+		printf("]}\n");
+		return;
+	}
+
+	printf("%s : PIO cycles per sector (%u sectors)\n",bd->name,sectors);
+	for(i=0;i<PIO_PATH_NUM;++i)
+		printf("%-15s read %.0f  write %.0f  (%d port accesses)\n",
+			pio_path_name[i],cycles[i][0],cycles[i][1],(i==2)?SECTOR_WORDS/2:SECTOR_WORDS);
+}
+
+
+/*
+ * デバイスを準備する
+ * return : 0 or -1
+ */
+static int setup()
+{
+	BENCH_DEV *bd;
+	ATA_SCHED sched;
+	int mode;
+	int i,j;
+
+
+	sim_verbose=conf.verbose;
+	sim_set_chipset(conf.chipset);
+	sim_hdd.queue_depth=conf.tcq;
+	if(conf.overlap!=-1)sim_cdrom.overlap=conf.overlap;
+	for(i=0;i<dev_num;++i)
+	{
+		bd=&bench_dev[i];
+		if(sim_attach(bd->host,bd->dev,bd->type,bd->image,NULL)!=0)
+		{
+			fprintf(stderr,"ata_bench : cannot open %s\n",bd->image);
+			return -1;
+		}
+	}
+
+	if(init_ata()!=0)
+	{
+		fprintf(stderr,"ata_bench : init_ata failed\n");
+		return -1;
+	}
+
+	for(i=0;i<dev_num;++i)
+	{
+		bd=&bench_dev[i];
+		if(((bd->info=sim_device(bd->name))==NULL)||(bd->info->open()!=0))
+		{
+			fprintf(stderr,"ata_bench : %s is not ready\n",bd->name);
+			return -1;
+		}
+		if(conf.bs%bd->info->sector_size!=0)
+		{
+			fprintf(stderr,"ata_bench : block size must be a multiple of %d\n",bd->info->sector_size);
+			return -1;
+		}
+		bd->bs_sect=conf.bs/bd->info->sector_size;
+		bd->sectors=bd->info->last_blk+1;
+		bd->info->ioctl(ATA_IOCTL_SET_PRIO,&bd->prio);
+		if(bd->sectors<bd->bs_sect)
+		{
+			fprintf(stderr,"ata_bench : %s is smaller than the block size\n",bd->name);
+			return -1;
+		}
+
+		if(conf.pio)
+		{
+			mode=ATA_PIO;
+			bd->info->ioctl(ATA_IOCTL_SET_MODE,&mode);
+		}
+		if(conf.pio32&&(bd->info->ioctl(ATA_IOCTL_SET_PIO32,&conf.pio32)!=0))
+			fprintf(stderr,"ata_bench : %s cannot use 32bit PIO on chipset %08x\n",bd->name,conf.chipset);
+		if(bd->type==SIM_ATA)
+		{
+			if((conf.wcache!=-1)&&(bd->info->ioctl(ATA_IOCTL_SET_WCACHE,&conf.wcache)!=0))
+				fprintf(stderr,"ata_bench : %s cannot change the write cache\n",bd->name);
+			if((conf.lookahead!=-1)&&(bd->info->ioctl(ATA_IOCTL_SET_LOOKAHEAD,&conf.lookahead)!=0))
+				fprintf(stderr,"ata_bench : %s cannot change the look-ahead\n",bd->name);
+			if(conf.writeback!=-1)bd->info->ioctl(ATA_IOCTL_SET_WRITEBACK,&conf.writeback);
+			bd->info->ioctl(ATA_IOCTL_RESET_DEV_STAT,NULL);
+		}
+		else if(conf.stream&&(bd->info->ioctl(ATA_IOCTL_SET_STREAM,&conf.stream)!=0))
+			fprintf(stderr,"ata_bench : %s cannot stream\n",bd->name);
+
+		/* エレベーターはチャネルごと */
+		bd->info->ioctl(ATA_IOCTL_GET_SCHED,&sched);
+		if(bd->type==SIM_ATA)sched.queue_depth=(conf.qd>1)?conf.qd:0;
+		if(conf.elevator!=-1)sched.elevator=conf.elevator;
+		bd->info->ioctl(ATA_IOCTL_SET_SCHED,&sched);
+		bd->info->ioctl(ATA_IOCTL_RESET_SCHED_STAT,NULL);
+
+		for(j=0;j<conf.qd;++j)
+			if((bd->slot[j].buf=malloc(conf.bs))==NULL)
+			{
+				fprintf(stderr,"ata_bench : no memory\n");
+				return -1;
+			}
+	}
+
+	return 0;
+}
+
+
+/*
+ * チャネルの最初のデバイスか
+ * エレベーターの統計はチャネルごとなので、チャネルに一度だけ出す
+ * parameters : bench_devの番号
+ * return : 1=最初,0=違う
+ */
+static int first_on_host(int n)
+{
+	int i;
+
+
+	for(i=0;i<n;++i)
+		if(bench_dev[i].host==bench_dev[n].host)return 0;
+	return 1;
+}
+
+
+/*
+ * 結果を出力する
+ * parameters : 測定時間ns,CPUが動いていたns,ホストのCPU時間ns
+ */
+static void report(uint64 elapsed,uint64 busy,uint64 host_ns)
+{
+	BENCH_DEV *bd;
+	SIM_STAT st;
+	ATA_DEV_STAT ds;
+	ATA_SCHED sched;
+	ATA_SCHED_STAT ss;
+	uint64 bytes;
+	uint req,error;
+	double sec,iops,mbps,cycles;
+	double lat_avg;
+	int i,n;
+
+
+	qsort(lat,lat_num,sizeof(uint64),cmp_latency);
+	for(bytes=0,req=0,error=0,i=0;i<dev_num;++i)
+	{
+		bytes+=bench_dev[i].bytes;
+		req+=bench_dev[i].read+bench_dev[i].write;
+		error+=bench_dev[i].error;
+	}
+	sec=(elapsed!=0)?elapsed/1e9:1;
+	iops=req/sec;
+	mbps=bytes/sec/1e6;
+	cycles=(req!=0)?(double)busy*SIM_CPU_MHZ/1000/req:0;
+
+	if(conf.json)
+	{
+		printf("{\"pattern\":\"%s\",\"read_pct\":%d,\"bs\":%u,\"qd\":%d,\"runtime_ms\":%u,",
+			conf.random?"random":"seq",conf.read_pct,conf.bs,conf.qd,conf.runtime);
+		printf("\"requests\":%u,\"errors\":%u,\"iops\":%.1f,\"mbps\":%.2f,\"cycles_per_req\":%.0f,\"host_ns_per_req\":%.0f,",
+			req,error,iops,mbps,cycles,(req!=0)?(double)host_ns/req:0);
+		printf("\"lat_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},\"devices\":[",
+			percentile(0.5)/1e3,percentile(0.99)/1e3,percentile(0.999)/1e3,(lat_num!=0)?lat[lat_num-1]/1e3:0);
+		for(i=0;i<dev_num;++i)
+		{
+			bd=&bench_dev[i];
+			sim_get_stat(bd->host,bd->dev,&st);
+			bd->info->ioctl(ATA_IOCTL_GET_DEV_STAT,&ds);
+			lat_avg=(bd->read+bd->write!=0)?(double)bd->lat_sum/(bd->read+bd->write):0;
+			printf("%s{\"name\":\"%s\",\"prio\":\"%s\",\"read\":%u,\"write\":%u,\"errors\":%u,\"flush\":%u,\"mbps\":%.2f,"
+				"\"lat_avg_us\":%.1f,\"lat_max_us\":%.1f,\"seeks\":%u,\"ra_hits\":%u,\"polled\":%u,\"slept\":%u,\"released\":%u}",
+				(i!=0)?",":"",bd->name,prio_name[bd->prio],bd->read,bd->write,bd->error,bd->flush,bd->bytes/sec/1e6,
+				lat_avg/1e3,bd->lat_max/1e3,st.seek,st.ra_hit,ds.poll,ds.sleep,ds.release);
+		}
+		printf("],\"channels\":[");
+		for(n=0,i=0;i<dev_num;++i)
+		{
+			if(first_on_host(i)==0)continue;
+			bd=&bench_dev[i];
+			bd->info->ioctl(ATA_IOCTL_GET_SCHED,&sched);
+			bd->info->ioctl(ATA_IOCTL_GET_SCHED_STAT,&ss);
+			printf("%s{\"host\":%d,\"elevator\":\"%s\",\"dispatch\":%u,\"merge\":%u,\"expire\":%u,\"seeks\":%u,\"seek_dist\":%llu}",
+				(n++!=0)?",":"",bd->host,sched.elevator?"c-scan":"fifo",ss.dispatch,ss.merge,ss.expire,ss.seek,ss.seek_dist);
+		}
+		printf("]}\n");
+		return;
+	}
+
+	printf("pattern %s, read %d%%, bs %u, qd %d, runtime %ums\n",
+		conf.random?"random":"sequential",conf.read_pct,conf.bs,conf.qd,conf.runtime);
+	printf("requests   %u (errors %u)\n",req,error);
+	printf("IOPS       %.1f\n",iops);
+	printf("MB/s       %.2f\n",mbps);
+	printf("cycles/req %.0f (host %.0f ns/req)\n",cycles,(req!=0)?(double)host_ns/req:0);
+	printf("latency us p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+		percentile(0.5)/1e3,percentile(0.99)/1e3,percentile(0.999)/1e3,(lat_num!=0)?lat[lat_num-1]/1e3:0);
+	for(i=0;i<dev_num;++i)
+	{
+		bd=&bench_dev[i];
+		sim_get_stat(bd->host,bd->dev,&st);
+		bd->info->ioctl(ATA_IOCTL_GET_DEV_STAT,&ds);
+		lat_avg=(bd->read+bd->write!=0)?(double)bd->lat_sum/(bd->read+bd->write):0;
+		printf("%s : read %u write %u errors %u flush %u, %.2f MB/s, seeks %u, look-ahead hits %u, DMA polled %u slept %u, bus released %u\n",
+			bd->name,bd->read,bd->write,bd->error,bd->flush,bd->bytes/sec/1e6,st.seek,st.ra_hit,ds.poll,ds.sleep,ds.release);
+		printf("%s : class %s, latency us avg %.1f max %.1f\n",bd->name,prio_name[bd->prio],lat_avg/1e3,bd->lat_max/1e3);
+	}
+	for(i=0;i<dev_num;++i)
+	{
+		if(first_on_host(i)==0)continue;
+		bd=&bench_dev[i];
+		bd->info->ioctl(ATA_IOCTL_GET_SCHED,&sched);
+		bd->info->ioctl(ATA_IOCTL_GET_SCHED_STAT,&ss);
+		printf("ide%d : elevator %s, commands %u, merged %u, deadline %u, seeks %u, seek distance %llu sectors (%.0f per seek)\n",
+			bd->host,sched.elevator?"c-scan":"fifo",ss.dispatch,ss.merge,ss.expire,ss.seek,ss.seek_dist,
+			(ss.seek!=0)?(double)ss.seek_dist/ss.seek:0);
+	}
+}
+
+
+/*
+ * キューの深さを1から倍にしながらconf.qdまで非同期で測る
+ * 深さごとにドライバーのqueue_depthを合わせ、同じ乱数列で1行ずつ出す
+ */
+static void run_sweep()
+{
+	BENCH_DEV *bd;
+	ATA_SCHED sched;
+	uint64 start;
+	uint64 bytes;
+	uint req;
+	double sec;
+	int qd_max;
+	int i,n;
+
+
+	qd_max=conf.qd;
+	if(conf.json)printf("{\"pattern\":\"%s\",\"read_pct\":%d,\"bs\":%u,\"runtime_ms\":%u,\"tcq\":%u,\"sweep\":[",
+		conf.random?"random":"seq",conf.read_pct,conf.bs,conf.runtime,conf.tcq);
+	else printf("pattern %s, read %d%%, bs %u, runtime %ums, drive TCQ %u\n"
+		"qd      IOPS     MB/s   p50 us   p99 us\n",
+		conf.random?"random":"sequential",conf.read_pct,conf.bs,conf.runtime,conf.tcq);
+
+	for(n=0,conf.qd=1;conf.qd<=qd_max;conf.qd*=2)
+	{
+		for(i=0;i<dev_num;++i)
+		{
+			bd=&bench_dev[i];
+			bd->pos=0;
+			bd->read=bd->write=bd->error=bd->unflushed=bd->flush=0;
+			bd->bytes=bd->lat_sum=bd->lat_max=0;
+			if(bd->type!=SIM_ATA)continue;
+			bd->info->ioctl(ATA_IOCTL_GET_SCHED,&sched);
+			sched.queue_depth=(conf.qd>1)?conf.qd:0;
+			bd->info->ioctl(ATA_IOCTL_SET_SCHED,&sched);
+		}
+		lat_num=0;
+		rand_state=conf.seed;
+
+		start=sim_time();
+		run_async(start+(uint64)conf.runtime*1000000);
+		sec=(sim_time()-start)/1e9;
+
+		qsort(lat,lat_num,sizeof(uint64),cmp_latency);
+		for(bytes=0,req=0,i=0;i<dev_num;++i)
+		{
+			bytes+=bench_dev[i].bytes;
+			req+=bench_dev[i].read+bench_dev[i].write;
+		}
+		if(conf.json)printf("%s{\"qd\":%d,\"requests\":%u,\"iops\":%.1f,\"mbps\":%.2f,\"lat_us\":{\"p50\":%.1f,\"p99\":%.1f}}",
+			(n++!=0)?",":"",conf.qd,req,req/sec,bytes/sec/1e6,percentile(0.5)/1e3,percentile(0.99)/1e3);
+		else printf("%-4d %8.1f %8.2f %8.1f %8.1f\n",
+			conf.qd,req/sec,bytes/sec/1e6,percentile(0.5)/1e3,percentile(0.99)/1e3);
+	}
+	if(conf.json)printf("]}\n");
+	conf.qd=qd_max;
+}
+
+
+/*
+ * NAME=CLASSでデバイスのI/O priority classを決める
+ * parameters : 引数
+ * return : 0 or -1
+ */
+static int set_prio(char *arg)
+{
+	char *class;
+	int i,n;
+
+
+	if((class=strchr(arg,'='))==NULL)return -1;
+	*class++='\0';
+	for(n=0;(n<ATA_PRIO_NUM)&&(strcmp(class,prio_name[n])!=0);++n);
+	if(n==ATA_PRIO_NUM)return -1;
+	for(i=0;i<dev_num;++i)
+		if(strcmp(arg,bench_dev[i].name)==0)
+		{
+			bench_dev[i].prio=n;
+			return 0;
+		}
+	return -1;
+}
+
+
+/*
+ * NAME=IMAGEを登録する
+ * parameters : 引数,SIM_ATA or SIM_ATAPI
+ * return : 0 or -1
+ */
+static int add_device(char *arg,int type)
+{
+	static const char *name[DEV_MAX]={"hda","hdb","hdc","hdd"};
+	BENCH_DEV *bd;
+	char *image;
+	int i,n;
+
+
+	if(((image=strchr(arg,'='))==NULL)||(dev_num==DEV_MAX))return -1;
+	*image++='\0';
+	for(n=0;(n<DEV_MAX)&&(strcmp(arg,name[n])!=0);++n);
+	if(n==DEV_MAX)return -1;
+	for(i=0;i<dev_num;++i)
+		if(bench_dev[i].name==name[n])return -1;
+
+	bd=&bench_dev[dev_num++];
+	bd->name=name[n];
+	bd->image=image;
+	bd->type=type;
+	bd->host=n/2;
+	bd->dev=n%2;
+
+	return 0;
+}
+
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: ata_bench [options]\n"
+		"  -d, --disk NAME=IMAGE    ATA disk image (NAME is hda-hdd), repeatable\n"
+		"  -c, --cdrom NAME=IMAGE   ATAPI CD-ROM image, read only\n"
+		"  -r, --random             random access (default sequential)\n"
+		"  -R, --read PCT           read percentage (default 100),writes change the image\n"
+		"  -b, --bs BYTES           request size (default 4096)\n"
+		"  -q, --qd N               requests in flight per device (default 1)\n"
+		"  -t, --runtime MS         simulated run time (default 1000)\n"
+		"  -s, --seed N             random seed\n"
+		"      --tcq N              drive TCQ depth (default 0)\n"
+		"      --pio                use PIO instead of DMA\n"
+		"      --pio32              32-bit PIO data transfer (if the chipset supports it)\n"
+		"      --pio-bench N        compare PIO data port paths per sector on the first N sectors of the first disk\n"
+		"                           (reads them and writes the same data back)\n"
+		"      --chipset ID         IDE controller PCI id in hex (default 24cb8086)\n"
+		"  -f, --flush N            write barrier (flush_ata) every N writes\n"
+		"      --wcache 0|1         drive write cache off/on\n"
+		"      --lookahead 0|1      drive read look-ahead off/on\n"
+		"      --writeback 0|1      driver cache write-through/write-back (default write-through)\n"
+		"      --stream             ATAPI streaming read (READ(12) into two buffers)\n"
+		"      --overlap 0|1        CD-ROM overlapped commands off/on (default on)\n"
+		"      --elevator 0|1       channel elevator FIFO/C-SCAN (default C-SCAN)\n"
+		"      --prio NAME=CLASS    I/O priority class rt, be or idle of a device given before (default be)\n"
+		"      --sweep              measure qd 1,2,4,... up to --qd with submit_ata(), one line per depth\n"
+		"  -j, --json               machine readable output\n"
+		"  -v, --verbose            print driver messages\n"
+		"qd 1 calls the hdX read/write entry points (through the buffer cache),\n"
+		"qd > 1 keeps N requests queued with submit_ata().\n");
+}
+
+
+int main(int argc,char **argv)
+{
+	static struct option long_options[]={
+		{"disk",1,0,'d'},
+		{"cdrom",1,0,'c'},
+		{"random",0,0,'r'},
+		{"read",1,0,'R'},
+		{"bs",1,0,'b'},
+		{"qd",1,0,'q'},
+		{"runtime",1,0,'t'},
+		{"seed",1,0,'s'},
+		{"tcq",1,0,'T'},
+		{"pio",0,0,'P'},
+		{"pio32",0,0,'3'},
+		{"pio-bench",1,0,'B'},
+		{"chipset",1,0,'C'},
+		{"flush",1,0,'f'},
+		{"wcache",1,0,'W'},
+		{"lookahead",1,0,'L'},
+		{"writeback",1,0,'K'},
+		{"stream",0,0,'S'},
+		{"overlap",1,0,'O'},
+		{"elevator",1,0,'e'},
+		{"prio",1,0,'p'},
+		{"sweep",0,0,'w'},
+		{"json",0,0,'j'},
+		{"verbose",0,0,'v'},
+		{"help",0,0,'h'},
+		{0,0,0,0}
+	};
+	uint64 start,idle,elapsed;
+	clock_t host;
+	int c;
+
+
+	while((c=getopt_long(argc,argv,"d:c:rR:b:q:t:s:f:jvh",long_options,NULL))!=-1)
+	{
+		switch(c)
+		{
+			case 'd':
+			case 'c':
+				if(add_device(optarg,(c=='d')?SIM_ATA:SIM_ATAPI)!=0)
+				{
+					fprintf(stderr,"ata_bench : bad device `%s'\n",optarg);
+					return 1;
+				}
+				break;
+			case 'r':
+				conf.random=1;
+				break;
+			case 'R':
+				conf.read_pct=atoi(optarg);
+				break;
+			case 'b':
+				conf.bs=strtoul(optarg,NULL,0);
+				break;
+			case 'q':
+				conf.qd=atoi(optarg);
+				break;
+			case 't':
+				conf.runtime=strtoul(optarg,NULL,0);
+				break;
+			case 's':
+				conf.seed=strtoul(optarg,NULL,0);
+				break;
+			case 'T':
+				conf.tcq=strtoul(optarg,NULL,0);
+				break;
+			case 'P':
+				conf.pio=1;
+				break;
+			case '3':
+				conf.pio32=1;
+				break;
+			case 'B':
+				conf.pio_bench=strtoul(optarg,NULL,0);
+				break;
+			case 'C':
+				conf.chipset=strtoul(optarg,NULL,16);
+				break;
+			case 'f':
+				conf.flush=strtoul(optarg,NULL,0);
+				break;
+			case 'W':
+				conf.wcache=atoi(optarg)!=0;
+				break;
+			case 'L':
+				conf.lookahead=atoi(optarg)!=0;
+				break;
+			case 'K':
+				conf.writeback=atoi(optarg)!=0;
+				break;
+			case 'S':
+				conf.stream=1;
+				break;
+			case 'O':
+				conf.overlap=atoi(optarg)!=0;
+				break;
+			case 'e':
+				conf.elevator=atoi(optarg)!=0;
+				break;
+			case 'p':
+				if(set_prio(optarg)!=0)
+				{
+					fprintf(stderr,"ata_bench : bad priority `%s'\n",optarg);
+					return 1;
+				}
+				break;
+			case 'w':
+				conf.sweep=1;
+				break;
+			case 'j':
+				conf.json=1;
+				break;
+			case 'v':
+				conf.verbose=1;
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if((dev_num==0)||(conf.qd<1)||(conf.qd>QD_MAX)||(conf.bs==0)||(conf.read_pct<0)||(conf.read_pct>100))
+	{
+		usage();
+		return 1;
+	}
+
+	if(setup()!=0)return 1;
+
+	if(conf.pio_bench!=0)
+	{
+		for(c=0;(c<dev_num)&&(bench_dev[c].type!=SIM_ATA);++c);
+		if(c==dev_num)fprintf(stderr,"ata_bench : --pio-bench needs a disk\n");
+		else run_pio_bench(&bench_dev[c]);
+		sim_detach();
+		return (c==dev_num)?1:0;
+	}
+
+	if(conf.sweep)
+	{
+		run_sweep();
+		sim_detach();
+		return 0;
+	}
+
+	rand_state=conf.seed;
+	start=sim_time();
+	idle=sim_idle_time();
+	host=clock();
+	if(conf.qd==1)run_sync(start+(uint64)conf.runtime*1000000);
+	else run_async(start+(uint64)conf.runtime*1000000);
+	host=clock()-host;
+	elapsed=sim_time()-start;
+
+	report(elapsed,elapsed-(sim_idle_time()-idle),(uint64)host*1000000000/CLOCKS_PER_SEC);
+	sim_detach();
+
+	return 0;
+}
@@ -0,0 +1,2545 @@
+/*
+ * ata_sim.c
+ *
+ * Copyright 2002, Minoru Murashima. All rights reserved.
+ * Distributed under the terms of the BSD License.
+ *
+ * ATA controller simulator
+ * PIIX/ICH互換のバスマスターIDEコントローラーと、ディスクイメージを使うATAディスク、
+ * ATAPI CD-ROMをユーザー空間で真似て、ata.cをそのまま動かす。
+ * 時間はシミュレーターの中だけで進み、ポートアクセス、タイマー、割り込み待ちでイベントを処理する。
+ * 同じイメージと同じ操作なら、何度実行しても同じ時間になる。
+ */
+
+
+#define _FILE_OFFSET_BITS 64
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdarg.h>
+#include"ata_sim.h"
+
+
+enum{
+	PRIM_BASE=0x1F0,
+	SECN_BASE=0x170,
+	CTRL_OFFSET=0x206,
+	BM_BASE=0xc000,			/* Bus Master IDE IO base */
+	REG_CTRL=8,				/* Device control,alternate status */
+	REG_BM=16,				/* Bus Master IDE register */
+	BUF_SIZE=0x10000,		/* DRQ block buffer */
+	MAX_MULTIPLE=16,		/* READ/WRITE MULTIPLEの最大セクター数 */
+	SPIN_UP_NS=800000000,	/* メディアを入れてから読めるようになるまで */
+	OVL_MIN_NS=1000000,		/* overlapのパケットコマンドは、これより長く待つならバスを解放する */
+
+	/* GET EVENT STATUS NOTIFICATION media event */
+	ME_NONE=0,
+	ME_NEW=2,				/* New media */
+	ME_REMOVAL=3,			/* Media removal */
+	TAG_MAX=32,
+	REG_NS=300,				/* Register access ns */
+	PIO_CALL_NS=100,		/* in/out命令かrep ins/outs命令を1回発行するCPU時間 */
+	PCI_IO_NS=60,			/* データポートへのI/Oトランザクション1回 */
+	RESET_NS=1000000,		/* ソフトリセットからBSYが落ちるまで */
+
+	/* Status */
+	BSY=0x80,
+	DRDY=0x40,
+	DF=0x20,
+	SRV=0x10,
+	DRQ=0x8,
+	ERR=0x1,
+
+	/* Error */
+	ICRC=0x80,
+	UNC=0x40,
+	IDNF=0x10,
+	ABRT=0x4,
+
+	/* Interrupt reason */
+	IR_CD=0x1,
+	IR_IO=0x2,
+	IR_REL=0x4,
+
+	/* Device control */
+	CTRL_NIEN=0x2,
+	CTRL_SRST=0x4,
+	CTRL_HOB=0x80,
+
+	/* Bus Master IDE */
+	BMIC_START=0x1,
+	BMIC_READ=0x8,			/* メモリーに書き込む */
+	BMIS_ACT=0x1,
+	BMIS_ERR=0x2,
+	BMIS_INTR=0x4,
+	PRD_EOT=0x80000000,
+
+	/* Channel phase */
+	PH_IDLE=0,				/* コマンド待ち */
+	PH_BUSY,				/* BSY,イベント待ち */
+	PH_PIO_IN,				/* DRQ,ホストがデータを読む */
+	PH_PIO_OUT,				/* DRQ,ホストがデータを書く */
+	PH_PACKET,				/* DRQ,パケットを受け取る */
+	PH_DMA,					/* バスマスターで転送する */
+
+	/* Channel event */
+	EV_NONE=0,
+	EV_DONE,				/* コマンド完了 */
+	EV_PIO_IN,				/* 次のDRQブロックを読める */
+	EV_PIO_OUT,				/* 次のDRQブロックを書ける */
+	EV_DMA,					/* バスマスター転送完了 */
+	EV_RELEASE,				/* TCQ,overlapのバス解放 */
+	EV_RESET,				/* ソフトリセット完了 */
+
+	/* Tag state */
+	TAG_FREE=0,
+	TAG_QUEUED,				/* ドライブのキューにある */
+	TAG_MEDIA,				/* メディアから読んでいる */
+	TAG_READY,				/* SERVICE待ち */
+	TAG_XFER,				/* 転送中 */
+};
+
+/* Physical Region Descriptor,ata.cと同じ形 */
+typedef struct{
+	void *addr;
+	uint count;
+}SIM_PRD;
+
+/* Task file,[1]はHOB */
+typedef struct{
+	uchar feature[2];
+	uchar count[2];
+	uchar lbal[2];
+	uchar lbam[2];
+	uchar lbah[2];
+	uchar device;
+	uchar status;
+	uchar error;
+}TASK_FILE;
+
+/* Queued command */
+typedef struct{
+	int state;
+	int write;
+	uint64 lba;
+	uint count;
+}SIM_TAG;
+
+/* Simulated drive */
+typedef struct{
+	int type;				/* 0=なし,SIM_ATA,SIM_ATAPI */
+	FILE *fp;				/* Disk image */
+	uint64 sectors;			/* Number of sectors */
+	int sector_size;
+	SIM_DRIVE model;
+	SIM_STAT stat;
+	TASK_FILE tf;
+	ushort id[256];			/* Identify infomation */
+	int xfer;				/* SET FEATURESの転送モード */
+	int multiple;			/* READ/WRITE MULTIPLEのセクター数 */
+	int wcache;				/* Write cache enable */
+	int lookahead;			/* Read look-ahead enable */
+	int rel_intr;			/* Release interrupt enable */
+	int srv_intr;			/* SERVICE interrupt enable */
+	uint64 head;			/* ヘッドの次のセクター */
+	uint64 media_free;		/* メディアが空くns */
+	uint64 ra_lba;			/* 先読みの開始セクター */
+	uint64 ra_time;			/* 先読みを始めたns */
+	int ra_valid;
+	uint ndma;				/* DMAコマンド数 */
+	SIM_TAG tag[TAG_MAX];
+	int media_tag;			/* メディアから読んでいるtag,-1なら空き */
+	uint64 media_done;		/* media_tagの読み込みが終わるns */
+	int srv_sent;			/* SERVICE割り込みを出した */
+	uchar sense[3];			/* ATAPI sense key,ASC,ASCQ */
+	uint speed;				/* SET CD SPEEDの速度 KB/s,0なら最高速 */
+	int intrq;				/* 割り込み保留中,選択されている時だけINTRQに出る */
+	int media_event;		/* GET EVENT STATUS NOTIFICATIONで報告するイベント */
+	uint64 ready_time;		/* メディアが読めるようになるns */
+}SIM_DEV;
+
+/* Simulated channel */
+typedef struct{
+	SIM_DEV dev[2];
+	int irq;
+	uchar control;
+	int sel;				/* Selected device */
+	int phase;
+	int cur;				/* コマンドを実行しているデバイス */
+	int atapi;				/* パケットコマンド実行中 */
+	int write;
+	uint64 lba;				/* 次のDRQブロックのセクター */
+	uint remain;			/* 残りのセクター,ATAPIはバイト */
+	uint block;				/* DRQブロックのセクター数,ATAPIはバイト数 */
+	uint done;				/* 転送済みのセクター,ATAPIはバイト */
+	uchar buf[BUF_SIZE];
+	uint pos;
+	uint len;
+	uchar resp[64];			/* ATAPIの応答データ */
+	uint64 media_t0;		/* メディアからの読み出しを始めるns */
+	int ev;
+	uint64 ev_time;
+	uchar ev_error;			/* EV_DONEで返すエラー */
+	int dma_tag;			/* TCQで転送中のtag,-1ならTCQでない */
+	uint dma_bytes;
+	uint64 dma_ready;		/* DMAで送るデータが揃うns */
+	int dma_go;				/* バスマスターの転送を始めた */
+	int dma_write;
+	uchar packet[12];
+	uchar bmic;
+	uchar bmis;
+	uint prd;
+	int line;				/* INTRQ line */
+}SIM_HOST;
+
+
+SIM_DRIVE sim_hdd={7200,500,800,8500,50000,50,2048,0x3f,0,1,1,0,0};
+SIM_DRIVE sim_cdrom={4800,300,15000,100000,3600,200,512,0x07,0,0,1,0,1};
+int sim_verbose=1;
+uint sim_wake_ns=15000;
+
+int MFPS_addres=0;
+uint64 clock_1m=SIM_CPU_MHZ*1000;
+int (*irq_entry[16])();
+
+static SIM_HOST host[2];
+static uint64 now;						/* Simulated time ns */
+static uint io_cost=REG_NS;
+static int cpu_if=1;					/* 割り込み許可 */
+static int in_irq;						/* 割り込みハンドラー実行中 */
+static int idling;						/* wait_intrで寝ている */
+static uint64 idle_start;
+static uint64 idle_ns;					/* 寝ていた合計時間 */
+static uint pic_irr;					/* 受け付けた割り込み */
+static uint pic_mask=(1<<IRQ14)|(1<<IRQ15);
+static uchar pci[256];					/* IDE controller configuration space */
+static uint chipset=0x24CB8086;			/* Intel ICH4 */
+static DEV_INFO *device[8];
+static const uint pio_cycle[5]={600,383,240,180,120};
+
+
+static void run_until(uint64);
+static void exec_command(SIM_HOST*,uchar);
+static void atapi_command(SIM_HOST*);
+static void schedule_tag(SIM_HOST*,SIM_DEV*);
+
+
+/************************************************************************************************
+ *
+ * Time and interrupt
+ *
+ ************************************************************************************************/
+
+
+/*
+ * 割り込みを配る
+ * 割り込み許可中で、ハンドラーの外なら、マスクされていない割り込みのハンドラーを呼ぶ
+ */
+static void deliver()
+{
+	int irq;
+
+
+	while((cpu_if!=0)&&(in_irq==0))
+	{
+		for(irq=IRQ14;irq<=IRQ15;++irq)
+			if(pic_irr&~pic_mask&(1<<irq))break;
+		if(irq>IRQ15)return;
+
+		pic_irr&=~(1<<irq);
+		if(irq_entry[irq]==NULL)continue;
+
+		/* ハンドラーの実行中はCPUが動いている */
+		if(idling)idle_ns+=now-idle_start;
+		in_irq=1;
+		cpu_if=0;
+		irq_entry[irq]();
+		cpu_if=1;
+		in_irq=0;
+		if(idling)idle_start=now;
+	}
+}
+
+
+/*
+ * INTRQの線を更新する
+ * 選択中のデバイスがnIENでなく割り込みを保留していればINTRQが上がり、
+ * 立ち上がりでBus Master IDEの割り込みビットとPICに割り込みが残る
+ * parameters : Channel
+ */
+static void update_irq(SIM_HOST *h)
+{
+	int line;
+
+
+	line=((h->control&CTRL_NIEN)==0)&&h->dev[h->sel].intrq;
+	if(line&&(h->line==0))
+	{
+		h->bmis|=BMIS_INTR;
+		pic_irr|=1<<h->irq;
+	}
+	h->line=line;
+}
+
+
+/*
+ * デバイスの割り込みを保留する
+ * parameters : Channel,Drive
+ */
+static void raise_irq(SIM_HOST *h,SIM_DEV *d)
+{
+	d->intrq=1;
+	update_irq(h);
+}
+
+
+/*
+ * デバイスの割り込みを解除する
+ * ステータスを読むか、コマンドを書くと解除される
+ * parameters : Channel,Drive
+ */
+static void clear_irq(SIM_HOST *h,SIM_DEV *d)
+{
+	d->intrq=0;
+	update_irq(h);
+}
+
+
+/*
+ * イベントを予約する
+ * parameters : Channel,Event,Time
+ */
+static void set_event(SIM_HOST *h,int ev,uint64 time)
+{
+	h->ev=ev;
+	h->ev_time=(time>now)?time:now;
+}
+
+
+/*
+ * 一番早いイベントの時刻
+ * parameters : Return time
+ * return : 1=イベントあり,0=なし
+ */
+static int next_event(uint64 *time)
+{
+	SIM_DEV *d;
+	int found;
+	int i,j;
+
+
+	found=0;
+	for(i=0;i<2;++i)
+	{
+		if((host[i].ev!=EV_NONE)&&((found==0)||(host[i].ev_time<*time)))
+		{
+			*time=host[i].ev_time;
+			found=1;
+		}
+		for(j=0;j<2;++j)
+		{
+			d=&host[i].dev[j];
+			if((d->type==0)||(d->media_tag==-1))continue;
+			if((found==0)||(d->media_done<*time))
+			{
+				*time=d->media_done;
+				found=1;
+			}
+		}
+	}
+
+	return found;
+}
+
+
+/************************************************************************************************
+ *
+ * Drive model
+ *
+ ************************************************************************************************/
+
+
+static uint64 isqrt(uint64 x)
+{
+	uint64 r,b;
+
+
+	r=0;
+	for(b=(uint64)1<<62;b!=0;b>>=2)
+	{
+		if(x>=r+b)
+		{
+			x-=r+b;
+			r=(r>>1)+b;
+		}
+		else r>>=1;
+	}
+	return r;
+}
+
+
+/*
+ * 1セクターをメディアから転送するns
+ */
+static uint64 sect_ns(SIM_DEV *d)
+{
+	uint rate;
+
+
+	rate=d->model.media_rate;
+	if((d->speed!=0)&&(d->speed<rate))rate=d->speed;
+
+	return (uint64)d->sector_size*1000000/rate;
+}
+
+
+/*
+ * インターフェースの転送時間
+ * parameters : Drive,Bytes
+ * return : ns
+ */
+static uint64 bus_ns(SIM_DEV *d,uint bytes)
+{
+	static const uint pio[5]={3300,5200,8300,11100,16600};
+	static const uint mdma[3]={4100,13300,16600};
+	static const uint udma[7]={16600,25000,33300,44400,66600,100000,133000};
+	uint rate;
+
+
+	switch(d->xfer&0xf8)
+	{
+		case 0x40:
+			rate=udma[d->xfer&0x7];
+			break;
+		case 0x20:
+			rate=mdma[d->xfer&0x3];
+			break;
+		case 0x08:
+			rate=pio[d->xfer&0x7];
+			break;
+		default:
+			rate=pio[0];
+	}
+
+	return (uint64)bytes*1000000/rate;
+}
+
+
+/*
+ * ヘッドを移動して目的のセクターが回ってくるまでの時間
+ * メディアが続けて動いていて、次のセクターならすぐ
+ * parameters : Drive,Start time,Sector
+ * return : ns
+ */
+static uint64 access_ns(SIM_DEV *d,uint64 start,uint64 lba)
+{
+	uint64 tracks,dist,seek,rev,pos,target;
+	uint spt;
+
+
+	if(d->model.rpm==0)return 0;
+	if((lba==d->head)&&(start<=d->media_free))return 0;
+
+	spt=d->model.sect_per_track;
+	tracks=d->sectors/spt+1;
+	dist=(lba/spt>d->head/spt)?lba/spt-d->head/spt:d->head/spt-lba/spt;
+	seek=0;
+	if(dist!=0)
+	{
+		seek=(uint64)d->model.seek_min*1000+
+			(uint64)(d->model.seek_max-d->model.seek_min)*isqrt(dist*1000000/tracks);
+		++d->stat.seek;
+		d->stat.seek_time+=seek;
+	}
+
+	rev=(uint64)60000000000ULL/d->model.rpm;
+	pos=(start+seek)%rev;
+	target=(lba%spt)*rev/spt;
+	d->stat.rot_time+=(target+rev-pos)%rev;
+
+	return seek+(target+rev-pos)%rev;
+}
+
+
+/*
+ * メディアから読み終わる時間
+ * 前の読み込みの後はcache_sectまで先読みを続けているので、その範囲はシークしない
+ * parameters : Drive,Start time,Sector,Sectors
+ * return : 読み終わるns
+ */
+static uint64 media_read(SIM_DEV *d,uint64 start,uint64 lba,uint count)
+{
+	uint64 end,ns;
+
+
+	ns=sect_ns(d);
+	if(d->lookahead&&d->ra_valid&&(lba>=d->ra_lba)&&(lba<d->ra_lba+d->model.cache_sect))
+	{
+		end=d->ra_time+(lba+count-d->ra_lba)*ns;
+		if(end<start)end=start;
+		if(d->ra_time+(lba+1-d->ra_lba)*ns<=start)++d->stat.ra_hit;
+	}
+	else end=start+access_ns(d,start,lba)+count*ns;
+
+	d->stat.media_time+=count*ns;
+	d->stat.read_sect+=count;
+	d->head=lba+count;
+	d->media_free=end;
+	d->ra_lba=lba+count;
+	d->ra_time=end;
+	d->ra_valid=1;
+
+	return end;
+}
+
+
+/*
+ * メディアに書く
+ * ライトキャッシュ有効ならキャッシュに入った時点で終わり、溢れる分は待つ
+ * parameters : Drive,Start time,Sector,Sectors
+ * return : 書き込みが終わったとみなすns
+ */
+static uint64 media_write(SIM_DEV *d,uint64 start,uint64 lba,uint count)
+{
+	uint64 begin,limit,ns;
+
+
+	ns=sect_ns(d);
+	begin=(d->media_free>start)?d->media_free:start;
+	d->media_free=begin+access_ns(d,begin,lba)+count*ns;
+	d->stat.media_time+=count*ns;
+	d->stat.write_sect+=count;
+	d->head=lba+count;
+	d->ra_valid=0;
+
+	if(d->wcache==0)return d->media_free;
+
+	limit=(uint64)d->model.cache_sect*ns;
+	return (d->media_free>start+limit)?d->media_free-limit:start;
+}
+
+
+/*
+ * イメージを読み書きする
+ * イメージの外は0を読む
+ * parameters : Drive,Byte offset,Buffer,Bytes,Write flag
+ */
+static void image_io(SIM_DEV *d,uint64 offset,void *buf,uint bytes,int write)
+{
+	size_t n;
+
+
+	fseeko(d->fp,(off_t)offset,SEEK_SET);
+	if(write)
+	{
+		fwrite(buf,1,bytes,d->fp);
+		return;
+	}
+	n=fread(buf,1,bytes,d->fp);
+	if(n<bytes)memset((char*)buf+n,0,bytes-n);
+}
+
+
+/************************************************************************************************
+ *
+ * Bus master
+ *
+ ************************************************************************************************/
+
+
+/*
+ * PRDテーブルに従ってメモリーと転送する
+ * parameters : Channel,Drive,Byte offset,Bytes,Write flag,ATAPIの応答データ or NULL
+ * return : 0=ちょうど,1=PRDが余った,-1=PRDが足りない
+ */
+static int dma_copy(SIM_HOST *h,SIM_DEV *d,uint64 offset,uint bytes,int write,uchar *resp)
+{
+	SIM_PRD *prd;
+	uint n;
+
+
+	for(prd=(SIM_PRD*)(size_t)h->prd;;++prd)
+	{
+		n=prd->count&0xffff;
+		if(n==0)n=0x10000;
+		if(n>bytes)n=bytes;
+		if(resp!=NULL)
+		{
+			memcpy(prd->addr,resp,n);
+			resp+=n;
+		}
+		else image_io(d,offset,prd->addr,n,write);
+		offset+=n;
+		bytes-=n;
+
+		if(bytes==0)return ((prd->count&PRD_EOT)&&(n==(((prd->count-1)&0xffff)+1)))?0:1;
+		if(prd->count&PRD_EOT)return -1;
+	}
+}
+
+
+/*
+ * チップセットの設定がドライブの転送モードに合っているか
+ * Intelのレイアウトだけ調べる
+ * parameters : Channel number,Device number
+ * return : 1=合っている
+ */
+static int chipset_ok(int hn,int dn)
+{
+	int udma;
+
+
+	if((chipset&0xffff)!=0x8086)return 1;
+	udma=(pci[0x48]>>(hn*2+dn))&1;
+
+	return udma==((host[hn].dev[dn].xfer&0xf8)==0x40);
+}
+
+
+/*
+ * バスマスターの転送を始める
+ * コマンドとバスマスターの起動の両方が揃った時点で終わりの時刻が決まる
+ * parameters : Channel
+ */
+static void dma_go(SIM_HOST *h)
+{
+	SIM_DEV *d;
+	uint64 end;
+
+
+	if((h->phase!=PH_DMA)||h->dma_go||((h->bmic&BMIC_START)==0))return;
+	if((pci[PCI_CONF_COM]&PCI_COM_BM_BIT)==0)return;
+	d=&h->dev[h->cur];
+	h->dma_go=1;
+
+	end=now+bus_ns(d,h->dma_bytes);
+	d->stat.bus_time+=bus_ns(d,h->dma_bytes);
+	if(h->dma_write)
+	{
+		if(h->atapi==0)end=media_write(d,end,h->lba,h->dma_bytes/d->sector_size);
+	}
+	else if(end<h->dma_ready)end=h->dma_ready;
+
+	set_event(h,EV_DMA,end);
+}
+
+
+/************************************************************************************************
+ *
+ * Command
+ *
+ ************************************************************************************************/
+
+
+/*
+ * コマンドを終える
+ * parameters : Channel,Delay ns,Error
+ */
+static void finish(SIM_HOST *h,uint64 delay,uchar error)
+{
+	h->phase=PH_BUSY;
+	h->dev[h->cur].tf.status=BSY;
+	h->ev_error=error;
+	set_event(h,EV_DONE,now+delay);
+}
+
+
+/*
+ * SERVICEを待っているtag
+ * return : Tag or -1
+ */
+static int ready_tag(SIM_DEV *d)
+{
+	int i;
+
+
+	for(i=0;i<TAG_MAX;++i)
+		if(d->tag[i].state==TAG_READY)return i;
+	return -1;
+}
+
+
+/*
+ * キューを捨てる
+ */
+static void clear_tag(SIM_DEV *d)
+{
+	memset(d->tag,0,sizeof(d->tag));
+	d->media_tag=-1;
+	d->srv_sent=0;
+}
+
+
+/*
+ * バスが空いていればSERVICE割り込みを出す
+ * overlapのATAPIはいつでもSERVICE割り込みを出す
+ * parameters : Channel
+ */
+static void service_irq(SIM_HOST *h)
+{
+	SIM_DEV *d;
+	int i;
+
+
+	if((h->phase!=PH_IDLE)||(h->ev!=EV_NONE))return;
+	for(i=0;i<2;++i)
+	{
+		d=&h->dev[i];
+		if(((d->srv_intr==0)&&(d->type!=SIM_ATAPI))||d->srv_sent||(ready_tag(d)==-1))continue;
+		d->srv_sent=1;
+		d->tf.status=DRDY|SRV;
+		raise_irq(h,d);
+		return;
+	}
+}
+
+
+/*
+ * ドライブのキューから次に読むtagを選ぶ
+ * 書き込みはすぐSERVICE待ちにし、読み込みは一番早く読めるものから読む
+ * parameters : Channel,Drive
+ */
+void schedule_tag(SIM_HOST *h,SIM_DEV *d)
+{
+	SIM_STAT stat;
+	uint64 start,best,t,head,free;
+	int i,tag;
+
+
+	for(i=0;i<TAG_MAX;++i)
+		if((d->tag[i].state==TAG_QUEUED)&&d->tag[i].write)d->tag[i].state=TAG_READY;
+	if(d->media_tag!=-1)return;
+
+	start=(d->media_free>now)?d->media_free:now;
+	head=d->head;
+	free=d->media_free;
+	stat=d->stat;
+	tag=-1;
+	best=0;
+	for(i=0;i<TAG_MAX;++i)
+	{
+		if(d->tag[i].state!=TAG_QUEUED)continue;
+		t=access_ns(d,start,d->tag[i].lba);
+		d->head=head;
+		d->media_free=free;
+		if((tag==-1)||(t<best))
+		{
+			tag=i;
+			best=t;
+		}
+	}
+	if(tag==-1)return;
+
+	/* 候補を比べた分の統計は戻す */
+	d->stat=stat;
+	d->media_tag=tag;
+	d->tag[tag].state=TAG_MEDIA;
+	d->media_done=media_read(d,start,d->tag[tag].lba,d->tag[tag].count);
+}
+
+
+/*
+ * Task fileのLBAとセクター数
+ * parameters : Drive,48bit flag,Return count
+ * return : LBA
+ */
+static uint64 tf_lba(SIM_DEV *d,int ext,uint *count)
+{
+	TASK_FILE *tf;
+
+
+	tf=&d->tf;
+	if(ext)
+	{
+		*count=(uint)tf->count[1]<<8|tf->count[0];
+		if(*count==0)*count=65536;
+		return (uint64)tf->lbah[1]<<40|(uint64)tf->lbam[1]<<32|(uint64)tf->lbal[1]<<24|
+			(uint64)tf->lbah[0]<<16|(uint64)tf->lbam[0]<<8|tf->lbal[0];
+	}
+
+	*count=(tf->count[0]==0)?256:tf->count[0];
+	return (uint64)(tf->device&0xf)<<24|(uint64)tf->lbah[0]<<16|(uint64)tf->lbam[0]<<8|tf->lbal[0];
+}
+
+
+/*
+ * READ/WRITE SECTORS,MULTIPLE,DMA
+ * parameters : Channel,Drive,48bit flag,Write flag,Block sectors(0ならDMA)
+ */
+static void rw_command(SIM_HOST *h,SIM_DEV *d,int ext,int write,uint block)
+{
+	uint64 lba,end;
+	uint count;
+
+
+	lba=tf_lba(d,ext,&count);
+	if(((d->tf.device&0x40)==0)||(lba+count>d->sectors))
+	{
+		finish(h,(uint64)d->model.overhead*1000,IDNF);
+		return;
+	}
+
+	h->write=write;
+	h->lba=lba;
+	h->remain=count;
+	h->done=0;
+	h->block=block;
+	h->phase=PH_BUSY;
+	d->tf.status=BSY;
+
+	/* DMA */
+	if(block==0)
+	{
+		h->phase=PH_DMA;
+		h->dma_tag=-1;
+		h->dma_go=0;
+		h->dma_write=write;
+		h->dma_bytes=count*d->sector_size;
+		h->dma_ready=0;
+		if(write==0)h->dma_ready=media_read(d,now+(uint64)d->model.overhead*1000,lba,count);
+		dma_go(h);
+		return;
+	}
+
+	/* PIO */
+	if(write)
+	{
+		set_event(h,EV_PIO_OUT,now+(uint64)d->model.overhead*1000);
+		return;
+	}
+	end=media_read(d,now+(uint64)d->model.overhead*1000,lba,count);
+	h->media_t0=end-count*sect_ns(d);
+	set_event(h,EV_PIO_IN,h->media_t0+((block<count)?block:count)*sect_ns(d));
+}
+
+
+/*
+ * READ/WRITE DMA QUEUED
+ * tagをキューに入れてバスを解放する
+ * parameters : Channel,Drive,48bit flag,Write flag
+ */
+static void queued_command(SIM_HOST *h,SIM_DEV *d,int ext,int write)
+{
+	uint64 lba;
+	uint count;
+	int tag;
+
+
+	tag=d->tf.count[0]>>3;
+	lba=tf_lba(d,ext,&count);
+	count=ext?((uint)d->tf.feature[1]<<8|d->tf.feature[0]):d->tf.feature[0];
+	if(count==0)count=ext?65536:256;
+
+	if((d->model.queue_depth==0)||(d->rel_intr==0)||(tag>=(int)d->model.queue_depth)||(d->tag[tag].state!=TAG_FREE)||
+		((d->tf.device&0x40)==0)||(lba+count>d->sectors))
+	{
+		clear_tag(d);
+		finish(h,(uint64)d->model.overhead*1000,ABRT);
+		return;
+	}
+
+	d->tag[tag].state=TAG_QUEUED;
+	d->tag[tag].write=write;
+	d->tag[tag].lba=lba;
+	d->tag[tag].count=count;
+	schedule_tag(h,d);
+
+	h->phase=PH_BUSY;
+	d->tf.status=BSY;
+	d->tf.count[0]=tag<<3;
+	set_event(h,EV_RELEASE,now+(uint64)d->model.overhead*1000);
+}
+
+
+/*
+ * SERVICE
+ * SERVICE待ちのtagの転送を始める
+ * parameters : Channel,Drive
+ */
+static void service_command(SIM_HOST *h,SIM_DEV *d)
+{
+	int tag;
+
+
+	if((tag=ready_tag(d))==-1)
+	{
+		finish(h,(uint64)d->model.overhead*1000,ABRT);
+		return;
+	}
+
+	d->srv_sent=0;
+	d->tag[tag].state=TAG_XFER;
+	d->tf.count[0]=(tag<<3)|(d->tag[tag].write?0:IR_IO);
+	d->tf.status=DRDY|DRQ|((ready_tag(d)!=-1)?SRV:0);
+
+	h->phase=PH_DMA;
+	h->lba=d->tag[tag].lba;
+	h->dma_tag=tag;
+	h->dma_go=0;
+	h->dma_write=d->tag[tag].write;
+	h->dma_bytes=d->tag[tag].count*d->sector_size;
+	h->dma_ready=now;
+	dma_go(h);
+}
+
+
+/*
+ * SET FEATURES
+ * return : 0 or Error
+ */
+static uchar set_features(SIM_DEV *d)
+{
+	uchar mode;
+
+
+	switch(d->tf.feature[0])
+	{
+		case 0x03:
+			mode=d->tf.count[0];
+			switch(mode&0xf8)
+			{
+				case 0x00:
+					break;
+				case 0x08:
+					if(((mode&0x7)<3)||((mode&0x7)>4))return ABRT;
+					break;
+				case 0x20:
+					if((mode&0x7)>2)return ABRT;
+					break;
+				case 0x40:
+					if((d->model.udma&(1<<(mode&0x7)))==0)return ABRT;
+					break;
+				default:
+					return ABRT;
+			}
+			d->xfer=mode;
+			d->id[63]&=0xff;
+			d->id[88]&=0xff;
+			if((mode&0xf8)==0x20)d->id[63]|=0x100<<(mode&0x7);
+			if((mode&0xf8)==0x40)d->id[88]|=0x100<<(mode&0x7);
+			return 0;
+		case 0x02:
+			d->wcache=1;
+			d->id[85]|=0x20;
+			return 0;
+		case 0x82:
+			d->wcache=0;
+			d->id[85]&=~0x20;
+			return 0;
+		case 0xaa:
+			d->lookahead=1;
+			d->id[85]|=0x40;
+			return 0;
+		case 0x55:
+			d->lookahead=0;
+			d->ra_valid=0;
+			d->id[85]&=~0x40;
+			return 0;
+		case 0x5d:
+			if(d->model.queue_depth==0)return ABRT;
+			d->rel_intr=1;
+			return 0;
+		case 0xdd:
+			d->rel_intr=0;
+			return 0;
+		case 0x5e:
+			if(d->model.queue_depth==0)return ABRT;
+			d->srv_intr=1;
+			return 0;
+		case 0xde:
+			d->srv_intr=0;
+			return 0;
+		default:
+			return ABRT;
+	}
+}
+
+
+/*
+ * Execute command
+ * parameters : Channel,Command
+ */
+void exec_command(SIM_HOST *h,uchar cmd)
+{
+	SIM_DEV *d;
+	uint64 overhead;
+	uint n;
+
+
+	d=&h->dev[h->sel];
+	if((d->type==0)||(d->tf.status&BSY))return;
+
+	++d->stat.command;
+	h->cur=h->sel;
+	h->atapi=0;
+	clear_irq(h,d);
+	d->tf.error=0;
+	overhead=(uint64)d->model.overhead*1000;
+
+	/* ATAPIが受け付けるコマンド */
+	if(d->type==SIM_ATAPI)
+		switch(cmd)
+		{
+			case 0xa0:
+				h->atapi=1;
+				h->phase=PH_PACKET;
+				h->pos=0;
+				h->len=12;
+				d->tf.count[0]=IR_CD;
+				d->tf.status=DRDY|DRQ;
+				return;
+			case 0xa1:
+				memcpy(h->buf,d->id,512);
+				h->lba=(uint64)-1;
+				h->remain=1;
+				h->block=1;
+				h->done=0;
+				h->phase=PH_BUSY;
+				d->tf.status=BSY;
+				h->media_t0=now;
+				set_event(h,EV_PIO_IN,now+overhead);
+				return;
+			case 0x08:
+				d->tf.count[0]=1;
+				d->tf.lbal[0]=1;
+				d->tf.lbam[0]=0x14;
+				d->tf.lbah[0]=0xeb;
+				d->tf.status=0;
+				d->tf.error=1;
+				return;
+			case 0xa2:
+				h->atapi=1;
+				service_command(h,d);
+				return;
+			case 0xef:
+			case 0xe1:
+				break;
+			default:
+				d->tf.lbam[0]=0x14;
+				d->tf.lbah[0]=0xeb;
+				finish(h,overhead,ABRT);
+				return;
+		}
+
+	switch(cmd)
+	{
+		case 0xec:			/* IDENTIFY DEVICE */
+			memcpy(h->buf,d->id,512);
+			h->lba=(uint64)-1;
+			h->remain=1;
+			h->block=1;
+			h->done=0;
+			h->phase=PH_BUSY;
+			d->tf.status=BSY;
+			h->media_t0=now;
+			set_event(h,EV_PIO_IN,now+overhead);
+			return;
+		case 0xef:			/* SET FEATURES */
+			finish(h,overhead,set_features(d));
+			return;
+		case 0xc6:			/* SET MULTIPLE */
+			n=d->tf.count[0];
+			if((n>MAX_MULTIPLE)||(n&(n-1)))
+			{
+				finish(h,overhead,ABRT);
+				return;
+			}
+			d->multiple=n;
+			d->id[59]=(n!=0)?0x100|n:0;
+			finish(h,overhead,0);
+			return;
+		case 0x91:			/* INITIALIZE DEVICE PARAMETERS */
+		case 0xe0:			/* STANDBY IMMEDIATE */
+		case 0xe1:			/* IDLE IMMEDIATE */
+			finish(h,overhead,0);
+			return;
+		case 0xe7:			/* FLUSH CACHE */
+		case 0xea:			/* FLUSH CACHE EXT */
+			++d->stat.flush;
+			finish(h,((d->media_free>now)?d->media_free-now:0)+overhead,0);
+			return;
+		case 0x20:
+		case 0x21:
+			rw_command(h,d,0,0,1);
+			return;
+		case 0x24:
+			rw_command(h,d,1,0,1);
+			return;
+		case 0x30:
+		case 0x31:
+			rw_command(h,d,0,1,1);
+			return;
+		case 0x34:
+			rw_command(h,d,1,1,1);
+			return;
+		case 0xc4:
+		case 0x29:
+		case 0xc5:
+		case 0x39:
+			if(d->multiple==0)
+			{
+				finish(h,overhead,ABRT);
+				return;
+			}
+			rw_command(h,d,(cmd==0x29)||(cmd==0x39),(cmd==0xc5)||(cmd==0x39),d->multiple);
+			return;
+		case 0xc8:
+		case 0xc9:
+			rw_command(h,d,0,0,0);
+			return;
+		case 0x25:
+			rw_command(h,d,1,0,0);
+			return;
+		case 0xca:
+		case 0xcb:
+			rw_command(h,d,0,1,0);
+			return;
+		case 0x35:
+			rw_command(h,d,1,1,0);
+			return;
+		case 0xc7:
+			queued_command(h,d,0,0);
+			return;
+		case 0x26:
+			queued_command(h,d,1,0);
+			return;
+		case 0xcc:
+			queued_command(h,d,0,1);
+			return;
+		case 0x36:
+			queued_command(h,d,1,1);
+			return;
+		case 0xa2:
+			service_command(h,d);
+			return;
+		default:
+			finish(h,overhead,ABRT);
+	}
+}
+
+
+/************************************************************************************************
+ *
+ * ATAPI
+ *
+ ************************************************************************************************/
+
+
+/*
+ * CHECK CONDITIONで終える
+ * parameters : Channel,Drive,Sense key<<16|ASC<<8|ASCQ
+ */
+static void check_condition(SIM_HOST *h,SIM_DEV *d,uint sense)
+{
+	d->sense[0]=sense>>16;
+	d->sense[1]=sense>>8;
+	d->sense[2]=sense;
+	finish(h,(uint64)d->model.overhead*1000,(sense>>16)<<4);
+}
+
+
+/*
+ * データを返すパケットコマンドの転送を始める
+ * parameters : Channel,Drive,Bytes,DRQ block bytes,データが揃うns
+ */
+static void atapi_data(SIM_HOST *h,SIM_DEV *d,uint bytes,uint block,uint64 ready)
+{
+	h->remain=bytes;
+	h->block=block;
+	h->done=0;
+	h->write=0;
+	h->phase=PH_BUSY;
+	d->tf.status=BSY;
+
+	if(d->tf.feature[0]&0x1)
+	{
+		h->phase=PH_DMA;
+		h->dma_tag=-1;
+		h->dma_go=0;
+		h->dma_write=0;
+		h->dma_bytes=bytes;
+		h->dma_ready=ready;
+		dma_go(h);
+		return;
+	}
+
+	h->media_t0=ready-((h->lba!=(uint64)-1)?(uint64)(bytes/d->sector_size)*sect_ns(d):0);
+	set_event(h,EV_PIO_IN,(h->lba!=(uint64)-1)?h->media_t0+sect_ns(d):ready);
+}
+
+
+/*
+ * パケットコマンドを実行する
+ * parameters : Channel
+ */
+void atapi_command(SIM_HOST *h)
+{
+	SIM_DEV *d;
+	uchar *p;
+	uint64 lba,overhead,ready;
+	uint count;
+
+
+	d=&h->dev[h->cur];
+	p=h->packet;
+	overhead=(uint64)d->model.overhead*1000;
+	h->lba=(uint64)-1;
+	memset(h->resp,0,sizeof(h->resp));
+
+	/*
+	 * Unit attentionはREQUEST SENSE,INQUIRY,GET EVENT STATUS NOTIFICATION以外をエラーにして一度だけ報告する
+	 * メディアがない、起動中ならメディアを使うコマンドはNOT READY
+	 */
+	if((p[0]!=0x03)&&(p[0]!=0x12)&&(p[0]!=0x4a))
+	{
+		if(d->sense[0]==0x6)
+		{
+			finish(h,overhead,0x6<<4);
+			return;
+		}
+		if(d->fp==NULL)
+		{
+			check_condition(h,d,0x23a00);
+			return;
+		}
+		if(now<d->ready_time)
+		{
+			check_condition(h,d,0x20401);
+			return;
+		}
+	}
+
+	switch(p[0])
+	{
+		case 0x00:			/* TEST UNIT READY */
+		case 0x1b:			/* START STOP UNIT */
+			finish(h,overhead,0);
+			return;
+		case 0x03:			/* REQUEST SENSE */
+			h->resp[0]=0x70;
+			h->resp[2]=d->sense[0];
+			h->resp[7]=10;
+			h->resp[12]=d->sense[1];
+			h->resp[13]=d->sense[2];
+			memset(d->sense,0,3);
+			count=(p[4]<18)?p[4]:18;
+			if(count==0)
+			{
+				finish(h,overhead,0);
+				return;
+			}
+			atapi_data(h,d,count,count,now+overhead);
+			return;
+		case 0x12:			/* INQUIRY */
+			h->resp[0]=0x5;
+			h->resp[1]=0x80;
+			h->resp[3]=0x21;
+			h->resp[4]=31;
+			memcpy(h->resp+8,"SIM     CDROM           1.0 ",28);
+			count=(p[4]<36)?p[4]:36;
+			if(count==0)
+			{
+				finish(h,overhead,0);
+				return;
+			}
+			atapi_data(h,d,count,count,now+overhead);
+			return;
+		case 0x4a:			/* GET EVENT STATUS NOTIFICATION */
+			if((p[1]&1)==0)
+			{
+				check_condition(h,d,0x52400);		/* Polledだけ */
+				return;
+			}
+			h->resp[3]=0x10;					/* Media classだけ */
+			if(p[4]&0x10)
+			{
+				h->resp[1]=6;
+				h->resp[2]=4;
+				h->resp[4]=d->media_event;
+				h->resp[5]=(d->fp!=NULL)?0x2:0;
+				d->media_event=ME_NONE;
+			}
+			else
+			{
+				h->resp[1]=2;
+				h->resp[2]=0x80;
+			}
+			count=(uint)p[7]<<8|p[8];
+			if(count>(uint)h->resp[1]+2)count=h->resp[1]+2;
+			if(count==0)
+			{
+				finish(h,overhead,0);
+				return;
+			}
+			atapi_data(h,d,count,count,now+overhead);
+			return;
+		case 0x25:			/* READ CAPACITY */
+			lba=d->sectors-1;
+			h->resp[0]=lba>>24;
+			h->resp[1]=lba>>16;
+			h->resp[2]=lba>>8;
+			h->resp[3]=lba;
+			h->resp[6]=d->sector_size>>8;
+			h->resp[7]=d->sector_size;
+			atapi_data(h,d,8,8,now+overhead);
+			return;
+		case 0xbb:			/* SET CD SPEED */
+			count=(uint)p[2]<<8|p[3];
+			d->speed=(count==0xffff)?0:count;
+			finish(h,overhead,0);
+			return;
+		case 0x28:			/* READ(10) */
+		case 0xa8:			/* READ(12) */
+			lba=(uint)p[2]<<24|(uint)p[3]<<16|(uint)p[4]<<8|p[5];
+			if(p[0]==0x28)count=(uint)p[7]<<8|p[8];
+			else count=(uint)p[6]<<24|(uint)p[7]<<16|(uint)p[8]<<8|p[9];
+			if(lba+count>d->sectors)
+			{
+				check_condition(h,d,0x52100);
+				return;
+			}
+			if(count==0)
+			{
+				finish(h,overhead,0);
+				return;
+			}
+			h->lba=lba;
+			ready=media_read(d,now+overhead,lba,count);
+
+			/* Overlapで待ちが長ければバスを解放して、読めたらSERVICEを要求する */
+			if(((d->tf.feature[0]&0x3)==0x3)&&d->model.overlap&&(ready>now+overhead+OVL_MIN_NS))
+			{
+				d->tag[0].state=TAG_MEDIA;
+				d->tag[0].write=0;
+				d->tag[0].lba=lba;
+				d->tag[0].count=count;
+				d->media_tag=0;
+				d->media_done=ready;
+				h->phase=PH_BUSY;
+				d->tf.status=BSY;
+				d->tf.count[0]=0;
+				set_event(h,EV_RELEASE,now+overhead);
+				return;
+			}
+			atapi_data(h,d,count*d->sector_size,d->sector_size,ready);
+			return;
+		case 0x2a:			/* WRITE(10) */
+		case 0xaa:			/* WRITE(12) */
+			check_condition(h,d,0x72700);
+			return;
+		default:
+			check_condition(h,d,0x52000);
+	}
+}
+
+
+/************************************************************************************************
+ *
+ * Event
+ *
+ ************************************************************************************************/
+
+
+/*
+ * DRQブロックをホストが読み終わった
+ * parameters : Channel
+ */
+static void pio_in_done(SIM_HOST *h)
+{
+	SIM_DEV *d;
+	uint n;
+
+
+	d=&h->dev[h->cur];
+	if(h->atapi)
+	{
+		h->remain-=h->len;
+		h->done+=h->len;
+		if(h->remain==0)
+		{
+			finish(h,0,0);
+			return;
+		}
+		h->phase=PH_BUSY;
+		d->tf.status=BSY;
+		set_event(h,EV_PIO_IN,h->media_t0+((uint64)h->done/d->sector_size+1)*sect_ns(d));
+		return;
+	}
+
+	n=h->len/512;
+	h->lba+=n;
+	h->remain-=n;
+	h->done+=n;
+	if(h->remain==0)
+	{
+		h->phase=PH_IDLE;
+		d->tf.status=DRDY;
+		return;
+	}
+	h->phase=PH_BUSY;
+	d->tf.status=BSY;
+	n=(h->block<h->remain)?h->block:h->remain;
+	set_event(h,EV_PIO_IN,h->media_t0+(uint64)(h->done+n)*sect_ns(d));
+}
+
+
+/*
+ * DRQブロックをホストが書き終わった
+ * parameters : Channel
+ */
+static void pio_out_done(SIM_HOST *h)
+{
+	SIM_DEV *d;
+	uint64 end;
+	uint n;
+
+
+	d=&h->dev[h->cur];
+	if(h->phase==PH_PACKET)
+	{
+		memcpy(h->packet,h->buf,12);
+		atapi_command(h);
+		return;
+	}
+
+	n=h->len/512;
+	image_io(d,h->lba*512,h->buf,h->len,1);
+	end=media_write(d,now,h->lba,n);
+	h->lba+=n;
+	h->remain-=n;
+	h->done+=n;
+	h->phase=PH_BUSY;
+	d->tf.status=BSY;
+	if(h->remain==0)
+	{
+		h->ev_error=0;
+		set_event(h,EV_DONE,end);
+	}
+	else set_event(h,EV_PIO_OUT,end);
+}
+
+
+/*
+ * イベントを実行する
+ * parameters : Channel
+ */
+static void fire(SIM_HOST *h)
+{
+	SIM_DEV *d;
+	uint n;
+	int ev;
+	int i,r;
+
+
+	ev=h->ev;
+	h->ev=EV_NONE;
+	d=&h->dev[h->cur];
+
+	switch(ev)
+	{
+		case EV_DONE:
+			h->phase=PH_IDLE;
+			d->tf.error=h->ev_error;
+			d->tf.status=DRDY|((h->ev_error!=0)?ERR:0)|((ready_tag(d)!=-1)?SRV:0);
+			if(h->atapi)
+			{
+				d->tf.count[0]=IR_IO|IR_CD;
+				d->tf.status&=~SRV;
+			}
+			if(h->ev_error&ABRT)clear_tag(d);
+			raise_irq(h,d);
+			break;
+		case EV_PIO_IN:
+			if(h->atapi)
+			{
+				n=(h->block<h->remain)?h->block:h->remain;
+				if(h->lba!=(uint64)-1)image_io(d,(h->lba+h->done/d->sector_size)*d->sector_size,h->buf,n,0);
+				else memcpy(h->buf,h->resp+h->done,n);
+				d->tf.count[0]=IR_IO;
+				d->tf.lbam[0]=n;
+				d->tf.lbah[0]=n>>8;
+			}
+			else if(h->lba==(uint64)-1)n=512;
+			else
+			{
+				n=((h->block<h->remain)?h->block:h->remain)*512;
+				image_io(d,h->lba*512,h->buf,n,0);
+			}
+			h->len=n;
+			h->pos=0;
+			h->phase=PH_PIO_IN;
+			d->tf.status=DRDY|DRQ;
+			raise_irq(h,d);
+			break;
+		case EV_PIO_OUT:
+			n=(h->block<h->remain)?h->block:h->remain;
+			h->len=n*512;
+			h->pos=0;
+			h->phase=PH_PIO_OUT;
+			d->tf.status=DRDY|DRQ;
+			if(h->done!=0)raise_irq(h,d);
+			break;
+		case EV_DMA:
+			h->phase=PH_IDLE;
+			h->dma_go=0;
+			r=0;
+			h->ev_error=0;
+			if(((h->bmic&BMIC_READ)!=0)==h->dma_write)r=-1;
+			else if((h->atapi==0)&&(chipset_ok(h-host,h->cur)==0))h->ev_error=ICRC|ABRT;
+			else if((h->atapi==0)&&((d->xfer&0xf8)==0x40)&&((d->xfer&0x7)>=3)&&d->model.crc_every&&
+				(++d->ndma%d->model.crc_every==0))h->ev_error=ICRC|ABRT;
+			else if(h->atapi&&(h->lba==(uint64)-1))r=dma_copy(h,d,0,h->dma_bytes,0,h->resp);
+			else r=dma_copy(h,d,h->lba*d->sector_size,h->dma_bytes,h->dma_write,NULL);
+			if(h->ev_error&ICRC)++d->stat.crc_error;
+
+			if(r==0)h->bmis&=~BMIS_ACT;
+			if(r<0)h->bmis|=BMIS_ERR;
+			d->tf.error=h->ev_error;
+			d->tf.status=DRDY|((h->ev_error!=0)?ERR:0);
+
+			if(h->dma_tag!=-1)
+			{
+				i=h->dma_tag;
+				h->dma_tag=-1;
+				d->tag[i].state=TAG_FREE;
+				d->tf.count[0]=(i<<3)|IR_IO|IR_CD;
+				if(h->ev_error)clear_tag(d);
+				else
+				{
+					schedule_tag(h,d);
+					if(ready_tag(d)!=-1)
+					{
+						d->tf.status|=SRV;
+						d->srv_sent=1;
+					}
+				}
+			}
+			if(h->atapi)d->tf.count[0]=IR_IO|IR_CD;
+			raise_irq(h,d);
+			break;
+		case EV_RELEASE:
+			h->phase=PH_IDLE;
+			d->tf.count[0]|=IR_REL;
+			d->tf.status=DRDY;
+			if(ready_tag(d)!=-1)
+			{
+				d->tf.status|=SRV;
+				d->srv_sent=1;
+			}
+			raise_irq(h,d);
+			break;
+		case EV_RESET:
+			for(i=0;i<2;++i)
+			{
+				d=&h->dev[i];
+				if(d->type==0)continue;
+				d->tf.count[0]=1;
+				d->tf.lbal[0]=1;
+				d->tf.lbam[0]=(d->type==SIM_ATAPI)?0x14:0;
+				d->tf.lbah[0]=(d->type==SIM_ATAPI)?0xeb:0;
+				d->tf.device=0;
+				d->tf.error=1;
+				d->tf.status=(d->type==SIM_ATAPI)?0:DRDY;
+			}
+			h->sel=0;
+			h->phase=PH_IDLE;
+			break;
+	}
+}
+
+
+/*
+ * 時間を進める
+ * targetまでのイベントを時刻順に実行し、割り込みを配る
+ * parameters : Time
+ */
+void run_until(uint64 target)
+{
+	uint64 t;
+	SIM_DEV *d;
+	int i,j;
+
+
+	for(;;)
+	{
+		if((next_event(&t)==0)||(t>target))break;
+		if(t>now)now=t;
+
+		for(i=0;i<2;++i)
+		{
+			if((host[i].ev!=EV_NONE)&&(host[i].ev_time<=now))
+			{
+				fire(&host[i]);
+				service_irq(&host[i]);
+			}
+			for(j=0;j<2;++j)
+			{
+				d=&host[i].dev[j];
+				if((d->type!=0)&&(d->media_tag!=-1)&&(d->media_done<=now))
+				{
+					d->tag[d->media_tag].state=TAG_READY;
+					d->media_tag=-1;
+					schedule_tag(&host[i],d);
+					service_irq(&host[i]);
+				}
+			}
+		}
+		deliver();
+	}
+	if(target>now)now=target;
+	deliver();
+}
+
+
+/************************************************************************************************
+ *
+ * Port IO
+ *
+ ************************************************************************************************/
+
+
+/*
+ * ポート番号からチャネルとレジスターを求める
+ * parameters : Port,Return register
+ * return : Channel or NULL
+ */
+static SIM_HOST *port_host(int port,int *reg)
+{
+	if((port>=PRIM_BASE)&&(port<PRIM_BASE+8))
+	{
+		*reg=port-PRIM_BASE;
+		return &host[0];
+	}
+	if((port>=SECN_BASE)&&(port<SECN_BASE+8))
+	{
+		*reg=port-SECN_BASE;
+		return &host[1];
+	}
+	if(port==PRIM_BASE+CTRL_OFFSET)
+	{
+		*reg=REG_CTRL;
+		return &host[0];
+	}
+	if(port==SECN_BASE+CTRL_OFFSET)
+	{
+		*reg=REG_CTRL;
+		return &host[1];
+	}
+	if((port>=BM_BASE)&&(port<BM_BASE+16))
+	{
+		*reg=REG_BM+(port&0x7);
+		return &host[(port-BM_BASE)/8];
+	}
+	return NULL;
+}
+
+
+/*
+ * データポートのアクセス時間
+ */
+static uint data_ns(SIM_HOST *h)
+{
+	int xfer;
+
+
+	xfer=h->dev[h->sel].xfer;
+	if((xfer&0xf8)==0x08)return pio_cycle[xfer&0x7];
+	if(xfer==0)return pio_cycle[0];
+	return pio_cycle[4];
+}
+
+
+/*
+ * データポートを読む
+ * parameters : Channel,Bytes
+ */
+static uint read_data(SIM_HOST *h,int bytes)
+{
+	uint value;
+	int i;
+
+
+	if(h->phase!=PH_PIO_IN)return 0xffffffff;
+
+	value=0;
+	for(i=0;(i<bytes)&&(h->pos<h->len);++i)value|=(uint)h->buf[h->pos++]<<(i*8);
+	if(h->pos>=h->len)pio_in_done(h);
+
+	return value;
+}
+
+
+/*
+ * データポートに書く
+ * parameters : Channel,Value,Bytes
+ */
+static void write_data(SIM_HOST *h,uint value,int bytes)
+{
+	int i;
+
+
+	if((h->phase!=PH_PIO_OUT)&&(h->phase!=PH_PACKET))return;
+
+	for(i=0;(i<bytes)&&(h->pos<h->len);++i)h->buf[h->pos++]=value>>(i*8);
+	if(h->pos>=h->len)pio_out_done(h);
+}
+
+
+/*
+ * データポートを1回アクセスする
+ * I/Oトランザクション1回と、16bitごとにデバイスのPIOサイクルがかかる
+ * 命令を発行する時間は呼び出し側で数える
+ * parameters : Channel,Bytes
+ */
+static uint data_in(SIM_HOST *h,int bytes)
+{
+	run_until(now+PCI_IO_NS+(uint64)data_ns(h)*((bytes+1)/2));
+	return read_data(h,bytes);
+}
+
+
+static void data_out(SIM_HOST *h,uint value,int bytes)
+{
+	run_until(now+PCI_IO_NS+(uint64)data_ns(h)*((bytes+1)/2));
+	write_data(h,value,bytes);
+}
+
+
+/*
+ * レジスターを読む
+ * parameters : Channel,Register
+ */
+static uchar read_reg(SIM_HOST *h,int reg)
+{
+	SIM_DEV *d;
+	int hob;
+
+
+	if(reg>=REG_BM)
+	{
+		switch(reg-REG_BM)
+		{
+			case 0:return h->bmic;
+			case 2:return h->bmis|0x60;
+			case 4:return h->prd;
+			case 5:return h->prd>>8;
+			case 6:return h->prd>>16;
+			case 7:return h->prd>>24;
+			default:return 0;
+		}
+	}
+
+	d=&h->dev[h->sel];
+	if(d->type==0)
+	{
+		if((h->dev[0].type==0)&&(h->dev[1].type==0))return 0xff;
+		return ((reg==7)||(reg==REG_CTRL))?0:0xff;
+	}
+
+	hob=(h->control&CTRL_HOB)!=0;
+	switch(reg)
+	{
+		case 1:return (hob)?0:d->tf.error;
+		case 2:return d->tf.count[hob];
+		case 3:return d->tf.lbal[hob];
+		case 4:return d->tf.lbam[hob];
+		case 5:return d->tf.lbah[hob];
+		case 6:return d->tf.device;
+		case 7:
+			clear_irq(h,d);
+			return d->tf.status;
+		case REG_CTRL:return d->tf.status;
+	}
+	return 0xff;
+}
+
+
+/*
+ * レジスターに書く
+ * Task fileは両方のデバイスに書く。書くと前の値はHOBに移る
+ * parameters : Channel,Register,Value
+ */
+static void write_reg(SIM_HOST *h,int reg,uchar value)
+{
+	TASK_FILE *tf;
+	uchar old;
+	int i;
+
+
+	if(reg>=REG_BM)
+	{
+		switch(reg-REG_BM)
+		{
+			case 0:
+				old=h->bmic;
+				h->bmic=value&(BMIC_START|BMIC_READ);
+				if((value&BMIC_START)&&((old&BMIC_START)==0))
+				{
+					h->bmis|=BMIS_ACT;
+					dma_go(h);
+				}
+				if(((value&BMIC_START)==0)&&(old&BMIC_START))
+				{
+					h->bmis&=~BMIS_ACT;
+					if((h->ev==EV_DMA)&&h->dma_go)
+					{
+						h->ev=EV_NONE;
+						h->dma_go=0;
+					}
+				}
+				break;
+			case 2:
+				h->bmis&=~(value&(BMIS_ERR|BMIS_INTR));
+				break;
+			case 4:
+				h->prd=(h->prd&~0xff)|value;
+				break;
+		}
+		return;
+	}
+
+	if(reg==REG_CTRL)
+	{
+		old=h->control;
+		h->control=value;
+		if((value&CTRL_SRST)&&((old&CTRL_SRST)==0))
+		{
+			for(i=0;i<2;++i)
+				if(h->dev[i].type!=0)
+				{
+					h->dev[i].tf.status=BSY;
+					h->dev[i].xfer=0;
+					h->dev[i].multiple=0;
+					h->dev[i].id[59]=0;
+					h->dev[i].rel_intr=0;
+					h->dev[i].srv_intr=0;
+					h->dev[i].wcache=h->dev[i].model.write_cache;
+					h->dev[i].lookahead=1;
+					h->dev[i].id[85]=(h->dev[i].id[85]&~0x60)|(h->dev[i].wcache?0x20:0)|0x40;
+					if(h->dev[i].type==SIM_ATAPI)
+					{
+						h->dev[i].sense[0]=0x6;
+						h->dev[i].sense[1]=0x29;
+					}
+					clear_tag(&h->dev[i]);
+					h->dev[i].intrq=0;
+				}
+			h->phase=PH_IDLE;
+			h->ev=EV_NONE;
+		}
+		if(((value&CTRL_SRST)==0)&&(old&CTRL_SRST))set_event(h,EV_RESET,now+RESET_NS);
+
+		/* INTRQの出力が有効になれば、保留中の割り込みが届く */
+		update_irq(h);
+		return;
+	}
+
+	h->control&=~CTRL_HOB;
+	for(i=0;i<2;++i)
+	{
+		tf=&h->dev[i].tf;
+		switch(reg)
+		{
+			case 1:
+				tf->feature[1]=tf->feature[0];
+				tf->feature[0]=value;
+				break;
+			case 2:
+				tf->count[1]=tf->count[0];
+				tf->count[0]=value;
+				break;
+			case 3:
+				tf->lbal[1]=tf->lbal[0];
+				tf->lbal[0]=value;
+				break;
+			case 4:
+				tf->lbam[1]=tf->lbam[0];
+				tf->lbam[0]=value;
+				break;
+			case 5:
+				tf->lbah[1]=tf->lbah[0];
+				tf->lbah[0]=value;
+				break;
+			case 6:
+				tf->device=value;
+				break;
+		}
+	}
+	if(reg==6)
+	{
+		h->sel=(value>>4)&1;
+		update_irq(h);
+	}
+	if(reg==7)exec_command(h,value);
+}
+
+
+uchar inb(int port)
+{
+	SIM_HOST *h;
+	int reg;
+
+
+	run_until(now+io_cost);
+	if((h=port_host(port,&reg))==NULL)return 0xff;
+	if(reg==0)return read_data(h,1);
+	return read_reg(h,reg);
+}
+
+
+void outb(int port,uchar value)
+{
+	SIM_HOST *h;
+	int reg;
+
+
+	run_until(now+io_cost);
+	if((h=port_host(port,&reg))==NULL)return;
+	if(reg==0)write_data(h,value,1);
+	else write_reg(h,reg,value);
+}
+
+
+ushort inw(int port)
+{
+	SIM_HOST *h;
+	int reg;
+
+
+	if((h=port_host(port,&reg))==NULL)
+	{
+		run_until(now+io_cost);
+		return 0xffff;
+	}
+	if(reg==0)
+	{
+		run_until(now+PIO_CALL_NS);
+		return data_in(h,2);
+	}
+	run_until(now+io_cost);
+	return read_reg(h,reg)|(uint)read_reg(h,reg+1)<<8;
+}
+
+
+void outw(int port,ushort value)
+{
+	SIM_HOST *h;
+	int reg;
+
+
+	if((h=port_host(port,&reg))==NULL)
+	{
+		run_until(now+io_cost);
+		return;
+	}
+	if(reg==0)
+	{
+		run_until(now+PIO_CALL_NS);
+		data_out(h,value,2);
+		return;
+	}
+	run_until(now+io_cost);
+	write_reg(h,reg,value);
+	write_reg(h,reg+1,value>>8);
+}
+
+
+uint indw(int port)
+{
+	SIM_HOST *h;
+	int reg;
+
+
+	if((h=port_host(port,&reg))==NULL)
+	{
+		run_until(now+io_cost);
+		return 0xffffffff;
+	}
+	if(reg==0)
+	{
+		/* 16bitのデバイスなのでPIOサイクルは2回 */
+		run_until(now+PIO_CALL_NS);
+		return data_in(h,4);
+	}
+	run_until(now+io_cost);
+	if(reg==REG_BM+4)return h->prd;
+	return read_reg(h,reg);
+}
+
+
+void outdw(int port,uint value)
+{
+	SIM_HOST *h;
+	int reg;
+
+
+	if((h=port_host(port,&reg))==NULL)
+	{
+		run_until(now+io_cost);
+		return;
+	}
+	if(reg==0)
+	{
+		run_until(now+PIO_CALL_NS);
+		data_out(h,value,4);
+		return;
+	}
+	run_until(now+io_cost);
+	if(reg==REG_BM+4)h->prd=value&~0x3;
+	else write_reg(h,reg,value);
+}
+
+
+/*
+ * ata.cのrep insw/insl
+ * 命令の発行時間はrep 1回につき1回だけかかる
+ * parameters : Data port,Buffer,Words,32bit flag
+ */
+void sim_in_pio(int port,void *buf,int count,int pio32)
+{
+	SIM_HOST *h;
+	uint value;
+	int reg;
+	int i;
+
+
+	if(((h=port_host(port,&reg))==NULL)||(reg!=0))
+	{
+		for(i=0;i<count;++i)((ushort*)buf)[i]=inw(port);
+		return;
+	}
+
+	/* rep insl,端数はrep insw。命令の発行はそれぞれ1回 */
+	i=0;
+	if(pio32&&(count>=2))
+	{
+		run_until(now+PIO_CALL_NS);
+		for(;i+1<count;i+=2)
+		{
+			value=data_in(h,4);
+			memcpy((ushort*)buf+i,&value,4);
+		}
+		if(i==count)return;
+	}
+	run_until(now+PIO_CALL_NS);
+	for(;i<count;++i)((ushort*)buf)[i]=data_in(h,2);
+}
+
+
+/*
+ * ata.cのrep outsw/outsl
+ * parameters : Data port,Buffer,Words,32bit flag
+ */
+void sim_out_pio(int port,void *buf,int count,int pio32)
+{
+	SIM_HOST *h;
+	uint value;
+	int reg;
+	int i;
+
+
+	if(((h=port_host(port,&reg))==NULL)||(reg!=0))
+	{
+		for(i=0;i<count;++i)outw(port,((ushort*)buf)[i]);
+		return;
+	}
+
+	i=0;
+	if(pio32&&(count>=2))
+	{
+		run_until(now+PIO_CALL_NS);
+		for(;i+1<count;i+=2)
+		{
+			memcpy(&value,(ushort*)buf+i,4);
+			data_out(h,value,4);
+		}
+		if(i==count)return;
+	}
+	run_until(now+PIO_CALL_NS);
+	for(;i<count;++i)data_out(h,((ushort*)buf)[i],2);
+}
+
+
+/************************************************************************************************
+ *
+ * Kernel interface
+ *
+ ************************************************************************************************/
+
+
+uint64 rdtsc()
+{
+	return now*SIM_CPU_MHZ/1000;
+}
+
+
+void mili_timer(int ms)
+{
+	run_until(now+(uint64)ms*1000000);
+}
+
+
+void micro_timer(int us)
+{
+	run_until(now+(uint64)us*1000);
+}
+
+
+uint sim_cli()
+{
+	uint eflags;
+
+
+	eflags=cpu_if;
+	cpu_if=0;
+	return eflags;
+}
+
+
+void sim_sti(uint eflags)
+{
+	cpu_if=eflags;
+	deliver();
+}
+
+
+void set_irq_mask(int irq)
+{
+	pic_mask|=1<<irq;
+}
+
+
+void release_irq_mask(int irq)
+{
+	pic_mask&=~(1<<irq);
+	deliver();
+}
+
+
+void set_intr_cpu(int irq,int cpu)
+{
+}
+
+
+int get_current_cpu()
+{
+	return 0;
+}
+
+
+/*
+ * 割り込みを待つ
+ * 寝ている間は割り込みを許可し、起こされるかタイムアウトまでイベントを進める
+ * parameters : Wait queue,Time out ms
+ */
+void wait_intr(WAIT_INTR *wait,int timeout)
+{
+	uint64 limit,t;
+	int eflags;
+	int slept;
+
+
+	limit=now+(uint64)timeout*1000000;
+	eflags=cpu_if;
+	cpu_if=1;
+	idling=1;
+	idle_start=now;
+	deliver();
+	slept=(wait->flag<=0);
+	while(wait->flag<=0)
+	{
+		if((next_event(&t)==0)||(t>limit))
+		{
+			run_until(limit);
+			break;
+		}
+		run_until(t);
+	}
+	idle_ns+=now-idle_start;
+	idling=0;
+
+	/* 起こされてから再スケジュールされるまで */
+	if(slept&&(wait->flag>0))run_until(now+sim_wake_ns);
+	wait->flag=(wait->flag>0)?0:-1;
+	cpu_if=eflags;
+}
+
+
+void wake_intr(WAIT_INTR *wait)
+{
+	wait->flag=1;
+}
+
+
+void wait_proc(WAIT_QUEUE *queue)
+{
+	if(queue->lock)
+	{
+		fprintf(stderr,"ata_sim : wait_proc deadlock\n");
+		abort();
+	}
+	queue->lock=1;
+}
+
+
+void wake_proc(WAIT_QUEUE *queue)
+{
+	queue->lock=0;
+}
+
+
+void *kmalloc(size_t size)
+{
+	return malloc(size);
+}
+
+
+void kfree(void *p)
+{
+	free(p);
+}
+
+
+int search_pci_class(int cls,PCI_INFO *info)
+{
+	if((cls!=PCI_CLS_IDE)||(chipset==0))return -1;
+
+	info->bus=0;
+	info->dev=31;
+	info->func=1;
+	info->vender=chipset;
+	return 0;
+}
+
+
+uint read_pci_config(int bus,int dev,int func,int reg)
+{
+	uint value;
+
+
+	reg&=0xfc;
+	memcpy(&value,pci+reg,4);
+	return value;
+}
+
+
+void writeb_pci_config(int bus,int dev,int func,int reg,uchar value)
+{
+	pci[reg&0xff]=value;
+}
+
+
+void writew_pci_config(int bus,int dev,int func,int reg,ushort value)
+{
+	reg&=0xfe;
+	memcpy(pci+reg,&value,2);
+}
+
+
+void writedw_pci_config(int bus,int dev,int func,int reg,uint value)
+{
+	reg&=0xfc;
+	memcpy(pci+reg,&value,4);
+
+	/* 読み出し専用のレジスター */
+	memcpy(pci,&chipset,4);
+	pci[0x20]=(BM_BASE|1)&0xff;
+	pci[0x21]=BM_BASE>>8;
+}
+
+
+int regist_device(DEV_INFO *info)
+{
+	int i;
+
+
+	for(i=0;i<8;++i)
+		if((device[i]==NULL)||(device[i]==info))
+		{
+			device[i]=info;
+			return 0;
+		}
+	return -1;
+}
+
+
+int printk(const char *form,...)
+{
+	va_list ap;
+	int n;
+
+
+	if(sim_verbose==0)return 0;
+	va_start(ap,form);
+	n=vprintf(form,ap);
+	va_end(ap);
+	return n;
+}
+
+
+int sim_error(int error,const char *func)
+{
+	if(sim_verbose)printf("%s : error %d\n",func,error);
+	return -error;
+}
+
+
+/************************************************************************************************
+ *
+ * Simulator control
+ *
+ ************************************************************************************************/
+
+
+/*
+ * ATAの文字列はワードの中でバイトが逆になる
+ */
+static void id_string(ushort *word,const char *str,int len)
+{
+	char buf[40];
+	int i;
+
+
+	memset(buf,' ',len);
+	memcpy(buf,str,(strlen(str)<(size_t)len)?strlen(str):(size_t)len);
+	for(i=0;i<len;i+=2)word[i/2]=(ushort)(uchar)buf[i]<<8|(uchar)buf[i+1];
+}
+
+
+/*
+ * Identify infomationを作る
+ */
+static void make_identify(SIM_DEV *d)
+{
+	ushort *id;
+	uint64 lba28;
+	uint cyl;
+
+
+	id=d->id;
+	memset(id,0,512);
+	id_string(id+10,"SIM00000001",20);
+	id_string(id+23,"1.0",8);
+	id[49]=0x0b00|(((d->type==SIM_ATAPI)&&d->model.overlap)?0x2000:0);	/* DMA,LBA,IORDY,Overlap */
+	id[53]=0x0006;
+	id[63]=0x0007;
+	id[64]=0x0003;
+	id[65]=id[66]=id[67]=id[68]=120;
+	id[80]=0x007e;
+	id[88]=d->model.udma&0x7f;
+	id[93]=0x4001|(d->model.cable80?0x2000:0);
+
+	if(d->type==SIM_ATAPI)
+	{
+		id[0]=0x85c0;				/* ATAPI,CD-ROM,removable */
+		id_string(id+27,"ATAPI SIM CDROM",40);
+		return;
+	}
+
+	id[0]=0x0040;
+	id_string(id+27,"ATA SIM DISK",40);
+	cyl=(d->sectors/(16*63)>16383)?16383:d->sectors/(16*63);
+	id[1]=id[54]=cyl;
+	id[3]=id[55]=16;
+	id[6]=id[56]=63;
+	id[57]=(cyl*16*63)&0xffff;
+	id[58]=(cyl*16*63)>>16;
+	id[47]=0x8000|MAX_MULTIPLE;
+	id[53]=0x0007;
+	lba28=(d->sectors>0x0fffffff)?0x0fffffff:d->sectors;
+	id[60]=lba28&0xffff;
+	id[61]=lba28>>16;
+	id[75]=(d->model.queue_depth!=0)?d->model.queue_depth-1:0;
+	id[82]=0x4060|((d->model.queue_depth!=0)?0x180:0);	/* Write cache,Look-ahead,Release,SERVICE */
+	id[83]=0x7400|((d->model.queue_depth!=0)?0x2:0);	/* LBA48,FLUSH CACHE(EXT),TCQ */
+	id[84]=0x4000;
+	id[85]=0x4000|(d->wcache?0x20:0)|0x40;
+	id[86]=0x3400|((d->model.queue_depth!=0)?0x2:0);
+	id[87]=0x4000;
+	id[100]=d->sectors&0xffff;
+	id[101]=(d->sectors>>16)&0xffff;
+	id[102]=(d->sectors>>32)&0xffff;
+	id[103]=0;
+}
+
+
+/*
+ * デバイスをつなぐ
+ * parameters : Host number,Device number,SIM_ATA or SIM_ATAPI,Image file,Drive model(NULLなら標準)
+ * return : 0 or -1
+ */
+int sim_attach(int hn,int dn,int type,const char *path,SIM_DRIVE *model)
+{
+	SIM_HOST *h;
+	SIM_DEV *d;
+	off_t size;
+
+
+	if(((uint)hn>1)||((uint)dn>1)||((type!=SIM_ATA)&&(type!=SIM_ATAPI)))return -1;
+
+	/* sim_set_chipsetを呼んでいなければ標準のチップセットにする */
+	if(pci[0x20]==0)sim_set_chipset(chipset);
+
+	h=&host[hn];
+	d=&h->dev[dn];
+	if(d->fp!=NULL)fclose(d->fp);
+	memset(d,0,sizeof(SIM_DEV));
+	if((d->fp=fopen(path,(type==SIM_ATA)?"r+b":"rb"))==NULL)return -1;
+
+	d->type=type;
+	d->model=(model!=NULL)?*model:(type==SIM_ATA)?sim_hdd:sim_cdrom;
+	if(d->model.queue_depth>TAG_MAX)d->model.queue_depth=TAG_MAX;
+	if(d->model.sect_per_track==0)d->model.sect_per_track=1;
+	if(d->model.media_rate==0)d->model.media_rate=1;
+	d->sector_size=(type==SIM_ATA)?512:2048;
+	fseeko(d->fp,0,SEEK_END);
+	size=ftello(d->fp);
+	d->sectors=size/d->sector_size;
+	d->wcache=d->model.write_cache;
+	d->lookahead=1;
+	d->media_tag=-1;
+	make_identify(d);
+
+	/* 電源投入時のシグネチャー */
+	d->tf.count[0]=1;
+	d->tf.lbal[0]=1;
+	d->tf.lbam[0]=(type==SIM_ATAPI)?0x14:0;
+	d->tf.lbah[0]=(type==SIM_ATAPI)?0xeb:0;
+	d->tf.error=1;
+	d->tf.status=(type==SIM_ATAPI)?0:DRDY;
+	if(type==SIM_ATAPI)
+	{
+		d->sense[0]=0x6;
+		d->sense[1]=0x29;
+	}
+
+	h->irq=(hn==0)?IRQ14:IRQ15;
+	h->dma_tag=-1;
+
+	return 0;
+}
+
+
+/*
+ * ATAPIのメディアを入れ替える
+ * 入れたメディアは起動するまでNOT READYになり、unit attentionとメディアイベントで報告する
+ * parameters : Host number,Device number,Image path or NULL(取り出す)
+ * return : 0 or -1
+ */
+int sim_change_media(int hn,int dn,const char *path)
+{
+	SIM_DEV *d;
+	FILE *fp;
+
+
+	if(((uint)hn>1)||((uint)dn>1))return -1;
+	d=&host[hn].dev[dn];
+	if(d->type!=SIM_ATAPI)return -1;
+
+	fp=NULL;
+	if((path!=NULL)&&((fp=fopen(path,"rb"))==NULL))return -1;
+	if(d->fp!=NULL)fclose(d->fp);
+	d->fp=fp;
+	d->ra_valid=0;
+
+	if(fp==NULL)
+	{
+		d->sectors=0;
+		d->media_event=ME_REMOVAL;
+		return 0;
+	}
+	fseeko(fp,0,SEEK_END);
+	d->sectors=ftello(fp)/d->sector_size;
+	d->media_event=ME_NEW;
+	d->ready_time=now+SPIN_UP_NS;
+	d->sense[0]=0x6;
+	d->sense[1]=0x28;
+	d->sense[2]=0;
+
+	return 0;
+}
+
+
+/*
+ * 全てのデバイスを外して、時間を0に戻す
+ */
+void sim_detach()
+{
+	int i,j;
+
+
+	for(i=0;i<2;++i)
+		for(j=0;j<2;++j)
+			if(host[i].dev[j].fp!=NULL)fclose(host[i].dev[j].fp);
+	memset(host,0,sizeof(host));
+	memset(device,0,sizeof(device));
+	memset(irq_entry,0,sizeof(irq_entry));
+	now=0;
+	idle_ns=0;
+	pic_irr=0;
+	pic_mask=(1<<IRQ14)|(1<<IRQ15);
+	sim_set_chipset(chipset);
+}
+
+
+/*
+ * IDEコントローラーのPCI IDを設定する
+ * parameters : Device id|Vender id,0ならPCIのIDEコントローラーなし
+ */
+void sim_set_chipset(uint id)
+{
+	chipset=id;
+	memset(pci,0,sizeof(pci));
+	writedw_pci_config(0,31,1,0x8,0x01018a00);	/* IDE,Bus master */
+	pci[0x40]=pci[0x42]=0;
+	pci[0x41]=pci[0x43]=0x80;					/* IDE decode enable */
+}
+
+
+/*
+ * レジスターアクセス時間
+ * parameters : ns
+ */
+void sim_set_io_cost(uint ns)
+{
+	io_cost=ns;
+}
+
+
+uint64 sim_time()
+{
+	return now;
+}
+
+
+/*
+ * wait_intrで寝ていた時間
+ * sim_time()から引けばCPUがドライバーを実行していた時間になる
+ */
+uint64 sim_idle_time()
+{
+	return idle_ns;
+}
+
+
+void sim_get_stat(int hn,int dn,SIM_STAT *stat)
+{
+	*stat=host[hn&1].dev[dn&1].stat;
+}
+
+
+/*
+ * regist_deviceで登録されたデバイスを名前で探す
+ * parameters : Device name
+ * return : DEV_INFO or NULL
+ */
+DEV_INFO *sim_device(const char *name)
+{
+	int i;
+
+
+	for(i=0;(i<8)&&(device[i]!=NULL);++i)
+		if(strcmp(device[i]->name,name)==0)return device[i];
+	return NULL;
+}
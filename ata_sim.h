@@ -0,0 +1,197 @@
+/*
+ * ata_sim.h
+ *
+ * Copyright 2002, Minoru Murashima. All rights reserved.
+ * Distributed under the terms of the BSD License.
+ *
+ * ATA controller simulator
+ * ATA_SIMを定義してata.cをコンパイルすると、カーネルのヘッダーの代わりにこのヘッダーを使い、
+ * ポートIO、PCI、割り込み、タイマーをata_sim.cのシミュレーターにつなぐ。
+ *
+ * gcc -m32 -DATA_SIM -c ata.c ata_sim.c
+ */
+
+
+#ifndef ata_sim_h
+#define ata_sim_h
+
+
+#include<stddef.h>
+
+
+/************************************************************************************************
+ *
+ * Kernel interface
+ *
+ ************************************************************************************************/
+
+
+typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef unsigned int uint;
+typedef unsigned long long uint64;
+
+typedef struct PROC PROC;
+
+/* 割り込み待ち */
+typedef struct{
+	PROC *proc;
+	volatile int flag;		/* 1=起こされた,-1=タイムアウト */
+}WAIT_INTR;
+
+/* プロセス待ちキュー,シミュレーターでは1プロセスなのでロックとして使う */
+typedef struct{
+	PROC *next;
+	PROC *prev;
+	int count;
+	int lock;
+}WAIT_QUEUE;
+
+/* Device infomation */
+typedef struct{
+	const char *name;
+	uint last_blk;
+	int sector_size;
+	int flag;
+	int (*open)();
+	int (*read)(void*,size_t,size_t);
+	int (*write)(void*,size_t,size_t);
+	int (*ioctl)(int,void*);
+}DEV_INFO;
+
+/* PCI device */
+typedef struct{
+	int bus;
+	int dev;
+	int func;
+	uint vender;		/* Device id|Vender id */
+}PCI_INFO;
+
+/* Error number */
+enum{
+	EINVAL=1,
+	ENOMEM,
+	ENOSYS,
+	ENODEV,
+	EDBUSY,
+	EDERRE,
+	ETIMEOUT,
+	ENOMEDIUM,
+};
+
+enum{
+	IRQ14=14,
+	IRQ15=15,
+
+	PCI_CLS_IDE=0x0101,		/* Mass storage,IDE */
+	PCI_CONF_COM=0x4,		/* Command register */
+	PCI_COM_BM_BIT=0x4,		/* Bus master enable */
+};
+
+#define ROUNDDOWN(a,b)	((a)/(b)*(b))
+#define ROUNDUP(a,b)	(((a)+(b)-1)/(b)*(b))
+#define PRINT_ERR(error,func)	sim_error((error),(func))
+
+extern int MFPS_addres;
+extern uint64 clock_1m;
+extern int (*irq_entry[])();
+
+extern uchar inb(int);
+extern void outb(int,uchar);
+extern ushort inw(int);
+extern void outw(int,ushort);
+extern uint indw(int);
+extern void outdw(int,uint);
+extern uint64 rdtsc();
+extern void set_irq_mask(int);
+extern void release_irq_mask(int);
+extern void set_intr_cpu(int,int);
+extern int get_current_cpu();
+extern void mili_timer(int);
+extern void micro_timer(int);
+extern void wait_intr(WAIT_INTR*,int);
+extern void wake_intr(WAIT_INTR*);
+extern void wait_proc(WAIT_QUEUE*);
+extern void wake_proc(WAIT_QUEUE*);
+extern void *kmalloc(size_t);
+extern void kfree(void*);
+extern int search_pci_class(int,PCI_INFO*);
+extern uint read_pci_config(int,int,int,int);
+extern void writeb_pci_config(int,int,int,int,uchar);
+extern void writew_pci_config(int,int,int,int,ushort);
+extern void writedw_pci_config(int,int,int,int,uint);
+extern int regist_device(DEV_INFO*);
+extern int printk(const char*,...);
+extern void *memset(void*,int,size_t);
+extern void *memcpy(void*,const void*,size_t);
+
+/* ata.cのインラインアセンブラの代わり */
+extern uint sim_cli();
+extern void sim_sti(uint);
+extern void sim_in_pio(int,void*,int,int);
+extern void sim_out_pio(int,void*,int,int);
+extern int sim_error(int,const char*);
+
+
+/************************************************************************************************
+ *
+ * Simulator control
+ *
+ ************************************************************************************************/
+
+
+enum{
+	SIM_ATA=1,				/* ATA disk */
+	SIM_ATAPI=2,			/* ATAPI CD-ROM */
+	SIM_CPU_MHZ=1000,		/* rdtsc clock,1clock=1ns */
+};
+
+/* Drive model */
+typedef struct{
+	uint rpm;				/* Rotation per minute,0なら回転待ちもシークもない */
+	uint sect_per_track;	/* Sectors per track */
+	uint seek_min;			/* Track to track seek us */
+	uint seek_max;			/* Full stroke seek us */
+	uint media_rate;		/* Media transfer KB/s */
+	uint overhead;			/* Command overhead us */
+	uint cache_sect;		/* 先読みとライトキャッシュのセクター数 */
+	uint udma;				/* 対応するULTRA DMAモードのビット */
+	uint queue_depth;		/* TCQのキューの深さ,0ならTCQ未対応 */
+	int write_cache;		/* 電源投入時のライトキャッシュ 1=有効 */
+	int cable80;			/* 80芯ケーブル */
+	uint crc_every;			/* UDMA3以上でこの回数ごとにCRCエラー,0ならエラーなし */
+	int overlap;			/* ATAPIのoverlapしたパケットコマンド,シーク中はバスを解放する */
+}SIM_DRIVE;
+
+/* Drive statistics */
+typedef struct{
+	uint command;			/* Commands */
+	uint64 read_sect;		/* Read sectors */
+	uint64 write_sect;		/* Written sectors */
+	uint seek;				/* Seeks */
+	uint64 seek_time;		/* Total seek ns */
+	uint64 rot_time;		/* Total rotational latency ns */
+	uint64 media_time;		/* Total media transfer ns */
+	uint64 bus_time;		/* Total interface transfer ns */
+	uint ra_hit;			/* 先読みバッファーで済んだ読み込み */
+	uint flush;				/* Flush cache commands */
+	uint crc_error;			/* 起こしたCRCエラー */
+}SIM_STAT;
+
+extern SIM_DRIVE sim_hdd;		/* 7200rpmのATA100ディスク */
+extern SIM_DRIVE sim_cdrom;		/* 24倍速CD-ROM */
+extern int sim_verbose;			/* printkとエラーを表示する */
+extern uint sim_wake_ns;		/* wait_intrで寝たプロセスが起きて動き出すまでのns */
+
+extern int sim_attach(int,int,int,const char*,SIM_DRIVE*);
+extern void sim_detach();
+extern int sim_change_media(int,int,const char*);
+extern void sim_set_chipset(uint);
+extern void sim_set_io_cost(uint);
+extern uint64 sim_time();
+extern uint64 sim_idle_time();
+extern void sim_get_stat(int,int,SIM_STAT*);
+extern DEV_INFO *sim_device(const char*);
+
+
+#endif